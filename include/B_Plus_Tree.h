@@ -2,66 +2,153 @@
 #define B_PLUS_TREE_H
 #include <uuid/uuid.h>
 
+#include <algorithm>
+#include <cassert>
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <fstream>
+#include <future>
 #include <iostream>
 #include <iterator>
 #include <memory>
 #include <mutex>
+#include <numeric>
+#include <optional>
 #include <queue>
 #include <shared_mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "CompactFile.h"
+#include "KeySearch.h"
+#include "Latch.h"
+#include "NodeArray.h"
+#include "PageFile.h"
+#include "WriteAheadLog.h"
 #include "bplustree.pb.h"
 using namespace std;
 
 #define NDEBUG
 
+template <typename T, size_t Degree = 0>
+class BNode;
+
+/* 后台快照开始那一刻节点的内容 */
+template <typename T, size_t Degree>
+struct NodeImage {
+  bool isLeaf = false;
+  size_t level = 0;
+  vector<T> keys;
+  /* 叶子的值 */
+  vector<uint64_t> values;
+  /* 内部节点的孩子 */
+  vector<BNode<T, Degree> *> children;
+  /* 叶子的左右兄弟 */
+  BNode<T, Degree> *next = nullptr;
+  BNode<T, Degree> *prev = nullptr;
+};
+
+/**
+ * @brief 进行中的后台快照
+ * 快照开始后，节点第一次被改之前先存下原来的内容；写快照的线程遇到改过的节点用存下的内容，
+ * 没改过的节点直接读，拼起来就是快照开始那一刻的树
+ */
+template <typename T, size_t Degree>
+class SnapshotState {
+ public:
+  explicit SnapshotState(const uint64_t &epoch) : _epoch(epoch) {}
+  SnapshotState(const SnapshotState &) = delete;
+  SnapshotState &operator=(const SnapshotState &) = delete;
+
+  uint64_t epoch() const { return _epoch; }
+
+  /* 存下节点现在的内容，持有节点写锁调用 */
+  void preserve(BNode<T, Degree> *node);
+
+  /* 节点存下的内容，没存过返回nullptr */
+  const NodeImage<T, Degree> *find(BNode<T, Degree> *node) {
+    lock_guard<mutex> lock(_mutex);
+    auto it = _images.find(node);
+    return it == _images.end() ? nullptr : &it->second;
+  }
+
+ private:
+  const uint64_t _epoch;
+  mutex _mutex;
+  unordered_map<BNode<T, Degree> *, NodeImage<T, Degree>> _images;
+};
+
+/* 当前线程正在修改的树上进行中的快照，由写操作进出时设置 */
+template <typename T, size_t Degree>
+thread_local SnapshotState<T, Degree> *snapshotInProgress = nullptr;
+
 // ---------------------------B+树的类-------------------------
 /**
  * @brief B+树节点基类
  * @tparam T 关键字类型，目前仅支持整型和string类型
  */
-template <typename T>
-class BNode {
+template <typename T, size_t Degree>
+class BNode : public KeyIndex<T> {
   typedef typename vector<T>::size_type size_type;
 
  public:
-  BNode() : _keyNum(0), _isLeaf(false) {}
-  BNode(bool isLeaf) : _keyNum(0), _isLeaf(isLeaf) {}
-  BNode(const BNode<T> &bnode)
-      : _keyNum(bnode._keyNum), _isLeaf(bnode._isLeaf), _key(bnode._key) {}
+  /* keys是子类在同一次分配里留给关键字的空间，后面紧跟着关键字索引的空间 */
+  BNode(bool isLeaf, T *keys, const size_type &capacity)
+      : KeyIndex<T>(keys, capacity),
+        _keyNum(0),
+        _isLeaf(isLeaf),
+        _key(keys, capacity),
+        _level(0) {}
+  BNode(const BNode<T, Degree> &bnode) = delete;
   /*序列化的构造函数*/
-  BNode(const bplustree::BNode &pb_bnode)
-      : _keyNum(pb_bnode._keynum()),
+  BNode(const bplustree::BNode &pb_bnode, T *keys, const size_type &capacity)
+      : KeyIndex<T>(keys, capacity),
+        _keyNum(pb_bnode._keynum()),
         _isLeaf(pb_bnode._isleaf()),
-        _key(begin(pb_bnode._key()), end(pb_bnode._key())) {
+        _key(keys, capacity, begin(pb_bnode._key()), end(pb_bnode._key())),
+        _level(0) {
     char str[36];
     strncpy(str, pb_bnode._uuid().c_str(), 36);
     uuid_parse(str, _uuid);
   }
-  virtual ~BNode() { _mutex.unlock(); }
+  virtual ~BNode() {}
 
   /**
    * @brief 分裂用的特殊构造函数
    * @param SIZE 从_key的多少位开始
    * */
-  BNode(BNode<T> *bnode, const size_type &SIZE)
-      : _isLeaf(bnode->isLeaf()),
-        _key(bnode->_key.begin() + SIZE, bnode->_key.end()) {
+  BNode(BNode<T, Degree> *bnode, const size_type &SIZE, T *keys,
+        const size_type &capacity)
+      : KeyIndex<T>(keys, capacity),
+        _isLeaf(bnode->isLeaf()),
+        _key(keys, capacity, bnode->_key.begin() + SIZE, bnode->_key.end()),
+        _level(bnode->_level) {
     updateKeyNum();
   }
 
   /* 获取关键字数量 */
   size_type getKeyNum() const { return _keyNum; }
 
-  /* 更新关键字数量 */
-  void updateKeyNum() { _keyNum = _key.size(); }
+  /* 关键字改动后更新关键字数量和索引 */
+  void updateKeyNum() {
+    _keyNum = _key.size();
+    this->rebuild(_key.begin(), _keyNum);
+  }
+
+  /* 度数，编译期给定Degree时是常量，为0时用运行时传入的MAX_SIZE */
+  static constexpr size_type degree(const size_type &MAX_SIZE) {
+    return Degree ? Degree : MAX_SIZE;
+  }
+  /* 非根节点至少要有的关键字数，即ceil(MAX_SIZE / 2) - 1 */
+  static constexpr size_type minKeyNum(const size_type &MAX_SIZE) {
+    return (degree(MAX_SIZE) + 1) / 2 - 1;
+  }
 
   /**
   * @brief 是否是安全节点
@@ -69,9 +156,9 @@ class BNode {
                 true -----插入
   */
   bool isSafe(const size_type &MAX_SIZE, bool type) {
-    if (type && _keyNum < MAX_SIZE - 1) {
+    if (type && _keyNum < degree(MAX_SIZE) - 1) {
       return true;
-    } else if (!type && _keyNum > ceil(1.0 * MAX_SIZE / 2) - 1) {
+    } else if (!type && _keyNum > minKeyNum(MAX_SIZE)) {
       return true;
     }
     return false;
@@ -80,12 +167,70 @@ class BNode {
   /* 是否是叶子节点 */
   const bool isLeaf() const { return _isLeaf; }
 
-  /* 插入关键字 */
-  virtual void insertKey(const pair<T, uint64_t> &kv, const size_type &MAX_SIZE,
-                         deque<shared_mutex *> &q_w_lock) = 0;
-  /* 删除关键字 */
+  /* 所在层，叶子为0 */
+  size_type getLevel() const { return _level; }
+
+  /* 右兄弟 */
+  virtual BNode<T, Degree> *getRight() const = 0;
+
+  /**
+   * @brief 分裂出右半边作为新的右兄弟
+   * 只需要锁住本节点，新节点挂到父节点上之前靠右链和高键找到
+   * @return 新节点和上推的关键字
+   */
+  virtual pair<BNode<T, Degree> *, T> splitRight(const size_type &MAX_SIZE) = 0;
+
+  /**
+   * @brief k落在右兄弟时返回右兄弟
+   * 分裂出的新节点还没挂到父节点上，或者按旧的父节点走到这里时，k都可能在右边
+   * @param forSearch 查找时等于高键向右走，插入时向左走
+   */
+  BNode<T, Degree> *moveRight(const T &k, const bool &forSearch) const {
+    BNode<T, Degree> *right = getRight();
+    if (right && (forSearch ? !(k < _highKey) : _highKey < k)) {
+      return right;
+    }
+    return nullptr;
+  }
+
+  /* k比低键小，不在本节点也不在右边，是按旧的父节点走过来的，要从根重来 */
+  bool belowLowKey(const T &k) const { return _hasLowKey && k < _lowKey; }
+
+  /* 获取高键 */
+  T getHighKey() const { return _highKey; }
+  /* 设置高键、低键，调用前持有本节点写锁 */
+  void setHighKey(const T &key) { _highKey = key; }
+  void setLowKey(const T &key) {
+    _lowKey = key;
+    _hasLowKey = true;
+  }
+
+  /* 右兄弟是否还没挂到父节点上，和节点内容一样受版本号保护 */
+  bool isRightPending() const { return _rightPending; }
+  void setRightPending(const bool &pending) { _rightPending = pending; }
+
+  /* 增量检查点用：节点在检查点文件里的页号，还没写过为0 */
+  page_id getPageId() const { return _pageId; }
+  void setPageId(const page_id &id) { _pageId = id; }
+  /* 上次检查点之后页内容是否改过 */
+  bool isDirty() const { return _dirty; }
+  /* 持有写锁、改页内容之前调用；有进行中的快照时先存下快照开始时的内容 */
+  void markDirty() {
+    _dirty = true;
+    SnapshotState<T, Degree> *snapshot = snapshotInProgress<T, Degree>;
+    if (snapshot && _snapshotEpoch != snapshot->epoch()) {
+      snapshot->preserve(this);
+      _snapshotEpoch = snapshot->epoch();
+    }
+  }
+  void clearDirty() { _dirty = false; }
+  /* 节点在哪次快照里存过内容或者是哪次快照开始后新建的 */
+  uint64_t getSnapshotEpoch() const { return _snapshotEpoch; }
+
+  /* 删除关键字，deleted带回叶子里是否真的删了 */
   virtual T deleteKey(const T &k, const size_type &MAX_SIZE,
-                      deque<shared_mutex *> &q_w_lock, bool &hasNewKey) = 0;
+                      deque<OptLock *> &q_w_lock, bool &hasNewKey,
+                      bool &deleted) = 0;
 
   /* 在该节点中添加关键字 */
   size_type addKey(const T &k) {
@@ -105,66 +250,39 @@ class BNode {
     return deleteIndex;
   }
 
-  /* 获取插入的关键字位置 */
+  /* 获取插入的关键字位置，整型关键字和string的键头走SIMD */
   size_type getInsertIndex(const T &k) const {
-    size_type l = 0;
-    size_type r = _keyNum;
-    size_type mid = (l + r) / 2;
-    while (l < r) {
-      mid = (l + r) / 2;
-      if (_key[mid] < k) {
-        l = mid + 1;
-      } else {
-        r = mid;
-      }
-    }
-    return l;
+    return this->lowerBound(_key.begin(), _keyNum, k);
   }
 
-  /* 找关键字的Index */
+  /* 找关键字的Index，没有返回_keyNum */
   size_type getKeyIndex(const T &k) const {
-    size_type l = 0;
-    size_type r = _keyNum;
-    size_type mid = (l + r) / 2;
-    while (l <= r) {
-      mid = (l + r) / 2;
-      if (mid == _keyNum) {
-        break;
-      }
-      if (_key[mid] == k) {
-        return mid;
-      } else if (_key[mid] < k) {
-        l = mid + 1;
-      } else {
-        if (mid) {
-          r = mid - 1;
-        } else {
-          break;
-        }
-      }
+    size_type index = getInsertIndex(k);
+    if (index < _keyNum && _key[index] == k) {
+      return index;
     }
     return _keyNum;
   }
 
-  /* 查找关键字 */
-  virtual pair<T, uint64_t *> searchKey(
-      const T &k, shared_lock<shared_mutex> &last_lock) = 0;
-  /* 范围查询关键字 */
-  virtual void searchKeyForRange(const T &l, const T &r,
-                                 vector<pair<T, uint64_t>> &seq,
-                                 const bool &continueFlag = false,
-                                 bool test = false) = 0;
+  /* 查找关键字，返回值的拷贝 */
+  virtual optional<uint64_t> searchKey(const T &k,
+                                       shared_lock<OptLock> &last_lock) = 0;
   /* 输出所有关键字 */
   virtual void outputAllKeys(vector<T> &seq, bool test = false) = 0;
   /* 关键字分裂 */
   virtual void keySplit(const bool &isLeft, const size_type &MAX_SIZE) = 0;
   /* 获取关键字 */
   T getKey(const size_type &index) const { return _key[index]; }
+  /* 替换关键字，调用前持有本节点写锁并已markDirty */
+  void setKey(const size_type &index, const T &key) {
+    _key[index] = key;
+    updateKeyNum();
+  }
   /* 借关键字 */
-  virtual T borrowKey(BNode<T> *const &silbing, const bool &isRight,
+  virtual T borrowKey(BNode<T, Degree> *const &silbing, const bool &isRight,
                       const T &key) = 0;
   /* 获取关键字数组 */
-  vector<T> getAllKeys() const { return _key; }
+  const NodeArray<T> &getAllKeys() const { return _key; }
   /* 序列化 */
   virtual void Serialize(string dir) = 0;
   /* 获取uuid */
@@ -177,14 +295,28 @@ class BNode {
   /* 设置uuid */
   void setUUID(uuid_t &uuid) { uuid_copy(_uuid, uuid); }
   /* 获取锁 */
-  shared_mutex &getMutex() { return _mutex; }
+  OptLock &getMutex() { return _mutex; }
 
  protected:
   size_type _keyNum;
   const bool _isLeaf;
-  vector<T> _key;
+  NodeArray<T> _key;
   uuid_t _uuid = "";
-  shared_mutex _mutex;
+  OptLock _mutex;
+  size_type _level;
+  /* 高键：和右兄弟之间的分隔关键字，有右兄弟时有效 */
+  T _highKey{};
+  /* 低键：和左兄弟之间的分隔关键字，同一层最左边的节点没有 */
+  T _lowKey{};
+  bool _hasLowKey = false;
+  bool _rightPending = false;
+  page_id _pageId = INVALID_PAGE;
+  /* 新节点还没写进检查点 */
+  bool _dirty = true;
+  /* 快照开始后新建的节点不在快照里，不用存内容 */
+  uint64_t _snapshotEpoch = snapshotInProgress<T, Degree>
+                                ? snapshotInProgress<T, Degree>->epoch()
+                                : 0;
 };
 
 /**
@@ -193,31 +325,68 @@ class BNode {
  *
  *
  */
-template <typename T = int>
-class LeafBNode : public BNode<T> {
+template <typename T = int, size_t Degree = 0>
+class LeafBNode : public BNode<T, Degree> {
   typedef typename vector<T>::size_type size_type;
+  using BNode<T, Degree>::degree;
 
  public:
-  LeafBNode() : BNode<T>(true), _next(nullptr), _prev(nullptr){};
-  LeafBNode(const LeafBNode &leafbnode)
-      : BNode<T>(leafbnode),
-        _next(leafbnode._next),
-        _prev(leafbnode._prev),
-        _value(leafbnode._value) {}
+  /**
+   * @brief 节点头、关键字数组、值数组在一次分配里，用 new (MAX_SIZE) 创建
+   * 布局：[LeafBNode][MAX_SIZE+1个关键字][关键字索引][MAX_SIZE+1个值]
+   */
+  static void *operator new(size_t size, const size_type &MAX_SIZE) {
+    return ::operator new(allocSize(MAX_SIZE), align_val_t(CACHE_LINE));
+  }
+  static void operator delete(void *ptr) {
+    ::operator delete(ptr, align_val_t(CACHE_LINE));
+  }
+  static void operator delete(void *ptr, const size_type &MAX_SIZE) {
+    ::operator delete(ptr, align_val_t(CACHE_LINE));
+  }
+  static void *operator new(size_t size) = delete;
+
+  /* 预取节点头和二分第一次访问的关键字，只按地址算，不读节点 */
+  static void prefetch(const LeafBNode *node, const size_type &MAX_SIZE) {
+    const char *base = reinterpret_cast<const char *>(node);
+    for (size_t offset = 0; offset < keyOffset(); offset += CACHE_LINE) {
+      __builtin_prefetch(base + offset);
+    }
+    __builtin_prefetch(base + keyOffset() + sizeof(T) * (degree(MAX_SIZE) / 2));
+  }
+
+  /* 预取整个节点：节点头、关键字数组和值数组 */
+  static void prefetchWhole(const LeafBNode *node, const size_type &MAX_SIZE) {
+    const char *base = reinterpret_cast<const char *>(node);
+    for (size_t offset = 0; offset < allocSize(MAX_SIZE);
+         offset += CACHE_LINE) {
+      __builtin_prefetch(base + offset);
+    }
+  }
+
+  LeafBNode(const size_type &MAX_SIZE)
+      : BNode<T, Degree>(true, keyStorage(this), degree(MAX_SIZE) + 1),
+        _next(nullptr),
+        _prev(nullptr),
+        _value(valueStorage(this, MAX_SIZE), degree(MAX_SIZE) + 1) {}
+  LeafBNode(const LeafBNode &leafbnode) = delete;
 
   /* 分裂用的特殊构造函数 */
   LeafBNode(LeafBNode *&leafbnode, const size_type &MAX_SIZE)
-      : BNode<T>(leafbnode, MAX_SIZE / 2),
+      : BNode<T, Degree>(leafbnode, degree(MAX_SIZE) / 2, keyStorage(this),
+                         degree(MAX_SIZE) + 1),
         _next(leafbnode->_next),
         _prev(leafbnode),
-        _value(leafbnode->_value.begin() + MAX_SIZE / 2,
+        _value(valueStorage(this, MAX_SIZE), degree(MAX_SIZE) + 1,
+               leafbnode->_value.begin() + degree(MAX_SIZE) / 2,
                leafbnode->_value.end()) {}
   /*序列化的构造函数*/
-  LeafBNode(const bplustree::BNode &pb_bnode)
-      : BNode<T>(pb_bnode), _next(nullptr), _prev(nullptr) {
-    for (int i = 0; i < pb_bnode._value_size(); ++i) {
-      _value.push_back(new uint64_t(pb_bnode._value(i)));
-    }
+  LeafBNode(const bplustree::BNode &pb_bnode, const size_type &MAX_SIZE)
+      : BNode<T, Degree>(pb_bnode, keyStorage(this), degree(MAX_SIZE) + 1),
+        _next(nullptr),
+        _prev(nullptr),
+        _value(valueStorage(this, MAX_SIZE), degree(MAX_SIZE) + 1,
+               begin(pb_bnode._value()), end(pb_bnode._value())) {
     // if (pb_bnode.has__next()) {
     //   string next = pb_bnode._next();
     //   ifstream fr;
@@ -227,7 +396,7 @@ class LeafBNode : public BNode<T> {
     //     fr >> str;
     //     bplustree::BNode pb_bnode;
     //     pb_bnode.ParseFromString(str);
-    //     _next = new LeafBNode<T>(pb_bnode, this);
+    //     _next = new LeafBNode<T, Degree>(pb_bnode, this);
     //     fr.close();
     //   } else {
     //     cerr << "open error:" << next << endl;
@@ -235,18 +404,14 @@ class LeafBNode : public BNode<T> {
     // }
     // _prev = prev;
   }
-  ~LeafBNode() {
-    for (auto &value : _value) {
-      delete value;
-      value = nullptr;
-    }
-  }
+  ~LeafBNode() {}
 
   /* 获取右兄弟 */
   LeafBNode *getNext() const { return _next; }
 
   /* 设置新的右兄弟，返回旧的 */
   LeafBNode *setNext(LeafBNode *const &leafnode) {
+    this->markDirty();
     LeafBNode *old = _next;
     _next = leafnode;
     return old;
@@ -257,59 +422,111 @@ class LeafBNode : public BNode<T> {
 
   /* 设置新的左兄弟，返回旧的 */
   LeafBNode *setPrev(LeafBNode *const &leafnode) {
+    this->markDirty();
     LeafBNode *old = _prev;
     _prev = leafnode;
     return old;
   }
 
   /* 搜索关键字 */
-  pair<T, uint64_t *> searchKey(const T &k,
-                                shared_lock<shared_mutex> &last_lock) override {
+  optional<uint64_t> searchKey(const T &k,
+                               shared_lock<OptLock> &last_lock) override {
+    return findValue(k);
+  }
+
+  /* 找关键字对应的值，没有返回空 */
+  optional<uint64_t> findValue(const T &k) const {
     size_type keyindex = this->getKeyIndex(k);
     if (this->_keyNum != keyindex) {
-      return make_pair(k, _value[keyindex]);
+      return _value[keyindex];
     }
-    return make_pair(k, nullptr);
+    return nullopt;
   }
 
-  /* 插入关键字 */
-  void insertKey(const pair<T, uint64_t> &kv, const size_type &MAX_SIZE,
-                 deque<shared_mutex *> &q_w_lock) override {
-    //当前节点是安全的，解锁之前的所有节点
-    if (this->isSafe(MAX_SIZE, true)) {
-      while (q_w_lock.size() != 1) {
-        q_w_lock.front()->unlock();
-        q_w_lock.pop_front();
-      }
+  /**
+   * @brief 修改关键字对应的值，w_lock是本节点的写锁
+   * @param onUpdate 改完后还拿着写锁时调用，用来记日志
+   */
+  template <typename Func>
+  bool updateValue(const T &k, const uint64_t &value,
+                   unique_lock<OptLock> &w_lock, Func onUpdate) {
+    size_type keyindex = this->getKeyIndex(k);
+    if (this->_keyNum == keyindex) {
+      return false;
+    }
+    this->markDirty();
+    _value[keyindex] = value;
+    onUpdate();
+    return true;
+  }
+
+  BNode<T, Degree> *getRight() const override { return _next; }
+
+  /* 分裂出右半边，调用前持有本节点写锁 */
+  pair<BNode<T, Degree> *, T> splitRight(const size_type &MAX_SIZE) override {
+    this->markDirty();
+    LeafBNode *self = this;
+    LeafBNode *newNode = new (MAX_SIZE) LeafBNode(self, MAX_SIZE);
+    newNode->_highKey = this->_highKey;
+    newNode->_rightPending = this->_rightPending;
+    if (_next) {
+      lock_guard<OptLock> w_lock(_next->getMutex());
+      _next->setPrev(newNode);
     }
+    _next = newNode;
+    keySplit(true, MAX_SIZE);
+    this->_highKey = newNode->getKey(0);
+    newNode->setLowKey(this->_highKey);
+    this->_rightPending = true;
+    return make_pair(newNode, this->_highKey);
+  }
+
+  /* 在末尾追加键值对，批量建树时用，调用者保证有序 */
+  void appendKeyValue(const pair<T, uint64_t> &kv) {
+    this->_key.push_back(kv.first);
+    this->updateKeyNum();
+    _value.push_back(kv.second);
+  }
+
+  /* 在该节点中添加键值对 */
+  void addKeyValue(const pair<T, uint64_t> &kv) {
+    this->markDirty();
     size_type insertIndex = this->addKey(kv.first);
-    uint64_t *p_v = new uint64_t(kv.second);
-    _value.insert(_value.begin() + insertIndex, p_v);
+    _value.insert(_value.begin() + insertIndex, kv.second);
+  }
+
+  /* 删除第index个键值对 */
+  void eraseKeyValue(const size_type &index) {
+#ifndef NDEBUG
+    cout << "----------------已删除<" << this->_key[index] << ", "
+         << _value[index] << ">-------------" << endl;
+#endif
+    this->markDirty();
+    this->_key.erase(this->_key.begin() + index);
+    this->updateKeyNum();
+    _value.erase(_value.begin() + index);
   }
 
   /* 删除关键字 */
   T deleteKey(const T &k, const size_type &MAX_SIZE,
-              deque<shared_mutex *> &q_w_lock, bool &hasNewKey) override {
+              deque<OptLock *> &q_w_lock, bool &hasNewKey,
+              bool &deleted) override {
     if (!hasNewKey && this->isSafe(MAX_SIZE, false)) {
       while (q_w_lock.size() != 1) {
         q_w_lock.front()->unlock();
         q_w_lock.pop_front();
       }
     }
-    size_type removeIndex = this->removeKey(k);
-    if (removeIndex != _value.size()) {
-#ifndef NDEBUG
-      cout << "----------------已删除<" << k << ", " << *_value[removeIndex]
-           << ">-------------" << endl;
-#endif
-      delete _value[removeIndex];
-      _value.erase(_value.begin() + removeIndex);
+    size_type removeIndex = this->getKeyIndex(k);
+    deleted = removeIndex != this->_keyNum;
+    if (deleted) {
+      eraseKeyValue(removeIndex);
       //返回更新的关键字
       if (hasNewKey) {
         if (removeIndex < this->_keyNum) {
           return this->_key[removeIndex];
         } else if (_next) {
-          shared_lock<shared_mutex> r_lock(_next->getMutex());
+          shared_lock<OptLock> r_lock(_next->getMutex());
           return _next->getKey(0);
         }
       }
@@ -327,52 +544,33 @@ class LeafBNode : public BNode<T> {
       cout << " [";
       for (size_type i = 0; i < this->_keyNum; ++i) {
         seq.push_back(this->_key[i]);
-        cout << " <" << this->_key[i] << ", " << *_value[i] << ">";
+        cout << " <" << this->_key[i] << ", " << _value[i] << ">";
       }
       cout << " ]";
     }
   }
 
-  /* 范围查询关键字 */
-  void searchKeyForRange(const T &l, const T &r, vector<pair<T, uint64_t>> &seq,
-                         const bool &continueFlag = false,
-                         bool test = false) override {
-    size_type index = 0;
-    if (!continueFlag) {
-      index = this->getInsertIndex(l);
-    }
-
-    while (index < this->_keyNum && this->_key[index] < r) {
-      seq.push_back(make_pair(this->_key[index], *_value[index]));
-      if (!test) {
-        cout << " <" << this->_key[index] << ", " << *_value[index] << ">";
-      }
-      ++index;
-    }
-    this->_mutex.unlock_shared();
-    if (_next && index == this->_keyNum) {
-      _next->getMutex().lock_shared();
-      _next->searchKeyForRange(l, r, seq, true, test);
-    }
-  }
-
   /* 分裂关键字和值 */
   void keySplit(const bool &isLeft, const size_type &MAX_SIZE) override {
+    this->markDirty();
     if (isLeft) {
-      this->_key.erase(this->_key.begin() + MAX_SIZE / 2, this->_key.end());
-      _value.erase(_value.begin() + MAX_SIZE / 2, _value.end());
+      this->_key.erase(this->_key.begin() + degree(MAX_SIZE) / 2,
+                       this->_key.end());
+      _value.erase(_value.begin() + degree(MAX_SIZE) / 2, _value.end());
     } else {
-      this->_key.erase(this->_key.begin(), this->_key.begin() + MAX_SIZE / 2);
-      _value.erase(_value.begin(), _value.begin() + MAX_SIZE / 2);
+      this->_key.erase(this->_key.begin(),
+                       this->_key.begin() + degree(MAX_SIZE) / 2);
+      _value.erase(_value.begin(), _value.begin() + degree(MAX_SIZE) / 2);
     }
     this->updateKeyNum();
   }
 
   /* 借关键字 */
-  T borrowKey(BNode<T> *const &silbing, const bool &isRight,
+  T borrowKey(BNode<T, Degree> *const &silbing, const bool &isRight,
               const T &key) override {
-    pair<T, uint64_t *> data =
-        static_cast<LeafBNode<T> *>(silbing)->provideKey(isRight);
+    pair<T, uint64_t> data =
+        static_cast<LeafBNode<T, Degree> *>(silbing)->provideKey(isRight);
+    this->markDirty();
     if (isRight) {
       this->_key.push_back(data.first);
       this->updateKeyNum();
@@ -387,9 +585,10 @@ class LeafBNode : public BNode<T> {
   }
 
   /* 提供借出的关键字及数据 */
-  pair<T, uint64_t *> provideKey(const bool isRight) {
+  pair<T, uint64_t> provideKey(const bool isRight) {
+    this->markDirty();
     T key;
-    uint64_t *value;
+    uint64_t value;
     if (isRight) {
       key = this->_key[0];
       this->_key.erase(this->_key.begin());
@@ -408,22 +607,22 @@ class LeafBNode : public BNode<T> {
 #endif
     return make_pair(key, value);
   }
-  /* 获取值指针的数组*/
-  vector<uint64_t *> getAllValues() { return _value; }
+  /* 获取值的数组 */
+  const NodeArray<uint64_t> &getAllValues() const { return _value; }
   /* 合并关键字 */
-  void mergeKeys(vector<T> &&keys) noexcept {
+  void mergeKeys(const NodeArray<T> &keys) noexcept {
     this->_key.insert(this->_key.end(), keys.begin(), keys.end());
     this->updateKeyNum();
   }
   /* 合并值 */
-  void mergeValues(vector<uint64_t *> &&values) noexcept {
+  void mergeValues(const NodeArray<uint64_t> &values) noexcept {
     _value.insert(_value.end(), values.begin(), values.end());
   }
-  /* 合并时，value移动后清空value的vector，以免析构的时候把值清了*/
+  /* 合并时，value移动后清空value的vector */
   void clearValues() { _value.clear(); }
   uint64_t getValue(size_type &index) {
     if (index < this->_keyNum) {
-      return *_value[index];
+      return _value[index];
     } else {
       cerr << "读value越界" << endl;
       return 0;
@@ -456,8 +655,11 @@ class LeafBNode : public BNode<T> {
     string name(begin(str), end(str));
     pb_bnode.set__uuid(name);
     for (size_t i = 0; i < this->_keyNum; ++i) {
-      pb_bnode.add__key(this->_key[i]);
-      pb_bnode.add__value(*_value[i]);
+      //protobuf的关键字是int32，string的树不走这里，见serializeAll
+      if constexpr (is_integral<T>::value) {
+        pb_bnode.add__key(this->_key[i]);
+      }
+      pb_bnode.add__value(_value[i]);
     }
     ofstream fw;
     fw.open(dir + name, ios::out | ios::binary);
@@ -472,110 +674,159 @@ class LeafBNode : public BNode<T> {
   }
 
  private:
+  static size_t keyOffset() {
+    return alignUp(sizeof(LeafBNode), alignof(T));
+  }
+  static size_t valueOffset(const size_type &MAX_SIZE) {
+    return alignUp(keyOffset() + sizeof(T) * (degree(MAX_SIZE) + 1) +
+                       KeyIndex<T>::storageSize(degree(MAX_SIZE) + 1),
+                   alignof(uint64_t));
+  }
+  static size_t allocSize(const size_type &MAX_SIZE) {
+    return valueOffset(MAX_SIZE) + sizeof(uint64_t) * (degree(MAX_SIZE) + 1);
+  }
+  /* 构造时基类还没初始化，只按地址算，不调用成员函数 */
+  static T *keyStorage(LeafBNode *self) {
+    return reinterpret_cast<T *>(reinterpret_cast<char *>(self) +
+                                 keyOffset());
+  }
+  static uint64_t *valueStorage(LeafBNode *self, const size_type &MAX_SIZE) {
+    return reinterpret_cast<uint64_t *>(reinterpret_cast<char *>(self) +
+                                        valueOffset(MAX_SIZE));
+  }
+
   LeafBNode *_next;
   LeafBNode *_prev;
-  vector<uint64_t *> _value;
+  /* 值和关键字一一对应，连续存放 */
+  NodeArray<uint64_t> _value;
 };
 
-/* 反序列化时存prev */
-template <typename T>
-LeafBNode<T> *deserialize_prev = nullptr;
-/* 反序列化时存head */
-template <typename T>
-LeafBNode<T> *deserialize_head = nullptr;
-
 /**
  * @brief 非叶子节点
  * @tparam T 关键字类型 默认为int 目前仅支持整型和string类型
  *
  *
  */
-template <typename T>
-class InnerBNode : public BNode<T> {
+template <typename T, size_t Degree = 0>
+class InnerBNode : public BNode<T, Degree> {
   typedef typename vector<T>::size_type size_type;
+  using BNode<T, Degree>::degree;
 
  public:
-  InnerBNode() : BNode<T>(false) {}
-  InnerBNode(const InnerBNode<T> &innerbnode)
-      : BNode<T>(innerbnode), p(innerbnode.p) {}
+  /**
+   * @brief 节点头、关键字数组、孩子数组在一次分配里，用 new (MAX_SIZE) 创建
+   * 布局：[InnerBNode][MAX_SIZE+1个关键字][关键字索引][MAX_SIZE+2个孩子指针]
+   */
+  static void *operator new(size_t size, const size_type &MAX_SIZE) {
+    return ::operator new(allocSize(MAX_SIZE), align_val_t(CACHE_LINE));
+  }
+  static void operator delete(void *ptr) {
+    ::operator delete(ptr, align_val_t(CACHE_LINE));
+  }
+  static void operator delete(void *ptr, const size_type &MAX_SIZE) {
+    ::operator delete(ptr, align_val_t(CACHE_LINE));
+  }
+  static void *operator new(size_t size) = delete;
+
+  /* 预取节点头和二分第一次访问的关键字，只按地址算，不读节点 */
+  static void prefetch(const InnerBNode *node, const size_type &MAX_SIZE) {
+    const char *base = reinterpret_cast<const char *>(node);
+    for (size_t offset = 0; offset < keyOffset(); offset += CACHE_LINE) {
+      __builtin_prefetch(base + offset);
+    }
+    __builtin_prefetch(base + keyOffset() + sizeof(T) * (degree(MAX_SIZE) / 2));
+  }
+
+  InnerBNode(const InnerBNode<T, Degree> &innerbnode) = delete;
   ~InnerBNode() {}
 
   /* 内部节点分裂用的特殊构造函数 */
-  InnerBNode(InnerBNode<T> *&innerbnode, const size_type &MAX_SIZE)
-      : BNode<T>(innerbnode, MAX_SIZE / 2 + 1),
-        p(innerbnode->p.begin() + MAX_SIZE / 2 + 1, innerbnode->p.end()) {}
-  /*顶层分裂调用*/
-  InnerBNode(BNode<T> *const &root, const size_type &MAX_SIZE)
-      : BNode<T>(false) {
-    pair<BNode<T> *, T> info = split(root, MAX_SIZE);
-    this->addKey(info.second);
-    p.push_back(root);
-    p.push_back(info.first);
-  }
-  /* 反序列化构造函数*/
-  InnerBNode(const bplustree::BNode &pb_bnode, string dir)
-      : BNode<T>(pb_bnode) {
-    typename vector<BNode<T> *>::size_type child_size = pb_bnode._child_size();
-    for (typename vector<BNode<T> *>::size_type i = 0; i < child_size; ++i) {
-      ifstream fr;
-      fr.open(dir + pb_bnode._child(i), ios::in | ios::binary);
-      if (fr) {
-        bplustree::BNode pb_child;
-        pb_child.ParseFromIstream(&fr);
-        if (pb_child._isleaf()) {
-          LeafBNode<T> *child = new LeafBNode<T>(pb_child);
-          p.push_back(child);
-
-          //设置head
-          if (!deserialize_head<T>) {
-            deserialize_head<T> = child;
-          }
-          //设置prev
-          if (deserialize_prev<T>) {
-            deserialize_prev<T>->setNext(child);
-          }
-          child->setPrev(deserialize_prev<T>);
-          deserialize_prev<T> = child;
-        } else {
-          p.push_back(new InnerBNode<T>(pb_child, dir));
-        }
-        fr.close();
-      } else {
-        cerr << "open error:" << pb_bnode._child(i) << endl;
-      }
-    }
+  InnerBNode(InnerBNode<T, Degree> *&innerbnode, const size_type &MAX_SIZE)
+      : BNode<T, Degree>(innerbnode, degree(MAX_SIZE) / 2 + 1,
+                         keyStorage(this), degree(MAX_SIZE) + 1),
+        p(childStorage(this, MAX_SIZE), degree(MAX_SIZE) + 2,
+          innerbnode->p.begin() + degree(MAX_SIZE) / 2 + 1,
+          innerbnode->p.end()),
+        _right(innerbnode->_right) {}
+  /* 根分裂后新的根 */
+  InnerBNode(BNode<T, Degree> *const &left, const T &key,
+             BNode<T, Degree> *const &right, const size_type &MAX_SIZE)
+      : BNode<T, Degree>(false, keyStorage(this), degree(MAX_SIZE) + 1),
+        p(childStorage(this, MAX_SIZE), degree(MAX_SIZE) + 2),
+        _right(nullptr) {
+    this->_level = left->getLevel() + 1;
+    this->addKey(key);
+    p.push_back(left);
+    p.push_back(right);
+  }
+  /* 批量建树用的空节点，孩子用appendChild加入 */
+  InnerBNode(const size_type &level, const size_type &MAX_SIZE)
+      : BNode<T, Degree>(false, keyStorage(this), degree(MAX_SIZE) + 1),
+        p(childStorage(this, MAX_SIZE), degree(MAX_SIZE) + 2),
+        _right(nullptr) {
+    this->_level = level;
+  }
+  BNode<T, Degree> *getRight() const override { return _right; }
+  InnerBNode<T, Degree> *getRightInner() const { return _right; }
+  void setRight(InnerBNode<T, Degree> *const &right) { _right = right; }
+
+  /* 分裂出右半边，调用前持有本节点写锁 */
+  pair<BNode<T, Degree> *, T> splitRight(const size_type &MAX_SIZE) override {
+    this->markDirty();
+    T newkey = this->_key[degree(MAX_SIZE) / 2];
+    InnerBNode *self = this;
+    InnerBNode *newNode = new (MAX_SIZE) InnerBNode(self, MAX_SIZE);
+    newNode->_highKey = this->_highKey;
+    newNode->_rightPending = this->_rightPending;
+    _right = newNode;
+    keySplit(true, MAX_SIZE);
+    this->_highKey = newkey;
+    newNode->setLowKey(newkey);
+    this->_rightPending = true;
+    return make_pair(newNode, newkey);
   }
 
-  /* 分裂某孩子节点 */
-  pair<BNode<T> *, T> split(BNode<T> *const &BNode, const size_type &MAX_SIZE) {
-    T newkey = BNode->getKey(MAX_SIZE / 2);
-    if (BNode->isLeaf()) {
-      LeafBNode<T> *firstNode = static_cast<LeafBNode<T> *>(BNode);
-      LeafBNode<T> *newNode = new LeafBNode<T>(firstNode, MAX_SIZE);
+  /* 在末尾追加孩子，key是它子树的最小关键字，第一个孩子不需要 */
+  void appendChild(const T &key, BNode<T, Degree> *const &child) {
+    if (!p.empty()) {
+      this->_key.push_back(key);
+      this->updateKeyNum();
+    }
+    p.push_back(child);
+  }
 
-      // LeafBNode<T>* newNode = new LeafBNode<T>(*firstNode);
-      firstNode->setNext(newNode);
-      // newNode->setPrev(firstNode);
-      firstNode->keySplit(true, MAX_SIZE);
-      // newNode->keySplit(false, MAX_SIZE);
-      return make_pair(newNode, newkey);
-    } else {
-      InnerBNode<T> *firstNode = static_cast<InnerBNode<T> *>(BNode);
-      InnerBNode<T> *newNode = new InnerBNode<T>(firstNode, MAX_SIZE);
+  /* 把分裂出的右兄弟挂到第index个孩子后面 */
+  void insertChild(const size_type &index, const T &key,
+                   BNode<T, Degree> *const &child) {
+    this->markDirty();
+    this->_key.insert(this->_key.begin() + index, key);
+    this->updateKeyNum();
+    p.insert(p.begin() + index + 1, child);
+  }
 
-      // InnerBNode<T>* newNode = new InnerBNode<T>(*firstNode);
-      firstNode->keySplit(true, MAX_SIZE);
-      // newNode->keySplit(false, MAX_SIZE);
-      return make_pair(newNode, newkey);
+  /* 孩子的下标，不是本节点的孩子返回孩子数 */
+  size_type getChildPos(BNode<T, Degree> *const &child) const {
+    size_type index = 0;
+    while (index < p.size() && p[index] != child) {
+      ++index;
     }
+    return index;
   }
 
   /* 合并某孩子节点 */
-  void merge(BNode<T> *const &left, BNode<T> *const &right, const T &&key) {
+  void merge(BNode<T, Degree> *const &left, BNode<T, Degree> *const &right,
+             const T &&key) {
+    //right释放后它的页在下次检查点时回收；进行中的快照可能还要读right
+    left->markDirty();
+    right->markDirty();
+    this->markDirty();
+    left->setHighKey(right->getHighKey());
     if (left->isLeaf()) {
       //叶子节点的合并
-      LeafBNode<T> *leafLeft = static_cast<LeafBNode<T> *>(left);
-      LeafBNode<T> *leafRight = static_cast<LeafBNode<T> *>(right);
+      LeafBNode<T, Degree> *leafLeft =
+          static_cast<LeafBNode<T, Degree> *>(left);
+      LeafBNode<T, Degree> *leafRight =
+          static_cast<LeafBNode<T, Degree> *>(right);
       leafLeft->mergeKeys(leafRight->getAllKeys());
       leafLeft->mergeValues(leafRight->getAllValues());
       leafRight->clearValues();
@@ -587,61 +838,77 @@ class InnerBNode : public BNode<T> {
       }
     } else {
       //非叶子节点的合并
-      InnerBNode<T> *innerLeft = static_cast<InnerBNode<T> *>(left);
-      InnerBNode<T> *innerRight = static_cast<InnerBNode<T> *>(right);
+      InnerBNode<T, Degree> *innerLeft =
+          static_cast<InnerBNode<T, Degree> *>(left);
+      InnerBNode<T, Degree> *innerRight =
+          static_cast<InnerBNode<T, Degree> *>(right);
       innerLeft->mergeKeys(innerRight->getAllKeys(), move(key));
       innerLeft->mergePs(innerRight->getAllPs());
+      innerLeft->setRight(innerRight->getRightInner());
     }
-    delete right;
+    //乐观读者可能还拿着right，延迟到没人访问时再释放
+    right->getMutex().unlockObsolete();
+    EpochManager::instance().retire(right);
   }
 
-  /* 搜索目标key值 */
-  pair<T, uint64_t *> searchKey(const T &k,
-                                shared_lock<shared_mutex> &last_lock) override {
+  /* 查找时关键字所在孩子的下标，遇见相等的关键字向右走 */
+  size_type getChildIndex(const T &k) const {
     size_type index = this->getInsertIndex(k);
     if (index < this->_keyNum && k == this->_key[index]) {
-      shared_lock<shared_mutex> r_lock(p[index + 1]->getMutex());
-      last_lock.unlock();
-      return p[index + 1]->searchKey(k, r_lock);
-    } else {
-      shared_lock<shared_mutex> r_lock(p[index]->getMutex());
-      last_lock.unlock();
-      return p[index]->searchKey(k, r_lock);
+      ++index;
     }
+    return index;
   }
 
-  /* 插入关键字 */
-  void insertKey(const pair<T, uint64_t> &kv, const size_type &MAX_SIZE,
-                 deque<shared_mutex *> &q_w_lock) override {
-    if (this->isSafe(MAX_SIZE, true)) {
-      while (q_w_lock.size() != 1) {
-        q_w_lock.front()->unlock();
-        q_w_lock.pop_front();
-      }
+  /* 搜索目标key值 */
+  optional<uint64_t> searchKey(const T &k,
+                               shared_lock<OptLock> &last_lock) override {
+    BNode<T, Degree> *child = p[getChildIndex(k)];
+    shared_lock<OptLock> r_lock(child->getMutex());
+    last_lock.unlock();
+    //孩子分裂了还没挂上来，沿右链找
+    while (BNode<T, Degree> *right = child->moveRight(k, true)) {
+      shared_lock<OptLock> right_lock(right->getMutex());
+      r_lock.swap(right_lock);
+      child = right;
     }
-    size_type insertIndex = this->getInsertIndex(kv.first);
-    BNode<T> *insertNode = p[insertIndex];
-    insertNode->getMutex().lock();
-    q_w_lock.push_back(&insertNode->getMutex());
-    //默认不插入相等的key，都是左插
-    insertNode->insertKey(kv, MAX_SIZE, q_w_lock);
+    return child->searchKey(k, r_lock);
+  }
 
-    //孩子插入后需要分裂
-    if (q_w_lock.size() > 1 && insertNode->getKeyNum() == MAX_SIZE) {
-      pair<BNode<T> *, T> info = split(insertNode, MAX_SIZE);
-      insertIndex = this->addKey(info.second);
-      p.insert(p.begin() + insertIndex + 1, info.first);
+  /**
+   * @brief 修改目标key的值，内部节点加读锁，叶子加写锁
+   * @param onUpdate 见叶子的updateValue
+   */
+  template <typename Func>
+  bool updateValue(const T &k, const uint64_t &value,
+                   shared_lock<OptLock> &last_lock, Func onUpdate) {
+    BNode<T, Degree> *child = p[getChildIndex(k)];
+    if (!child->isLeaf()) {
+      shared_lock<OptLock> r_lock(child->getMutex());
+      last_lock.unlock();
+      while (BNode<T, Degree> *right = child->moveRight(k, true)) {
+        shared_lock<OptLock> right_lock(right->getMutex());
+        r_lock.swap(right_lock);
+        child = right;
+      }
+      return static_cast<InnerBNode *>(child)->updateValue(k, value, r_lock,
+                                                           onUpdate);
     }
-
-    if (!q_w_lock.empty()) {
-      q_w_lock.back()->unlock();
-      q_w_lock.pop_back();
+    unique_lock<OptLock> w_lock(child->getMutex());
+    last_lock.unlock();
+    while (BNode<T, Degree> *right = child->moveRight(k, true)) {
+      unique_lock<OptLock> right_lock(right->getMutex());
+      w_lock.swap(right_lock);
+      child = right;
     }
+    return static_cast<LeafBNode<T, Degree> *>(child)->updateValue(
+        k, value, w_lock, onUpdate);
   }
 
   /* 删除关键字 */
   T deleteKey(const T &k, const size_type &MAX_SIZE,
-              deque<shared_mutex *> &q_w_lock, bool &hasNewKey) override {
+              deque<OptLock *> &q_w_lock, bool &hasNewKey,
+              bool &deleted) override {
     if (!hasNewKey && this->isSafe(MAX_SIZE, false)) {
       while (q_w_lock.size() != 1) {
         q_w_lock.front()->unlock();
@@ -651,7 +918,7 @@ class InnerBNode : public BNode<T> {
 
     size_type deleteIndex = this->getInsertIndex(k);
     T newKey;
-    BNode<int> *deleteChild = p[deleteIndex];
+    BNode<T, Degree> *deleteChild = p[deleteIndex];
     if (deleteIndex < this->_keyNum && k == this->_key[deleteIndex]) {
       ++deleteIndex;
       //遇见关键字向右找
@@ -659,17 +926,30 @@ class InnerBNode : public BNode<T> {
       deleteChild->getMutex().lock();
       q_w_lock.push_back(&deleteChild->getMutex());
       hasNewKey = true;
-      newKey = deleteChild->deleteKey(k, MAX_SIZE, q_w_lock, hasNewKey);
-      this->_key[deleteIndex - 1] = newKey;
+      newKey = deleteChild->deleteKey(k, MAX_SIZE, q_w_lock, hasNewKey,
+                                      deleted);
+      this->markDirty();
+      this->setKey(deleteIndex - 1, newKey);
+      //孩子还锁着时改它的低键，左边子树最右边一路节点的高键也跟着改
+      deleteChild->setLowKey(newKey);
+      raiseHighKeys(p[deleteIndex - 1], newKey);
     } else {
       deleteChild->getMutex().lock();
       q_w_lock.push_back(&deleteChild->getMutex());
-      newKey = deleteChild->deleteKey(k, MAX_SIZE, q_w_lock, hasNewKey);
+      //上面要改的分隔关键字是本子树的下界
+      const bool isLowerBound = hasNewKey;
+      newKey = deleteChild->deleteKey(k, MAX_SIZE, q_w_lock, hasNewKey,
+                                      deleted);
+      if (isLowerBound) {
+        deleteChild->setLowKey(newKey);
+      }
     }
     //孩子删除后需要借
     if (q_w_lock.size() > 1 &&
-        deleteChild->getKeyNum() < ceil(1.0 * MAX_SIZE / 2) - 1) {
+        deleteChild->getKeyNum() < this->minKeyNum(MAX_SIZE)) {
       q_w_lock.pop_back();
+      //借或合并都要改本节点的分隔关键字
+      this->markDirty();
       if (deleteIndex + 1 < p.size()) {
         p[deleteIndex + 1]->getMutex().lock();
       }
@@ -677,23 +957,29 @@ class InnerBNode : public BNode<T> {
         p[deleteIndex - 1]->getMutex().lock();
       }
       if (deleteIndex + 1 < p.size() &&
-          p[deleteIndex + 1]->getKeyNum() > ceil(1.0 * MAX_SIZE / 2) - 1) {
+          p[deleteIndex + 1]->getKeyNum() > this->minKeyNum(MAX_SIZE)) {
         if (deleteIndex) {
           p[deleteIndex - 1]->getMutex().unlock();
         }
         //找右边兄弟借
-        this->_key[deleteIndex] = deleteChild->borrowKey(
-            p[deleteIndex + 1], true, this->_key[deleteIndex]);
+        this->setKey(deleteIndex,
+                     deleteChild->borrowKey(p[deleteIndex + 1], true,
+                                            this->_key[deleteIndex]));
+        deleteChild->setHighKey(this->_key[deleteIndex]);
+        p[deleteIndex + 1]->setLowKey(this->_key[deleteIndex]);
         p[deleteIndex + 1]->getMutex().unlock();
         deleteChild->getMutex().unlock();
-      } else if (deleteIndex && p[deleteIndex - 1]->getKeyNum() >
-                                    ceil(1.0 * MAX_SIZE / 2) - 1) {
+      } else if (deleteIndex &&
+                 p[deleteIndex - 1]->getKeyNum() > this->minKeyNum(MAX_SIZE)) {
         //找左边兄弟借
         if (deleteIndex + 1 < p.size()) {
           p[deleteIndex + 1]->getMutex().unlock();
         }
-        this->_key[deleteIndex - 1] = deleteChild->borrowKey(
-            p[deleteIndex - 1], false, this->_key[deleteIndex - 1]);
+        this->setKey(deleteIndex - 1,
+                     deleteChild->borrowKey(p[deleteIndex - 1], false,
+                                            this->_key[deleteIndex - 1]));
+        p[deleteIndex - 1]->setHighKey(this->_key[deleteIndex - 1]);
+        deleteChild->setLowKey(this->_key[deleteIndex - 1]);
         p[deleteIndex - 1]->getMutex().unlock();
         deleteChild->getMutex().unlock();
       } else if (deleteIndex + 1 < p.size()) {
@@ -730,25 +1016,25 @@ class InnerBNode : public BNode<T> {
     return newKey;
   }
 
-  /* 范围查询关键字 */
-  void searchKeyForRange(const T &l, const T &r, vector<pair<T, uint64_t>> &seq,
-                         const bool &continueFlag = false,
-                         bool test = false) override {
-    size_type index = this->getInsertIndex(l);
-    if (index < this->_keyNum && l == this->_key[index]) {
-      p[index + 1]->getMutex().lock_shared();
-      this->_mutex.unlock_shared();
-      p[index + 1]->searchKeyForRange(l, r, seq, false, test);
-    } else {
-      p[index]->getMutex().lock_shared();
-      this->_mutex.unlock_shared();
-      p[index]->searchKeyForRange(l, r, seq, false, test);
+  /**
+   * @brief 分隔关键字改大后，左边子树最右边一路节点的高键改成新的分隔关键字
+   * 持有_smoMutex的写锁调用，没有分裂到一半的节点，一次只锁一个节点
+   */
+  static void raiseHighKeys(BNode<T, Degree> *node, const T &key) {
+    while (true) {
+      unique_lock<OptLock> w_lock(node->getMutex());
+      node->setHighKey(key);
+      if (node->isLeaf()) {
+        return;
+      }
+      InnerBNode *inner = static_cast<InnerBNode *>(node);
+      node = inner->p[inner->p.size() - 1];
     }
   }
 
   /* 输出所有关键字 */
   void outputAllKeys(vector<T> &seq, bool test = false) override {
-    shared_lock<shared_mutex> r_lock(this->_mutex);
+    shared_lock<OptLock> r_lock(this->_mutex);
     if (test) {
       for (size_type i = 0; i < this->_keyNum; ++i) {
         seq.push_back(this->_key[i]);
@@ -767,25 +1053,28 @@ class InnerBNode : public BNode<T> {
   }
   /* 分裂关键字和指针 */
   void keySplit(const bool &isLeft, const size_type &MAX_SIZE) override {
+    this->markDirty();
     if (isLeft) {
-      this->_key.erase(this->_key.begin() + MAX_SIZE / 2, this->_key.end());
-      p.erase(p.begin() + MAX_SIZE / 2 + 1, p.end());
+      this->_key.erase(this->_key.begin() + degree(MAX_SIZE) / 2,
+                       this->_key.end());
+      p.erase(p.begin() + degree(MAX_SIZE) / 2 + 1, p.end());
     } else {
       this->_key.erase(this->_key.begin(),
-                       this->_key.begin() + MAX_SIZE / 2 + 1);
-      p.erase(p.begin(), p.begin() + MAX_SIZE / 2 + 1);
+                       this->_key.begin() + degree(MAX_SIZE) / 2 + 1);
+      p.erase(p.begin(), p.begin() + degree(MAX_SIZE) / 2 + 1);
     }
     this->updateKeyNum();
   }
 
-  BNode<T> *getChild(const size_type &index) const { return p[index]; }
+  BNode<T, Degree> *getChild(const size_type &index) const { return p[index]; }
   size_type getChildNum() const { return p.size(); }
 
   /* 借关键字 */
-  T borrowKey(BNode<T> *const &silbing, const bool &isRight,
+  T borrowKey(BNode<T, Degree> *const &silbing, const bool &isRight,
               const T &key) override {
-    pair<T, BNode<T> *> data =
-        static_cast<InnerBNode<T> *>(silbing)->provideKey(isRight);
+    this->markDirty();
+    pair<T, BNode<T, Degree> *> data =
+        static_cast<InnerBNode<T, Degree> *>(silbing)->provideKey(isRight);
     if (isRight) {
       this->_key.push_back(key);
       p.push_back(data.second);
@@ -798,9 +1087,10 @@ class InnerBNode : public BNode<T> {
   }
 
   /* 提供借出的关键字及数据 */
-  pair<T, BNode<T> *> provideKey(const bool &isRight) {
+  pair<T, BNode<T, Degree> *> provideKey(const bool &isRight) {
+    this->markDirty();
     T key;
-    BNode<T> *child;
+    BNode<T, Degree> *child;
     if (isRight) {
       key = this->_key[0];
       this->_key.erase(this->_key.begin());
@@ -820,15 +1110,15 @@ class InnerBNode : public BNode<T> {
     return make_pair(key, child);
   }
   /* 获取指针的数组 */
-  vector<BNode<T> *> getAllPs() { return p; }
+  const NodeArray<BNode<T, Degree> *> &getAllPs() const { return p; }
   /* 合并关键字 */
-  void mergeKeys(vector<T> &&keys, const T &&key) noexcept {
+  void mergeKeys(const NodeArray<T> &keys, const T &&key) noexcept {
     this->_key.push_back(key);
     this->_key.insert(this->_key.end(), keys.begin(), keys.end());
     this->updateKeyNum();
   }
   /* 合并指针 */
-  void mergePs(vector<BNode<T> *> &&ps) noexcept {
+  void mergePs(const NodeArray<BNode<T, Degree> *> &ps) noexcept {
     p.insert(p.end(), ps.begin(), ps.end());
   }
 
@@ -840,7 +1130,10 @@ class InnerBNode : public BNode<T> {
     uuid_t uuid;
     char str[36];
     for (size_t i = 0; i < this->_keyNum; ++i) {
-      pb_bnode.add__key(this->_key[i]);
+      //protobuf的关键字是int32，string的树不走这里，见serializeAll
+      if constexpr (is_integral<T>::value) {
+        pb_bnode.add__key(this->_key[i]);
+      }
       p[i]->getUUID(uuid);
       uuid_unparse(uuid, str);
       string child(begin(str), end(str));
@@ -868,74 +1161,225 @@ class InnerBNode : public BNode<T> {
   }
 
  private:
-  vector<BNode<T> *> p;
+  static size_t keyOffset() {
+    return alignUp(sizeof(InnerBNode), alignof(T));
+  }
+  static size_t childOffset(const size_type &MAX_SIZE) {
+    return alignUp(keyOffset() + sizeof(T) * (degree(MAX_SIZE) + 1) +
+                       KeyIndex<T>::storageSize(degree(MAX_SIZE) + 1),
+                   alignof(BNode<T, Degree> *));
+  }
+  static size_t allocSize(const size_type &MAX_SIZE) {
+    return childOffset(MAX_SIZE) +
+           sizeof(BNode<T, Degree> *) * (degree(MAX_SIZE) + 2);
+  }
+  /* 构造时基类还没初始化，只按地址算，不调用成员函数 */
+  static T *keyStorage(InnerBNode *self) {
+    return reinterpret_cast<T *>(reinterpret_cast<char *>(self) +
+                                 keyOffset());
+  }
+  static BNode<T, Degree> **childStorage(InnerBNode *self,
+                                         const size_type &MAX_SIZE) {
+    return reinterpret_cast<BNode<T, Degree> **>(
+        reinterpret_cast<char *>(self) + childOffset(MAX_SIZE));
+  }
+
+  NodeArray<BNode<T, Degree> *> p;
+  /* 同一层的右兄弟 */
+  InnerBNode<T, Degree> *_right;
 };
 
-template <typename T>
+template <typename T, size_t Degree>
+void SnapshotState<T, Degree>::preserve(BNode<T, Degree> *node) {
+  NodeImage<T, Degree> image;
+  image.isLeaf = node->isLeaf();
+  image.level = node->getLevel();
+  image.keys.assign(node->getAllKeys().begin(), node->getAllKeys().end());
+  if (node->isLeaf()) {
+    LeafBNode<T, Degree> *leaf = static_cast<LeafBNode<T, Degree> *>(node);
+    image.values.assign(leaf->getAllValues().begin(),
+                        leaf->getAllValues().end());
+    image.next = leaf->getNext();
+    image.prev = leaf->getPrev();
+  } else {
+    InnerBNode<T, Degree> *inner = static_cast<InnerBNode<T, Degree> *>(node);
+    image.children.assign(inner->getAllPs().begin(), inner->getAllPs().end());
+  }
+  lock_guard<mutex> lock(_mutex);
+  _images.emplace(node, std::move(image));
+}
+
+template <typename T, size_t Degree = 0>
+class BPlusTreeCursor;
+
+/**
+ * @brief B+树
+ * Degree不为0时度数在编译期确定，构造函数传入的度数只能是0或Degree，
+ * 节点大小和分裂、合并的阈值都是常量；为0时用构造时传入的度数
+ */
+template <typename T, size_t Degree = 0>
 class BPlusTree {
+  static_assert(Degree == 0 || Degree > 2, "度数至少为3");
+  friend class BPlusTreeCursor<T, Degree>;
   typedef typename vector<T>::size_type size_type;
+  /* 乐观下降时记录路径的最大深度 */
+  static constexpr size_type MAX_HEIGHT = 64;
+  /* 批量查找时交错下降的关键字个数 */
+  static constexpr size_type MULTI_SEARCH_GROUP = 16;
+  /* 批量查找中一个关键字的下降状态，node为空表示要从根重启 */
+  struct SearchLane {
+    size_type index;
+    BNode<T, Degree> *node;
+    bool fresh;
+    uint64_t version;
+  };
+  enum StepState { STEP_MOVED, STEP_DONE, STEP_RESTART };
+  /* 反序列化时读出来的内部节点，孩子都建好后才建节点 */
+  struct ParsedInner {
+    vector<T> keys;
+    /* 孩子的文件名 */
+    vector<string> children;
+    string uuid;
+  };
+
+  /**
+   * @brief 一次写操作：进写闸门，让这次改到的节点知道有没有进行中的快照
+   * 要在改完、记完日志后unlock，等日志落盘时不挡快照切时间点
+   */
+  class WriteScope {
+   public:
+    explicit WriteScope(BPlusTree *tree) : _lock(tree->_writeGate) {
+      snapshotInProgress<T, Degree> = tree->_snapshot;
+    }
+    ~WriteScope() { unlock(); }
+    WriteScope(const WriteScope &) = delete;
+    WriteScope &operator=(const WriteScope &) = delete;
+
+    void unlock() {
+      if (_lock.owns_lock()) {
+        snapshotInProgress<T, Degree> = nullptr;
+        _lock.unlock();
+      }
+    }
+
+   private:
+    shared_lock<WriteGate> _lock;
+  };
 
  public:
-  BPlusTree() : _MAX_SIZE(3), _name("testTree") { B_Plus_Tree_Create(); }
+  BPlusTree() : _MAX_SIZE(Degree ? Degree : 3), _name("testTree") {
+    B_Plus_Tree_Create();
+  }
   BPlusTree(const size_type &max_size, string name)
-      : _MAX_SIZE(max_size), _name(name) {
+      : _MAX_SIZE(initDegree(max_size)), _name(name) {
     B_Plus_Tree_Create();
   }
+  /* 从键值对区间批量建树，参数见B_Plus_Tree_Bulk_Load，输入无序时是空树 */
+  template <typename ForwardIt>
+  BPlusTree(const size_type &max_size, string name, ForwardIt first,
+            ForwardIt last, const double &fillFactor = 1.0,
+            const bool &needSort = false)
+      : _MAX_SIZE(initDegree(max_size)), _name(name) {
+    if (!B_Plus_Tree_Bulk_Load(first, last, fillFactor, needSort)) {
+      B_Plus_Tree_Create();
+    }
+  }
+  /* 从serializeAll写出的目录恢复，参数见B_Plus_Tree_Deserialize，失败时是空树 */
   BPlusTree(const bplustree::BPlusTree &pb_bplustree)
-      : _MAX_SIZE(pb_bplustree._max_size()), _name(pb_bplustree._name()) {
-    if (pb_bplustree.has__root()) {
-      string root = pb_bplustree._root();
-      ifstream fr;
-      string dir = "./" + _name + "/";
-      fr.open(dir + root, ios::in | ios::binary);
-      if (fr) {
-        bplustree::BNode pb_bnode;
-        pb_bnode.ParseFromIstream(&fr);
-        if (pb_bnode._isleaf()) {
-          _root = new LeafBNode<T>(pb_bnode);
-          setHead();
-        } else {
-          deserialize_head<T> = nullptr;
-          deserialize_prev<T> = nullptr;
-          _root = new InnerBNode<T>(pb_bnode, dir);
-          _Head = deserialize_head<T>;
-        }
-        fr.close();
-      } else {
-        cerr << "open error:" << root << endl;
-      }
+      : _MAX_SIZE(Degree ? Degree : pb_bplustree._max_size()),
+        _name(pb_bplustree._name()) {
+    if (!B_Plus_Tree_Deserialize(pb_bplustree)) {
+      B_Plus_Tree_Create();
     }
-
-    // if (pb_bplustree.has__head() &&
-    //     pb_bplustree._head() != pb_bplustree._root()) {
-    //   string head = pb_bplustree._head();
-    //   ifstream fr;
-    //   fr.open("./bin/" + head, ios::in | ios::binary);
-    //   if (fr) {
-    //     string str;
-    //     fr >> str;
-    //     bplustree::BNode pb_bnode;
-    //     pb_bnode.ParseFromString(str);
-    //     _Head = new LeafBNode<T>(pb_bnode, nullptr);
-    //     fr.close();
-    //   } else {
-    //     cerr << "open error:" << head << endl;
-    //   }
-    // }
   }
   ~BPlusTree() { B_Plus_Tree_Clear(); }
 
   /**
    * @brief 搜索B树
-   * @return 查找成功返回键值对，失败返回的值是一个空指针
+   * @return 查找成功返回值的拷贝，失败返回空；值存在叶子里会随分裂移动，
+   * 要改值用B_Plus_Tree_Update
    * @param k 查找的关键字
    */
-  pair<T, uint64_t *> B_Plus_Tree_Search(const T &k) const {
-    if (_root->getKeyNum()) {
-      shared_lock<shared_mutex> r_lock(_root->getMutex());
-      return _root->searchKey(k, r_lock);
+  optional<uint64_t> B_Plus_Tree_Search(const T &k) const {
+    EpochGuard guard;
+    if constexpr (is_trivially_copyable<T>::value) {
+      return searchOptimistic(k);
     }
-    return make_pair(k, nullptr);
+    //关键字不能按位读（如string），沿路径加读锁
+    while (true) {
+      BNode<T, Degree> *root = _root.load();
+      shared_lock<OptLock> r_lock(root->getMutex());
+      if (root != _root.load() || root->getMutex().isObsolete()) {
+        continue;
+      }
+      return root->searchKey(k, r_lock);
+    }
+  }
+
+  /**
+   * @brief 批量查找
+   * 每MULTI_SEARCH_GROUP个关键字一组交错下降：一个关键字走一层就预取它的下一层节点，
+   * 然后换下一个关键字，轮回来时节点多半已经在缓存里，各关键字的缓存缺失互相重叠
+   * @return 和keys一一对应的查找结果
+   */
+  vector<optional<uint64_t>> B_Plus_Tree_MultiSearch(
+      const vector<T> &keys) const {
+    vector<optional<uint64_t>> result(keys.size());
+    if constexpr (!is_trivially_copyable<T>::value) {
+      for (size_type i = 0; i < keys.size(); ++i) {
+        result[i] = B_Plus_Tree_Search(keys[i]);
+      }
+      return result;
+    }
+    EpochGuard guard;
+    SearchLane lanes[MULTI_SEARCH_GROUP];
+    size_type order[MULTI_SEARCH_GROUP];
+    for (size_type base = 0; base < keys.size(); base += MULTI_SEARCH_GROUP) {
+      size_type active = min(MULTI_SEARCH_GROUP, keys.size() - base);
+      for (size_type j = 0; j < active; ++j) {
+        lanes[j].index = base + j;
+        lanes[j].node = nullptr;
+        order[j] = j;
+      }
+      while (active) {
+        bool restarted = true;
+        for (size_type j = 0; j < active;) {
+          SearchLane &lane = lanes[order[j]];
+          StepState state =
+              stepOptimistic(keys[lane.index], lane, result[lane.index]);
+          if (state != STEP_RESTART) {
+            restarted = false;
+          }
+          if (state == STEP_DONE) {
+            swap(order[j], order[--active]);
+          } else {
+            ++j;
+          }
+        }
+        //整轮都在重启说明节点被写者占着，让出CPU
+        if (restarted) {
+          this_thread::yield();
+        }
+      }
+    }
+    return result;
+  }
+
+  /**
+   * @brief 修改关键字对应的值
+   * @return 关键字不存在返回false
+   */
+  bool B_Plus_Tree_Update(const T &k, const uint64_t &value) {
+    WriteScope scope(this);
+    uint64_t lsn = 0;
+    //在叶子的写锁里记日志，同一关键字的并发修改在日志里和内存里先后一致
+    if (!updateInPlace(k, value,
+                       [&]() { lsn = logRecord(LOG_UPDATE, k, value); })) {
+      return false;
+    }
+    scope.unlock();
+    commitLog(lsn);
+    return true;
   }
 
   /**
@@ -947,85 +1391,175 @@ class BPlusTree {
     cout << "---------------向B+树中插入<" << data.first << ", " << data.second
          << ">--------------" << endl;
 #endif
-    deque<shared_mutex *> q_w_lock;
-    _mutex.lock();
-    q_w_lock.push_back(&_mutex);
-    BNode<T> *insertRoot = _root;
-    insertRoot->getMutex().lock();
-    q_w_lock.push_back(&insertRoot->getMutex());
-    insertRoot->insertKey(data, _MAX_SIZE, q_w_lock);
-    if (q_w_lock.size() > 1 && insertRoot->getKeyNum() == _MAX_SIZE) {
-#ifndef NDEBUG
-      cout << "-------------------顶层节点满了---------------" << endl;
-#endif
-      _root = new InnerBNode<T>(_root, _MAX_SIZE);
-    }
-    while (!q_w_lock.empty()) {
-      q_w_lock.back()->unlock();
-      q_w_lock.pop_back();
+    EpochGuard guard;
+    WriteScope scope(this);
+    uint64_t lsn = 0;
+    if (!insertOptimistic(data, lsn)) {
+      //叶子要分裂，和要借或合并的删除互斥，但分裂之间可以并发
+      shared_lock<shared_mutex> smo_lock(_smoMutex);
+      insertWithSplit(data, lsn);
     }
+    scope.unlock();
+    commitLog(lsn);
   }
 
   /**
-   * @brief 向B树中删除一个关键字
-   * @param k 待删除的关键字
+   * @brief 批量插入
+   * 先按关键字排序，每个目标叶子只下降一次，落在同一叶子的关键字在一次加锁内插完；
+   * 叶子满了分裂上推后从下一个关键字重新下降
    */
-  void B_Plus_Tree_Delete(const T &k) {
-    deque<shared_mutex *> q_w_lock;
-    _mutex.lock();
-    q_w_lock.push_back(&_mutex);
-    BNode<T> *deleteRoot = _root;
-    deleteRoot->getMutex().lock();
-    q_w_lock.push_back(&deleteRoot->getMutex());
-    if (!deleteRoot->getKeyNum()) {
-      cout << "无法删除" << endl;
-      while (!q_w_lock.empty()) {
-        q_w_lock.back()->unlock();
-        q_w_lock.pop_back();
+  template <typename InputIt>
+  void B_Plus_Tree_Insert_Batch(InputIt first, InputIt last) {
+    vector<pair<T, uint64_t>> batch(first, last);
+    stable_sort(batch.begin(), batch.end(), keyLess);
+    EpochGuard guard;
+    WriteScope scope(this);
+    shared_lock<shared_mutex> smo_lock(_smoMutex);
+    BNode<T, Degree> *path[MAX_HEIGHT];
+    size_type depth;
+    size_type i = 0;
+    uint64_t lsn = 0;
+    while (i < batch.size()) {
+      LeafBNode<T, Degree> *leaf = lockLeaf(batch[i].first, path, depth);
+      if (!leaf) {
+        continue;
       }
-      return;
-    }
-#ifndef NDEBUG
-    cout << "------------------开始删除<" << k << ">------------------" << endl;
-#endif
-
-    bool hasNewKey = false;
-    deleteRoot->deleteKey(k, _MAX_SIZE, q_w_lock, hasNewKey);
-    //顶层没节点了
-    if (q_w_lock.size() > 1 && deleteRoot->getKeyNum() == 0 &&
-        !deleteRoot->isLeaf()) {
-      InnerBNode<T> *oldRoot = dynamic_cast<InnerBNode<T> *>(deleteRoot);
-      q_w_lock.pop_back();
-      if (oldRoot) {
-        _root = oldRoot->getChild(0);
-        delete oldRoot;
+      //叶子的范围是个区间，有右兄弟时上界是高键，等于高键的也插在这里
+      const size_type start = i;
+      bool split = false;
+      while (i < batch.size()) {
+        if (i != start && leaf->moveRight(batch[i].first, false)) {
+          break;
+        }
+        if (leaf->getKeyNum() + 1 < maxSize()) {
+          leaf->addKeyValue(batch[i]);
+          lsn = logRecord(LOG_INSERT, batch[i].first, batch[i].second);
+          ++i;
+          continue;
+        }
+        //上次分裂出的右兄弟还没挂上去，先不分裂
+        if (!leaf->isRightPending()) {
+          leaf->addKeyValue(batch[i]);
+          lsn = logRecord(LOG_INSERT, batch[i].first, batch[i].second);
+          ++i;
+          splitAndPost(leaf, path, depth);
+          split = true;
+        }
+        break;
+      }
+      if (!split) {
+        leaf->getMutex().unlock();
+      }
+      if (i == start) {
+        this_thread::yield();
       }
     }
-    while (!q_w_lock.empty()) {
-      q_w_lock.back()->unlock();
-      q_w_lock.pop_back();
-    }
+    smo_lock.unlock();
+    scope.unlock();
+    commitLog(lsn);
+  }
+
+  /**
+   * @brief 向B树中删除一个关键字
+   * @param k 待删除的关键字
+   */
+  void B_Plus_Tree_Delete(const T &k) {
+    EpochGuard guard;
+    WriteScope scope(this);
+    uint64_t lsn = 0;
+    if (!deleteOptimistic(k, lsn)) {
+      //要借、合并或改分隔关键字时不能有分裂到一半的节点
+      unique_lock<shared_mutex> smo_lock(_smoMutex);
+      lsn = deleteWithRebalance(k);
+    }
+    scope.unlock();
+    commitLog(lsn);
   }
 
   /**
    * @brief B树的范围查询
+   * 先收集结果再输出，不在持有叶子锁时做终端输出
    * @param l 范围左域
    * @param r 范围右域
    */
   vector<pair<T, uint64_t>> B_Plus_Tree_Search_For_Range(
       const T &l, const T &r, bool test = false) const {
     vector<pair<T, uint64_t>> rangeSearchResult;
-    _root->getMutex().lock_shared();
-    _root->searchKeyForRange(l, r, rangeSearchResult, false, test);
-    if (rangeSearchResult.empty() && !test) {
-      cout << "没有该范围的关键字";
-    }
+    B_Plus_Tree_Scan(l, r, [&](const T &k, const uint64_t &value) {
+      rangeSearchResult.push_back(make_pair(k, value));
+      return true;
+    });
     if (!test) {
+      for (const auto &kv : rangeSearchResult) {
+        cout << " <" << kv.first << ", " << kv.second << ">";
+      }
+      if (rangeSearchResult.empty()) {
+        cout << "没有该范围的关键字";
+      }
       cout << endl;
     }
     return rangeSearchResult;
   }
 
+  /**
+   * @brief 流式范围扫描，对[l, r)里的每个键值对按顺序调用func
+   * func在持有叶子读锁时调用，不要在里面阻塞或做终端输出
+   * @param func bool(const T &k, const uint64_t &value)，返回false时提前结束
+   */
+  template <typename Func>
+  void B_Plus_Tree_Scan(const T &l, const T &r, Func func) const {
+    BPlusTreeCursor<T, Degree> cursor(*this);
+    for (cursor.seek(l); cursor.valid() && cursor.key() < r; cursor.next()) {
+      if (!func(cursor.key(), cursor.value())) {
+        return;
+      }
+    }
+  }
+
+  /**
+   * @brief 逆序流式范围扫描，从大到小对[l, r)里的每个键值对调用func
+   * 先定位到r之前的最后一个关键字，再沿叶子的左兄弟往回走
+   * @param func 同B_Plus_Tree_Scan，返回false时提前结束
+   */
+  template <typename Func>
+  void B_Plus_Tree_Scan_Reverse(const T &l, const T &r, Func func) const {
+    BPlusTreeCursor<T, Degree> cursor(*this);
+    for (cursor.seekForPrev(r); cursor.valid() && !(cursor.key() < l);
+         cursor.prev()) {
+      if (!func(cursor.key(), cursor.value())) {
+        return;
+      }
+    }
+  }
+
+  /**
+   * @brief 小于x的最后n个键值对，从大到小排列
+   * @param x 右边界，不包含
+   */
+  vector<pair<T, uint64_t>> B_Plus_Tree_Search_Last_N(
+      const T &x, const size_type &n) const {
+    vector<pair<T, uint64_t>> result;
+    if (!n) {
+      return result;
+    }
+    BPlusTreeCursor<T, Degree> cursor(*this);
+    for (cursor.seekForPrev(x); cursor.valid(); cursor.prev()) {
+      result.push_back(make_pair(cursor.key(), cursor.value()));
+      if (result.size() == n) {
+        break;
+      }
+    }
+    return result;
+  }
+
+  /**
+   * @brief 设置扫描时提前预取的叶子个数，0表示不预取
+   * 对之后创建的游标、范围扫描和OutPutAllTheKeys生效
+   */
+  void B_Plus_Tree_Set_Scan_Prefetch(const size_type &distance) {
+    _scanPrefetch = distance;
+  }
+
   /**
    * @brief 层序遍历
    * @tparam T 关键字类型 默认为int 目前仅支持整型和string类型
@@ -1034,17 +1568,18 @@ class BPlusTree {
    */
   vector<T> BFS(bool test = false) const {
     typedef typename vector<T>::size_type size_type;
-    queue<BNode<T> *> q;
+    queue<BNode<T, Degree> *> q;
     q.push(_root);
-    BNode<T> *lastLayer = _root;
+    BNode<T, Degree> *lastLayer = _root;
     vector<T> bfsSeq;
     while (!q.empty()) {
-      BNode<T> *temp = q.front();
+      BNode<T, Degree> *temp = q.front();
       q.pop();
-      shared_lock<shared_mutex> r_lock(temp->getMutex());
+      shared_lock<OptLock> r_lock(temp->getMutex());
       temp->outputAllKeys(bfsSeq, test);
       if (!temp->isLeaf()) {
-        InnerBNode<T> *tempInner = static_cast<InnerBNode<T> *>(temp);
+        InnerBNode<T, Degree> *tempInner =
+            static_cast<InnerBNode<T, Degree> *>(temp);
         for (size_type i = 0; i < tempInner->getChildNum(); ++i) {
           q.push(tempInner->getChild(i));
         }
@@ -1067,18 +1602,139 @@ class BPlusTree {
    *
    */
   vector<T> OutPutAllTheKeys(bool test = false) const {
-    LeafBNode<T> *p = _Head;
+    EpochGuard guard;
+    LeafBNode<T, Degree> *p = _Head;
+    //frontier之前的ahead个叶子已经预取过
+    LeafBNode<T, Degree> *frontier = p;
+    size_type ahead = 0;
     vector<T> allKeySeq;
     while (p) {
-      shared_lock<shared_mutex> r_lock(p->getMutex());
-      p->outputAllKeys(allKeySeq, test);
-      p = p->getNext();
+      for (; ahead < _scanPrefetch && frontier->getNext(); ++ahead) {
+        frontier = frontier->getNext();
+        LeafBNode<T, Degree>::prefetchWhole(frontier, maxSize());
+      }
+      {
+        shared_lock<OptLock> r_lock(p->getMutex());
+        p->outputAllKeys(allKeySeq, test);
+        p = p->getNext();
+      }
+      if (ahead) {
+        --ahead;
+      } else {
+        frontier = p;
+      }
     }
     if (!test) {
       cout << endl;
     }
     return allKeySeq;
   }
+  /**
+   * @brief 从按关键字有序的键值对自底向上批量建树，替换原来的内容
+   * 一遍扫描把叶子按填充率填满，再逐层建内部节点，不加锁，
+   * 调用期间不能有其它线程访问这棵树。
+   * 相同关键字都保留，和逐个插入一样，按输入的先后排。
+   * @param fillFactor 节点填充率(0,1]，不会低于删除要求的最小填充
+   * @param needSort 输入无序时传true，先拷贝一份排序
+   * @return 输入没按关键字排好又没传needSort返回false，树不变
+   */
+  template <typename ForwardIt>
+  bool B_Plus_Tree_Bulk_Load(ForwardIt first, ForwardIt last,
+                             const double &fillFactor = 1.0,
+                             const bool &needSort = false) {
+    if (needSort) {
+      vector<pair<T, uint64_t>> sorted(first, last);
+      stable_sort(sorted.begin(), sorted.end(), keyLess);
+      return B_Plus_Tree_Bulk_Load(sorted.begin(), sorted.end(), fillFactor);
+    }
+    if (!is_sorted(first, last, keyLess)) {
+      cerr << "批量建树的输入没按关键字排好" << endl;
+      return false;
+    }
+    if (_root) {
+      B_Plus_Tree_Clear();
+    }
+    vector<pair<T, BNode<T, Degree> *>> level =
+        buildLeaves(first, last, fillFactor);
+    if (level.empty()) {
+      B_Plus_Tree_Create();
+      return true;
+    }
+    _Head = static_cast<LeafBNode<T, Degree> *>(level.front().second);
+    while (level.size() > 1) {
+      level = buildInnerLevel(level, fillFactor);
+    }
+    _root = level.front().second;
+    setFences(_root, nullptr, nullptr);
+    return true;
+  }
+
+  /**
+   * @brief 多线程批量建树，输入必须按关键字有序
+   * 输入切成threadNum段，各线程建自己那段的叶子，首尾接上叶子链后，
+   * 每层内部节点也分给各线程建，再把同层的右链接上
+   * @param threadNum 线程数，数据少时会自动减少
+   * @return 输入没按关键字排好返回false，树不变
+   */
+  template <typename RandomIt>
+  bool B_Plus_Tree_Bulk_Load_Parallel(
+      RandomIt first, RandomIt last,
+      size_type threadNum = thread::hardware_concurrency(),
+      const double &fillFactor = 1.0) {
+    size_type total = last - first;
+    threadNum = max(min(threadNum, total / PARALLEL_MIN_ITEMS),
+                    static_cast<size_type>(1));
+    //各段连同和上一段的交界一起检查
+    atomic<bool> sorted(true);
+    parallelFor(total, threadNum,
+                [&](size_type id, size_type from, size_type to) {
+                  from -= from && from < to;
+                  if (!is_sorted(first + from, first + to, keyLess)) {
+                    sorted = false;
+                  }
+                });
+    if (!sorted) {
+      cerr << "批量建树的输入没按关键字排好" << endl;
+      return false;
+    }
+    if (_root) {
+      B_Plus_Tree_Clear();
+    }
+    vector<vector<pair<T, BNode<T, Degree> *>>> runs(threadNum);
+    parallelFor(total, threadNum,
+                [&](size_type id, size_type from, size_type to) {
+                  runs[id] = buildLeaves(first + from, first + to, fillFactor);
+                });
+    vector<pair<T, BNode<T, Degree> *>> level;
+    for (auto &run : runs) {
+      if (!run.empty() && !level.empty()) {
+        LeafBNode<T, Degree> *tail =
+            static_cast<LeafBNode<T, Degree> *>(level.back().second);
+        LeafBNode<T, Degree> *head =
+            static_cast<LeafBNode<T, Degree> *>(run.front().second);
+        tail->setNext(head);
+        head->setPrev(tail);
+        //这段只建出一个太空的叶子，和前一段的末尾匀一下
+        while (head->getKeyNum() < minKeyNum() &&
+               head->getKeyNum() < tail->getKeyNum()) {
+          run.front().first = head->borrowKey(tail, false, run.front().first);
+        }
+      }
+      level.insert(level.end(), run.begin(), run.end());
+    }
+    if (level.empty()) {
+      B_Plus_Tree_Create();
+      return true;
+    }
+    _Head = static_cast<LeafBNode<T, Degree> *>(level.front().second);
+    while (level.size() > 1) {
+      level = buildInnerLevel(level, fillFactor, threadNum);
+    }
+    _root = level.front().second;
+    setFences(_root, nullptr, nullptr);
+    return true;
+  }
+
   /* 重置树 */
   void B_Plus_Tree_Reset() {
     B_Plus_Tree_Clear();
@@ -1087,12 +1743,12 @@ class BPlusTree {
   /* 序列化 */
   void Serialize() {
     bplustree::BPlusTree pb_bplustree;
-    pb_bplustree.set__max_size(_MAX_SIZE);
+    pb_bplustree.set__max_size(maxSize());
     pb_bplustree.set__name(_name);
     uuid_t uuid;
     char str[36];
     // root
-    _root->getUUID(uuid);
+    _root.load()->getUUID(uuid);
     uuid_unparse(uuid, str);
     string root(begin(str), end(str));
     pb_bplustree.set__root(root);
@@ -1120,15 +1776,21 @@ class BPlusTree {
     }
   }
   void serializeAll() {
+    if (!is_integral<T>::value) {
+      cerr << "protobuf格式只能存整数关键字，string的树请用B_Plus_Tree_Save_Compact"
+           << endl;
+      return;
+    }
     Serialize();
     typedef typename vector<T>::size_type size_type;
-    queue<BNode<T> *> q;
+    queue<BNode<T, Degree> *> q;
     q.push(_root);
     while (!q.empty()) {
-      BNode<T> *temp = q.front();
+      BNode<T, Degree> *temp = q.front();
       q.pop();
       if (!temp->isLeaf()) {
-        InnerBNode<T> *tempInner = static_cast<InnerBNode<T> *>(temp);
+        InnerBNode<T, Degree> *tempInner =
+            static_cast<InnerBNode<T, Degree> *>(temp);
         for (size_type i = 0; i < tempInner->getChildNum(); ++i) {
           q.push(tempInner->getChild(i));
         }
@@ -1136,7 +1798,569 @@ class BPlusTree {
       temp->Serialize("./" + _name + "/");
     }
   }
-  size_type getMAX_SIZE() { return _MAX_SIZE; }
+
+  /**
+   * @brief 从serializeAll写出的目录恢复，替换原来的内容，调用期间不能有其它线程访问这棵树
+   * 从根往下一层层读，同一层的节点文件分给多个线程解析，孩子的文件名依次排成下一层；
+   * 读到叶子层后自底向上建内部节点，最后按顺序接上叶子链。
+   * 不用全局变量，可以同时恢复多棵树
+   * @param threadNum 解析用的线程数，一层的节点少时会自动减少
+   * @return 文件打不开、内容不对或度数对不上返回false，树不变
+   */
+  bool B_Plus_Tree_Deserialize(
+      const bplustree::BPlusTree &pb_bplustree,
+      size_type threadNum = thread::hardware_concurrency()) {
+    if (pb_bplustree._max_size() != maxSize() || !pb_bplustree.has__root()) {
+      cerr << "反序列化时树" << pb_bplustree._name() << "的度数不对或没有根"
+           << endl;
+      return false;
+    }
+    const string dir = "./" + pb_bplustree._name() + "/";
+    vector<vector<ParsedInner>> inners;
+    vector<LeafBNode<T, Degree> *> leaves;
+    vector<string> names(1, pb_bplustree._root());
+    bool ok = true;
+    while (ok && leaves.empty()) {
+      vector<ParsedInner> level(names.size());
+      vector<LeafBNode<T, Degree> *> levelLeaves(names.size(), nullptr);
+      //0:解析失败 1:内部节点 2:叶子
+      vector<uint8_t> kinds(names.size(), 0);
+      parallelFor(names.size(),
+                  max(min(threadNum, names.size()), static_cast<size_type>(1)),
+                  [&](size_type id, size_type from, size_type to) {
+                    for (size_type i = from; i < to; ++i) {
+                      kinds[i] = parseNodeFile(dir + names[i], level[i],
+                                               levelLeaves[i]);
+                    }
+                  });
+      //同一层要么都是叶子，要么都是内部节点
+      for (size_type i = 0; i < names.size(); ++i) {
+        ok = ok && kinds[i] && kinds[i] == kinds[0];
+      }
+      if (ok && kinds[0] == 2) {
+        leaves.swap(levelLeaves);
+      } else if (ok) {
+        names.clear();
+        for (ParsedInner &parsed : level) {
+          names.insert(names.end(), parsed.children.begin(),
+                       parsed.children.end());
+        }
+        inners.push_back(std::move(level));
+        //损坏的目录里孩子可能成环
+        ok = inners.size() < MAX_HEIGHT;
+      }
+      if (!ok) {
+        cerr << "反序列化时" << dir << "里的节点文件缺失或损坏" << endl;
+        for (LeafBNode<T, Degree> *leaf : levelLeaves) {
+          delete leaf;
+        }
+      }
+    }
+    if (!ok) {
+      return false;
+    }
+    vector<BNode<T, Degree> *> below(leaves.begin(), leaves.end());
+    for (size_type depth = inners.size(); depth--;) {
+      vector<BNode<T, Degree> *> built;
+      size_type next = 0;
+      for (ParsedInner &parsed : inners[depth]) {
+        InnerBNode<T, Degree> *inner = new (maxSize())
+            InnerBNode<T, Degree>(below.front()->getLevel() + 1, maxSize());
+        inner->appendChild(T(), below[next++]);
+        for (const T &key : parsed.keys) {
+          inner->appendChild(key, below[next++]);
+        }
+        uuid_t uuid;
+        if (uuid_parse(parsed.uuid.c_str(), uuid) == 0) {
+          inner->setUUID(uuid);
+        }
+        built.push_back(inner);
+      }
+      below.swap(built);
+    }
+    if (_root) {
+      B_Plus_Tree_Clear();
+    }
+    _root = below.front();
+    _Head = leaves.front();
+    for (size_type i = 1; i < leaves.size(); ++i) {
+      leaves[i - 1]->setNext(leaves[i]);
+      leaves[i]->setPrev(leaves[i - 1]);
+    }
+    linkInnerRights();
+    _checkpointSynced = false;
+    return true;
+  }
+
+  /**
+   * @brief 把整棵树存成一个分页文件，调用期间不能有写者
+   * 按层序编页号，同一层的节点页号连续，叶子层按关键字顺序排在最后；
+   * 页攒够一批再一次写出，整个文件是顺序写
+   * @param checkpointLsn 作为检查点时已包含的日志位置
+   * @return 打开或写入失败返回false
+   */
+  bool B_Plus_Tree_Save(const string &path,
+                        const uint64_t &checkpointLsn = 0) const {
+    if constexpr (!is_trivially_copyable<T>::value) {
+      cerr << "分页文件只支持定长关键字" << endl;
+      return false;
+    } else {
+      vector<BNode<T, Degree> *> nodes = collectNodes();
+      unordered_map<BNode<T, Degree> *, page_id> ids;
+      for (size_type i = 0; i < nodes.size(); ++i) {
+        ids[nodes[i]] = i + 1;
+      }
+      return writePageFile(
+          path, nodes, [&](BNode<T, Degree> *node) { return ids[node]; },
+          checkpointLsn);
+    }
+  }
+
+  /**
+   * @brief 同B_Plus_Tree_Save，整数关键字的叶子打包后更短时关键字区存打包的块
+   * 给MappedBPlusTree做只读副本：查找时只解出二分剩下的窗口，一个叶子占的缓存行更少。
+   * 文件能用B_Plus_Tree_Load恢复，不能用PagedBPlusTree打开；
+   * 作为检查点时第一次检查点会整棵树重写
+   * @return 打开或写入失败返回false
+   */
+  bool B_Plus_Tree_Save_Packed(const string &path) const {
+    if constexpr (!PackableKey<T>::value) {
+      cerr << "只有定长整数关键字能打包" << endl;
+      return false;
+    } else {
+      vector<BNode<T, Degree> *> nodes = collectNodes();
+      unordered_map<BNode<T, Degree> *, page_id> ids;
+      for (size_type i = 0; i < nodes.size(); ++i) {
+        ids[nodes[i]] = i + 1;
+      }
+      return writePageFile(
+          path, nodes, [&](BNode<T, Degree> *node) { return ids[node]; }, 0,
+          true);
+    }
+  }
+
+  /**
+   * @brief 从分页文件恢复，替换原来的内容，调用期间不能有其它线程访问这棵树
+   * 页的顺序任意：先建叶子，内部节点按层从低往高建，最后按页号接上叶子链。
+   * 有没写回完的页日志时先写回。节点的关键字数要和内存树一样在
+   * [minKeyNum, maxSize-1]里(根没有下限)，PagedBPlusTree删过、不到半满的文件会被拒绝
+   * @return 文件打不开、格式或度数对不上、节点过满或过空返回false，树不变
+   */
+  bool B_Plus_Tree_Load(const string &path) {
+    if constexpr (!is_trivially_copyable<T>::value) {
+      cerr << "分页文件只支持定长关键字" << endl;
+      return false;
+    } else {
+      if (!applyPageJournal(path)) {
+        cerr << "恢复时" << path << "的页日志写回失败" << endl;
+        return false;
+      }
+      PageFile file;
+      PageFileHeader header;
+      if (!file.open(path, false) ||
+          !file.readAt(&header, sizeof(header), 0)) {
+        cerr << "恢复时" << path << "打开失败" << endl;
+        return false;
+      }
+      if (!checkPageFileHeader<T>(header) || header.maxSize != maxSize() ||
+          header.root == INVALID_PAGE || header.head == INVALID_PAGE ||
+          file.size() < header.pageCount * header.pageSize) {
+        cerr << path << "不是度为" << maxSize() << "的分页文件" << endl;
+        return false;
+      }
+      const size_t pageSize = header.pageSize;
+      const size_type batchPages =
+          max(PAGE_WRITE_BATCH / pageSize, static_cast<size_t>(1));
+      vector<char> buffer(pageSize * batchPages);
+      vector<BNode<T, Degree> *> nodes(header.pageCount, nullptr);
+      vector<page_id> nextIds(header.pageCount, INVALID_PAGE);
+      vector<uint8_t> referenced(header.pageCount, 0);
+      //内部节点的孩子可能在后面的页里，先存下来，叶子都建好后按层从低往高建
+      vector<pair<uint32_t, page_id>> inners;
+      vector<char> innerPages;
+      bool ok = true;
+      for (page_id begin = 1; ok && begin < header.pageCount;
+           begin += batchPages) {
+        page_id end = min<page_id>(header.pageCount, begin + batchPages);
+        ok = file.readAt(buffer.data(), (end - begin) * pageSize,
+                         begin * pageSize);
+        for (page_id id = begin; ok && id < end; ++id) {
+          const char *page = buffer.data() + (id - begin) * pageSize;
+          const PageNode *node = PageLayout<T>::node(page);
+          if (node->isFree) {
+            continue;
+          }
+          if (node->isLeaf) {
+            nodes[id] = decodePage(page, nodes, nextIds[id], referenced);
+            ok = nodes[id] != nullptr;
+          } else {
+            inners.push_back(make_pair(node->level, id));
+            innerPages.insert(innerPages.end(), page, page + pageSize);
+          }
+        }
+      }
+      vector<size_type> order(inners.size());
+      iota(order.begin(), order.end(), 0);
+      stable_sort(order.begin(), order.end(),
+                  [&](const size_type &a, const size_type &b) {
+                    return inners[a].first < inners[b].first;
+                  });
+      for (size_type i = 0; ok && i < order.size(); ++i) {
+        page_id id = inners[order[i]].second;
+        nodes[id] = decodePage(innerPages.data() + order[i] * pageSize, nodes,
+                               nextIds[id], referenced);
+        ok = nodes[id] != nullptr;
+      }
+      //除了根，每个节点恰好被一个父节点引用，不然就是有没回收的页或者成环
+      for (page_id id = 1; ok && id < header.pageCount; ++id) {
+        ok = !nodes[id] || (id == header.root) != (referenced[id] != 0);
+        ok = ok && (!nodes[id] || id == header.root ||
+                    nodes[id]->getKeyNum() >= minKeyNum());
+        ok = ok && (!nextIds[id] || (nodes[nextIds[id]] &&
+                                     nodes[nextIds[id]]->isLeaf()));
+      }
+      if (!ok || !nodes[header.root] || !nodes[header.head] ||
+          !nodes[header.head]->isLeaf()) {
+        cerr << "恢复时" << path << "内容损坏" << endl;
+        for (BNode<T, Degree> *node : nodes) {
+          delete node;
+        }
+        return false;
+      }
+      for (page_id id = 1; id < header.pageCount; ++id) {
+        if (nodes[id] && nodes[id]->isLeaf() && nextIds[id] != INVALID_PAGE) {
+          LeafBNode<T, Degree> *leaf =
+              static_cast<LeafBNode<T, Degree> *>(nodes[id]);
+          LeafBNode<T, Degree> *next =
+              static_cast<LeafBNode<T, Degree> *>(nodes[nextIds[id]]);
+          leaf->setNext(next);
+          next->setPrev(leaf);
+        }
+      }
+      if (_root) {
+        B_Plus_Tree_Clear();
+      }
+      _root = nodes[header.root];
+      _Head = static_cast<LeafBNode<T, Degree> *>(nodes[header.head]);
+      linkInnerRights();
+      //节点和页一一对应，之后对这个文件做增量检查点只写改过的页
+      _livePages.assign(header.pageCount, false);
+      _freePages.clear();
+      for (page_id id = 1; id < header.pageCount; ++id) {
+        if (nodes[id]) {
+          nodes[id]->setPageId(id);
+          nodes[id]->clearDirty();
+          _livePages[id] = true;
+        } else {
+          _freePages.push_back(id);
+        }
+      }
+      _checkpointSynced = false;
+      return true;
+    }
+  }
+
+  /**
+   * @brief 把整棵树存成紧凑格式，调用期间不能有写者
+   * 节点按层序编号，记录头攒在一起，定长关键字和值直接从节点的数组用pwritev写出，
+   * 不经过中间缓冲；整数关键字打包后更短时写打包的块，string关键字去掉节点内的
+   * 公共前缀后编码成关键字块
+   * @return 打开或写入失败返回false
+   */
+  bool B_Plus_Tree_Save_Compact(const string &path) const {
+    vector<BNode<T, Degree> *> nodes = collectNodes();
+    CompactFileHeader header{COMPACT_FILE_MAGIC, COMPACT_FILE_VERSION,
+                             compactKeySize<T>(), maxSize(), nodes.size()};
+    //iovec指向这些数组，写完之前不能扩容
+    vector<CompactNode> records(nodes.size());
+    vector<string> keyBlocks(nodes.size());
+    vector<iovec> iov;
+    iov.reserve(nodes.size() * 3 + 1);
+    iov.push_back(iovec{&header, sizeof(header)});
+    uint64_t nextChild = 1;
+    for (size_type i = 0; i < nodes.size(); ++i) {
+      BNode<T, Degree> *node = nodes[i];
+      CompactNode &record = records[i];
+      record.isLeaf = node->isLeaf();
+      record.level = node->getLevel();
+      record.keyNum = node->getKeyNum();
+      if (!node->isLeaf()) {
+        record.firstChild = nextChild;
+        nextChild += static_cast<InnerBNode<T, Degree> *>(node)->getChildNum();
+      }
+      iov.push_back(iovec{&record, sizeof(record)});
+      const NodeArray<T> &keys = node->getAllKeys();
+      if constexpr (is_same<T, string>::value) {
+        //公共前缀节点里已经算好了
+        size_t prefixLength = node->getPrefixLength();
+        encodeStringKeys(keys.begin(), keys.end(), keyBlocks[i], prefixLength);
+        record.keyEncoding =
+            prefixLength ? COMPACT_KEYS_PREFIX : COMPACT_KEYS_RAW;
+      } else if constexpr (PackableKey<T>::value) {
+        //打包后不比原来短就按原样写
+        uint32_t width = packedWidth(keys.begin(), keys.size());
+        if (packedBytes<T>(keys.size(), width) < keys.size() * sizeof(T) &&
+            packKeys(keys.begin(), keys.size(), keyBlocks[i])) {
+          record.keyEncoding = COMPACT_KEYS_PACKED;
+        }
+      }
+      if (record.keyEncoding != COMPACT_KEYS_RAW ||
+          is_same<T, string>::value) {
+        record.keyBytes = keyBlocks[i].size();
+        iov.push_back(iovec{&keyBlocks[i][0], keyBlocks[i].size()});
+      } else {
+        record.keyBytes = keys.size() * sizeof(T);
+        iov.push_back(iovec{const_cast<T *>(keys.begin()), record.keyBytes});
+      }
+      if (node->isLeaf()) {
+        const NodeArray<uint64_t> &values =
+            static_cast<LeafBNode<T, Degree> *>(node)->getAllValues();
+        iov.push_back(iovec{const_cast<uint64_t *>(values.begin()),
+                            values.size() * sizeof(uint64_t)});
+      }
+    }
+    PageFile file;
+    if (!file.open(path, true) || !file.writeVAt(iov, 0) || !file.sync()) {
+      cerr << "保存时" << path << "写入失败" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * @brief 从紧凑格式恢复，替换原来的内容，调用期间不能有其它线程访问这棵树
+   * 整个文件读进来，先顺着记录检查长度和孩子序号，再倒着建节点，孩子总是先于父节点建好
+   * @return 文件打不开、格式或度数对不上、内容损坏返回false，树不变
+   */
+  bool B_Plus_Tree_Load_Compact(const string &path) {
+    PageFile file;
+    CompactFileHeader header;
+    if (!file.open(path, false) ||
+        !file.readAt(&header, sizeof(header), 0)) {
+      cerr << "恢复时" << path << "打开失败" << endl;
+      return false;
+    }
+    if (header.magic != COMPACT_FILE_MAGIC ||
+        !header.version || header.version > COMPACT_FILE_VERSION ||
+        header.keySize != compactKeySize<T>() || header.maxSize != maxSize() ||
+        !header.nodeCount) {
+      cerr << path << "不是度为" << maxSize() << "的紧凑格式文件" << endl;
+      return false;
+    }
+    vector<char> content(file.size() - sizeof(header));
+    if (!file.readAt(content.data(), content.size(), sizeof(header))) {
+      cerr << "恢复时" << path << "读取失败" << endl;
+      return false;
+    }
+    //层序里孩子紧跟着排，每个内部节点的第一个孩子正好接在前一个的孩子后面
+    vector<size_t> offsets(header.nodeCount);
+    size_t offset = 0;
+    uint64_t nextChild = 1;
+    bool ok = true;
+    for (uint64_t i = 0; ok && i < header.nodeCount; ++i) {
+      CompactNode record;
+      ok = content.size() - offset >= sizeof(record);
+      if (ok) {
+        memcpy(&record, content.data() + offset, sizeof(record));
+        uint64_t valueBytes =
+            record.isLeaf ? record.keyNum * sizeof(uint64_t) : 0;
+        ok = record.keyNum <= maxSize() &&
+             content.size() - offset - sizeof(record) >=
+                 record.keyBytes + valueBytes &&
+             (record.isLeaf ||
+              (record.firstChild == nextChild && record.firstChild > i));
+        offsets[i] = offset;
+        offset += sizeof(record) + record.keyBytes + valueBytes;
+        nextChild += record.isLeaf ? 0 : record.keyNum + 1;
+      }
+    }
+    if (!ok || offset != content.size() || nextChild != header.nodeCount) {
+      cerr << "恢复时" << path << "内容损坏" << endl;
+      return false;
+    }
+    vector<BNode<T, Degree> *> nodes(header.nodeCount, nullptr);
+    vector<T> keys;
+    for (uint64_t i = header.nodeCount; ok && i--;) {
+      CompactNode record;
+      const char *data = content.data() + offsets[i];
+      memcpy(&record, data, sizeof(record));
+      data += sizeof(record);
+      ok = decodeKeyBlock(data, record.keyBytes, record.keyNum,
+                          record.keyEncoding, keys) &&
+           (record.level == 0) == (record.isLeaf != 0);
+      if (ok && record.isLeaf) {
+        LeafBNode<T, Degree> *leaf =
+            new (maxSize()) LeafBNode<T, Degree>(maxSize());
+        const char *values = data + record.keyBytes;
+        for (uint32_t j = 0; j < record.keyNum; ++j) {
+          uint64_t value;
+          memcpy(&value, values + j * sizeof(value), sizeof(value));
+          leaf->appendKeyValue(make_pair(keys[j], value));
+        }
+        nodes[i] = leaf;
+      } else if (ok) {
+        for (uint64_t j = 0; ok && j <= record.keyNum; ++j) {
+          ok = nodes[record.firstChild + j]->getLevel() + 1 == record.level;
+        }
+        if (ok) {
+          InnerBNode<T, Degree> *inner =
+              new (maxSize()) InnerBNode<T, Degree>(record.level, maxSize());
+          inner->appendChild(T(), nodes[record.firstChild]);
+          for (uint32_t j = 0; j < record.keyNum; ++j) {
+            inner->appendChild(keys[j], nodes[record.firstChild + j + 1]);
+          }
+          nodes[i] = inner;
+        }
+      }
+    }
+    if (!ok) {
+      cerr << "恢复时" << path << "内容损坏" << endl;
+      //已经建好的节点还没挂到父节点上，逐个释放
+      for (BNode<T, Degree> *node : nodes) {
+        delete node;
+      }
+      return false;
+    }
+    if (_root) {
+      B_Plus_Tree_Clear();
+    }
+    _root = nodes[0];
+    _Head = nullptr;
+    LeafBNode<T, Degree> *last = nullptr;
+    for (BNode<T, Degree> *node : nodes) {
+      if (node->isLeaf()) {
+        LeafBNode<T, Degree> *leaf = static_cast<LeafBNode<T, Degree> *>(node);
+        if (last) {
+          last->setNext(leaf);
+          leaf->setPrev(last);
+        } else {
+          _Head = leaf;
+        }
+        last = leaf;
+      }
+    }
+    linkInnerRights();
+    _checkpointSynced = false;
+    return true;
+  }
+
+  /**
+   * @brief 打开预写日志，之后插入、删除、修改都先记日志，落盘后才返回
+   * 检查点存在时先从它恢复，再回放检查点之后的日志；不存在时把日志回放到当前的树上，
+   * 再做一次检查点。调用期间不能有其它线程访问这棵树
+   * @param checkpointPath B_Plus_Tree_Checkpoint写出的分页文件
+   * @return 检查点或日志打不开、内容损坏返回false，不开启日志
+   */
+  bool B_Plus_Tree_Open_Log(const string &checkpointPath,
+                            const string &logPath) {
+    if constexpr (!is_trivially_copyable<T>::value) {
+      cerr << "检查点只支持定长关键字" << endl;
+      return false;
+    } else {
+      _wal.reset();
+      PageFileHeader header;
+      const bool hasCheckpoint = readPageFileHeader(checkpointPath, header);
+      if (hasCheckpoint && !B_Plus_Tree_Load(checkpointPath)) {
+        return false;
+      }
+      //Load会先写回页日志，文件头要重新读
+      if (hasCheckpoint && !readPageFileHeader(checkpointPath, header)) {
+        return false;
+      }
+      const uint64_t checkpointLsn = hasCheckpoint ? header.checkpointLsn : 0;
+      unique_ptr<WriteAheadLog> wal(new WriteAheadLog());
+      bool replayed = true;
+      bool opened = wal->open(
+          logPath, [&](const uint64_t &lsn, const uint8_t &op,
+                       const char *payload, const size_t &size) {
+            //检查点之前的记录已经在检查点里了
+            if (lsn >= checkpointLsn && replayed) {
+              replayed = replayRecord(op, payload, size);
+            }
+          });
+      if (!opened || !replayed) {
+        cerr << "日志" << logPath << "回放失败" << endl;
+        return false;
+      }
+      _wal = std::move(wal);
+      _checkpointPath = checkpointPath;
+      //打包的文件节点和页对不上，第一次检查点整棵树重写
+      _checkpointSynced =
+          hasCheckpoint && !(header.flags & PAGE_FILE_PACKED_KEYS);
+      return hasCheckpoint || B_Plus_Tree_Checkpoint();
+    }
+  }
+
+  /**
+   * @brief 检查点：把树写进检查点文件后清空日志，调用期间不能有写者
+   * 节点和检查点文件里的页对应上以后只写上次检查点之后改过的页和回收的页，
+   * 经页日志改名生效；第一次或对应关系丢了时整棵树写到临时文件再改名。
+   * 任何时候崩溃，磁盘上都有一个完整的检查点和它之后的日志。
+   * 增量检查点在原位改写页，检查点文件不能同时给MappedBPlusTree映射，
+   * 只读副本要映射B_Plus_Tree_Save或B_Plus_Tree_Snapshot另写的文件
+   * @return 没开日志或写盘失败返回false
+   */
+  bool B_Plus_Tree_Checkpoint() {
+    if (!_wal || !_wal->commit(_wal->endLsn())) {
+      return false;
+    }
+    const uint64_t lsn = _wal->endLsn();
+    bool ok = _checkpointSynced ? checkpointDirty(lsn) : checkpointFull(lsn);
+    if (!ok) {
+      cerr << "检查点" << _checkpointPath << "写入失败" << endl;
+      _checkpointSynced = false;
+      return false;
+    }
+    return _wal->reset();
+  }
+
+  /**
+   * @brief 快照：写者照常插入删除，把开始那一刻的树写成一个新的分页文件
+   * 开始时关一下写闸门，等正在进行的写操作做完就记下根和日志位置；之后节点第一次被改前
+   * 存一份原来的内容，写快照时改过的节点用存下的内容，写者只多一次拷贝，不等写盘。
+   * 写到临时文件再改名，文件头记下开始时的日志位置，可以作为B_Plus_Tree_Open_Log的检查点，
+   * 但不清空日志。快照期间被合并掉的节点要等快照写完才释放
+   * @return 写盘失败返回false，原来的文件不变
+   */
+  bool B_Plus_Tree_Snapshot(const string &path) {
+    if constexpr (!is_trivially_copyable<T>::value) {
+      cerr << "分页文件只支持定长关键字" << endl;
+      return false;
+    } else {
+      lock_guard<mutex> snapshotLock(_snapshotMutex);
+      //先进epoch临界区，之后退休的节点都不会被释放
+      EpochGuard guard;
+      SnapshotState<T, Degree> state(++_snapshotEpoch);
+      BNode<T, Degree> *root;
+      uint64_t lsn;
+      {
+        lock_guard<WriteGate> gate(_writeGate);
+        _snapshot = &state;
+        root = _root.load();
+        lsn = _wal ? _wal->endLsn() : 0;
+      }
+      bool ok = writeSnapshot(path, root, state, lsn);
+      {
+        //还在写操作里的线程可能拿着state，等它们出去
+        lock_guard<WriteGate> gate(_writeGate);
+        _snapshot = nullptr;
+      }
+      if (!ok) {
+        cerr << "快照" << path << "写入失败" << endl;
+      }
+      return ok;
+    }
+  }
+
+  /* 在后台线程里做快照 */
+  future<bool> B_Plus_Tree_Snapshot_Async(const string &path) {
+    return async(launch::async,
+                 [this, path] { return B_Plus_Tree_Snapshot(path); });
+  }
+
+  size_type getMAX_SIZE() { return maxSize(); }
+  /* 度数，给定Degree时是编译期常量 */
+  size_type maxSize() const { return BNode<T, Degree>::degree(_MAX_SIZE); }
   string getName() { return _name; }
   void setName(string name) { _name = name; }
 
@@ -1151,40 +2375,1407 @@ class BPlusTree {
     cout << "---------------创建一课空的B+树--------------" << endl;
 #endif
     if (!_root) {
-      _root = new LeafBNode<T>();
+      _root = new (maxSize()) LeafBNode<T, Degree>(maxSize());
       setHead();
     }
   }
-  void setHead() { _Head = static_cast<LeafBNode<T> *>(_root); }
   /**
-   * @brief 利用层序遍历清空树
+   * @brief 乐观插入
+   * 下降到叶子，只给叶子加写锁，见lockLeaf
+   * @param lsn 开了日志时带回插入记录的位置
+   * @return 叶子要分裂时返回false
    */
-  void B_Plus_Tree_Clear() {
-    typedef typename vector<T>::size_type size_type;
-    queue<BNode<T> *> q;
-    q.push(_root);
-    while (!q.empty()) {
-      BNode<T> *temp = q.front();
-      q.pop();
-      if (!temp->isLeaf()) {
-        InnerBNode<T> *tempInner = static_cast<InnerBNode<T> *>(temp);
-        for (size_type i = 0; i < tempInner->getChildNum(); ++i) {
-          q.push(tempInner->getChild(i));
-        }
+  bool insertOptimistic(const pair<T, uint64_t> &data, uint64_t &lsn) {
+    BNode<T, Degree> *path[MAX_HEIGHT];
+    size_type depth;
+    while (true) {
+      LeafBNode<T, Degree> *leaf = lockLeaf(data.first, path, depth);
+      if (!leaf) {
+        continue;
       }
-      delete temp;
+      if (!leaf->isSafe(maxSize(), true)) {
+        leaf->getMutex().unlock();
+        return false;
+      }
+      leaf->addKeyValue(data);
+      lsn = logRecord(LOG_INSERT, data.first, data.second);
+      leaf->getMutex().unlock();
+      return true;
+    }
+  }
+
+  /**
+   * @brief 会引起分裂的插入，调用前持有_smoMutex的读锁
+   * 叶子分裂只锁叶子，再一层层把新节点挂到父节点上，每次只锁一个节点
+   */
+  void insertWithSplit(const pair<T, uint64_t> &data, uint64_t &lsn) {
+    BNode<T, Degree> *path[MAX_HEIGHT];
+    size_type depth;
+    while (true) {
+      LeafBNode<T, Degree> *leaf = lockLeaf(data.first, path, depth);
+      if (!leaf) {
+        continue;
+      }
+      //上次分裂出的右兄弟还没挂上去，先不分裂
+      if (leaf->getKeyNum() + 1 >= maxSize() && leaf->isRightPending()) {
+        leaf->getMutex().unlock();
+        this_thread::yield();
+        continue;
+      }
+      leaf->addKeyValue(data);
+      lsn = logRecord(LOG_INSERT, data.first, data.second);
+      if (leaf->getKeyNum() < maxSize()) {
+        leaf->getMutex().unlock();
+      } else {
+        splitAndPost(leaf, path, depth);
+      }
+      return;
+    }
+  }
+
+  /**
+   * @brief 乐观删除：下降到叶子，只给叶子加写锁，见lockLeaf
+   * 删叶子的第一个关键字可能要改祖先的分隔关键字，删完不够半满要借或合并，
+   * 这两种情况和空树都交给deleteWithRebalance
+   * @param lsn 开了日志时带回删除记录的位置
+   * @return 要加锁下降删除时返回false
+   */
+  bool deleteOptimistic(const T &k, uint64_t &lsn) {
+    BNode<T, Degree> *path[MAX_HEIGHT];
+    size_type depth;
+    while (true) {
+      LeafBNode<T, Degree> *leaf = lockLeaf(k, path, depth, true);
+      if (!leaf) {
+        continue;
+      }
+      size_type index = leaf->getKeyIndex(k);
+      bool found = index < leaf->getKeyNum();
+      //叶子锁着时它不会不再是根，也不会变成根
+      bool isRoot = leaf == _root.load();
+      if (!leaf->getKeyNum() ||
+          (found && !isRoot && (!index || !leaf->isSafe(maxSize(), false)))) {
+        leaf->getMutex().unlock();
+        return false;
+      }
+      //没找到时什么也没改，不记日志，也不用等刷盘
+      if (found) {
+        leaf->eraseKeyValue(index);
+        lsn = logRecord(LOG_DELETE, k);
+      }
+      leaf->getMutex().unlock();
+      return true;
+    }
+  }
+
+  /**
+   * @brief 加锁下降的删除，调用前持有_smoMutex的写锁
+   * @return 开了日志并且删了关键字时删除记录的位置，否则返回0
+   */
+  uint64_t deleteWithRebalance(const T &k) {
+    deque<OptLock *> q_w_lock;
+    _mutex.lock();
+    q_w_lock.push_back(&_mutex);
+    BNode<T, Degree> *deleteRoot = _root;
+    deleteRoot->getMutex().lock();
+    q_w_lock.push_back(&deleteRoot->getMutex());
+    if (!deleteRoot->getKeyNum()) {
+      cout << "无法删除" << endl;
+      while (!q_w_lock.empty()) {
+        q_w_lock.back()->unlock();
+        q_w_lock.pop_back();
+      }
+      return 0;
     }
-    _root = nullptr;
-    _Head = nullptr;
 #ifndef NDEBUG
-    cout << "----------------B+树已清空----------------" << endl;
+    cout << "------------------开始删除<" << k << ">------------------" << endl;
 #endif
+
+    bool hasNewKey = false;
+    bool deleted = false;
+    deleteRoot->deleteKey(k, maxSize(), q_w_lock, hasNewKey, deleted);
+    //顶层没节点了
+    if (q_w_lock.size() > 1 && deleteRoot->getKeyNum() == 0 &&
+        !deleteRoot->isLeaf()) {
+      InnerBNode<T, Degree> *oldRoot =
+          dynamic_cast<InnerBNode<T, Degree> *>(deleteRoot);
+      q_w_lock.pop_back();
+      if (oldRoot) {
+        _root = oldRoot->getChild(0);
+        oldRoot->getMutex().unlockObsolete();
+        EpochManager::instance().retire(oldRoot);
+      }
+    }
+    //还锁着时记日志，和并发插入在日志里的先后与内存一致
+    uint64_t lsn = deleted ? logRecord(LOG_DELETE, k) : 0;
+    while (!q_w_lock.empty()) {
+      q_w_lock.back()->unlock();
+      q_w_lock.pop_back();
+    }
+    return lsn;
   }
-  BNode<T> *_root = nullptr;
-  const size_type _MAX_SIZE;
-  LeafBNode<T> *_Head = nullptr;
-  string _name;
-  shared_mutex _mutex;
+
+  /**
+   * @brief 分裂满了的节点，并把新节点挂到父节点上，父节点满了继续往上
+   * 右兄弟还没挂上来的节点不再分裂，保证node的右兄弟始终是新节点
+   * @param node 已加写锁的满节点，返回前会解锁
+   * @param path 下降时经过的祖先，可能已经分裂过，靠右链找到真正的父节点
+   */
+  void splitAndPost(BNode<T, Degree> *node, BNode<T, Degree> **path,
+                    size_type depth) {
+    while (true) {
+      pair<BNode<T, Degree> *, T> info = node->splitRight(maxSize());
+      if (node == _root.load()) {
+#ifndef NDEBUG
+        cout << "-------------------顶层节点满了---------------" << endl;
+#endif
+        _root = new (maxSize())
+            InnerBNode<T, Degree>(node, info.second, info.first, maxSize());
+        node->setRightPending(false);
+        node->getMutex().unlock();
+        return;
+      }
+      node->getMutex().unlock();
+      InnerBNode<T, Degree> *start =
+          depth ? static_cast<InnerBNode<T, Degree> *>(path[--depth])
+                : findParent(node, info.second);
+      InnerBNode<T, Degree> *parent = lockParent(start, node);
+      parent->insertChild(parent->getChildPos(node), info.second, info.first);
+      //父节点锁着时再锁node，和自顶向下的加锁顺序一致
+      node->getMutex().lock();
+      node->setRightPending(false);
+      node->getMutex().unlock();
+      if (parent->getKeyNum() < maxSize()) {
+        parent->getMutex().unlock();
+        return;
+      }
+      node = parent;
+    }
+  }
+
+  /**
+   * @brief 从start沿右链找到child所在的节点并加写锁
+   * child还没挂上来，或者父节点再插一个就要分裂而它上次分裂还没挂上去时，等待后重找
+   */
+  InnerBNode<T, Degree> *lockParent(InnerBNode<T, Degree> *const &start,
+                            BNode<T, Degree> *const &child) {
+    InnerBNode<T, Degree> *parent = start;
+    parent->getMutex().lock();
+    while (true) {
+      if (parent->getChildPos(child) == parent->getChildNum()) {
+        InnerBNode<T, Degree> *right = parent->getRightInner();
+        if (right) {
+          right->getMutex().lock();
+          parent->getMutex().unlock();
+          parent = right;
+          continue;
+        }
+      } else if (parent->getKeyNum() + 1 < maxSize() ||
+                 !parent->isRightPending()) {
+        return parent;
+      }
+      parent->getMutex().unlock();
+      this_thread::yield();
+      parent = start;
+      parent->getMutex().lock();
+    }
+  }
+
+  /**
+   * @brief 下降时child还是根，后来树长高了，从新根找child所在层的上一层
+   * @return 上一层中按key路由到的节点，真正的父节点在它或它的右边
+   */
+  InnerBNode<T, Degree> *findParent(BNode<T, Degree> *const &child,
+                                    const T &key) {
+    BNode<T, Degree> *node = _root.load();
+    shared_lock<OptLock> r_lock(node->getMutex());
+    while (node->getLevel() > child->getLevel() + 1) {
+      InnerBNode<T, Degree> *inner = static_cast<InnerBNode<T, Degree> *>(node);
+      BNode<T, Degree> *next = inner->getChild(inner->getInsertIndex(key));
+      shared_lock<OptLock> next_lock(next->getMutex());
+      while (BNode<T, Degree> *right = next->moveRight(key, false)) {
+        shared_lock<OptLock> right_lock(right->getMutex());
+        next_lock.swap(right_lock);
+        next = right;
+      }
+      r_lock.swap(next_lock);
+      node = next;
+    }
+    return static_cast<InnerBNode<T, Degree> *>(node);
+  }
+
+  /* 沿读锁下降，给叶子加写锁改值，改完在写锁里调用onUpdate */
+  template <typename Func>
+  bool updateInPlace(const T &k, const uint64_t &value, Func onUpdate) {
+    EpochGuard guard;
+    while (true) {
+      BNode<T, Degree> *root = _root.load();
+      if (root->isLeaf()) {
+        unique_lock<OptLock> w_lock(root->getMutex());
+        if (root != _root.load() || root->getMutex().isObsolete()) {
+          continue;
+        }
+        return static_cast<LeafBNode<T, Degree> *>(root)->updateValue(
+            k, value, w_lock, onUpdate);
+      }
+      shared_lock<OptLock> r_lock(root->getMutex());
+      if (root != _root.load() || root->getMutex().isObsolete()) {
+        continue;
+      }
+      return static_cast<InnerBNode<T, Degree> *>(root)->updateValue(
+          k, value, r_lock, onUpdate);
+    }
+  }
+
+  /**
+   * @brief 乐观查找
+   * 下降和读叶子都只读版本号，不写任何共享内存，版本号对不上就重启
+   */
+  optional<uint64_t> searchOptimistic(const T &k) const {
+    BNode<T, Degree> *path[MAX_HEIGHT];
+    size_type depth;
+    uint64_t version;
+    while (true) {
+      LeafBNode<T, Degree> *leaf =
+          descendOptimistic(k, path, depth, version, true);
+      if (!leaf) {
+        this_thread::yield();
+        continue;
+      }
+      optional<uint64_t> value = leaf->findValue(k);
+      if (leaf->getMutex().validate(version)) {
+        return value;
+      }
+    }
+  }
+
+  /**
+   * @brief 沿路径加读锁下降到k所在的叶子，遇见相等的关键字向右走
+   * 返回时只持有叶子的读锁，调用者持有EpochGuard
+   */
+  LeafBNode<T, Degree> *lockLeafShared(const T &k) const {
+    BNode<T, Degree> *node = lockRootShared();
+    while (!node->isLeaf()) {
+      InnerBNode<T, Degree> *inner = static_cast<InnerBNode<T, Degree> *>(node);
+      BNode<T, Degree> *child = inner->getChild(inner->getChildIndex(k));
+      child->getMutex().lock_shared();
+      node->getMutex().unlock_shared();
+      node = child;
+    }
+    return static_cast<LeafBNode<T, Degree> *>(node);
+  }
+
+  /* 沿最右边的孩子加读锁下降，返回时只持有最右叶子的读锁 */
+  LeafBNode<T, Degree> *lockLastLeafShared() const {
+    BNode<T, Degree> *node = lockRootShared();
+    while (!node->isLeaf()) {
+      InnerBNode<T, Degree> *inner = static_cast<InnerBNode<T, Degree> *>(node);
+      BNode<T, Degree> *child = inner->getChild(inner->getChildNum() - 1);
+      child->getMutex().lock_shared();
+      node->getMutex().unlock_shared();
+      node = child;
+    }
+    return static_cast<LeafBNode<T, Degree> *>(node);
+  }
+
+  /* 给当前的根加读锁，加锁期间根被换掉就重来 */
+  BNode<T, Degree> *lockRootShared() const {
+    while (true) {
+      BNode<T, Degree> *root = _root.load();
+      root->getMutex().lock_shared();
+      if (root == _root.load() && !root->getMutex().isObsolete()) {
+        return root;
+      }
+      root->getMutex().unlock_shared();
+    }
+  }
+
+  /**
+   * @brief 批量查找中一个关键字乐观下降一步
+   * 取到下一层节点后只预取不读，下一步才读它的版本号
+   * @return 在叶子上查完并校验通过返回STEP_DONE，结果写入value
+   */
+  StepState stepOptimistic(const T &k, SearchLane &lane,
+                           optional<uint64_t> &value) const {
+    if (!lane.node) {
+      lane.node = _root.load();
+      if (!lane.node->getMutex().readVersion(lane.version) ||
+          lane.node != _root.load()) {
+        lane.node = nullptr;
+        return STEP_RESTART;
+      }
+    } else if (lane.fresh && !lane.node->getMutex().readVersion(lane.version)) {
+      lane.node = nullptr;
+      return STEP_RESTART;
+    }
+    lane.fresh = false;
+    BNode<T, Degree> *node = lane.node;
+    BNode<T, Degree> *right = node->moveRight(k, true);
+    bool wrongNode = node->belowLowKey(k);
+    if (node->isLeaf() && !right && !wrongNode) {
+      value = static_cast<LeafBNode<T, Degree> *>(node)->findValue(k);
+      if (node->getMutex().validate(lane.version)) {
+        return STEP_DONE;
+      }
+      lane.node = nullptr;
+      return STEP_RESTART;
+    }
+    BNode<T, Degree> *child = nullptr;
+    bool childIsLeaf = false;
+    if (!node->isLeaf()) {
+      InnerBNode<T, Degree> *inner = static_cast<InnerBNode<T, Degree> *>(node);
+      child = inner->getChild(inner->getChildIndex(k));
+      childIsLeaf = inner->getLevel() == 1;
+    }
+    //校验通过后读到的指针才能解引用
+    if (!node->getMutex().validate(lane.version) || wrongNode) {
+      lane.node = nullptr;
+      return STEP_RESTART;
+    }
+    if (right) {
+      lane.node = right;
+      prefetchNode(right, node->isLeaf());
+    } else {
+      lane.node = child;
+      prefetchNode(child, childIsLeaf);
+    }
+    lane.fresh = true;
+    return STEP_MOVED;
+  }
+
+  /* 预取节点，节点类型由调用者根据层数给出 */
+  void prefetchNode(const BNode<T, Degree> *node, const bool &isLeaf) const {
+    if (isLeaf) {
+      LeafBNode<T, Degree>::prefetch(
+          static_cast<const LeafBNode<T, Degree> *>(node), maxSize());
+    } else {
+      InnerBNode<T, Degree>::prefetch(
+          static_cast<const InnerBNode<T, Degree> *>(node), maxSize());
+    }
+  }
+
+  /**
+   * @brief 下降到k所在的叶子并加写锁，记录路径上的节点
+   * 定长关键字乐观下降后按版本号给叶子加锁；string这类关键字在写者改节点时
+   * 不能读，沿路径加读锁下降，和B_Plus_Tree_Search一样
+   * @param forSearch 遇见相等的关键字是否向右走，见descendOptimistic
+   * @return 乐观下降要重启时返回nullptr
+   */
+  LeafBNode<T, Degree> *lockLeaf(const T &k, BNode<T, Degree> **path,
+                                 size_type &depth,
+                                 const bool &forSearch = false) {
+    if constexpr (is_trivially_copyable<T>::value) {
+      uint64_t version;
+      LeafBNode<T, Degree> *leaf =
+          descendOptimistic(k, path, depth, version, forSearch);
+      if (!leaf) {
+        this_thread::yield();
+        return nullptr;
+      }
+      return leaf->getMutex().lockIfVersion(version) ? leaf : nullptr;
+    } else {
+      return descendLocked(k, path, depth, forSearch);
+    }
+  }
+
+  /**
+   * @brief 加锁下降到k所在的叶子，内部节点加读锁，叶子加写锁
+   * 先锁孩子再放父节点，沿右链走时先锁右兄弟再放自己，返回时只持有叶子的写锁
+   */
+  LeafBNode<T, Degree> *descendLocked(const T &k, BNode<T, Degree> **path,
+                                      size_type &depth,
+                                      const bool &forSearch) {
+    auto lockNode = [](BNode<T, Degree> *node, const bool &exclusive) {
+      if (exclusive) {
+        node->getMutex().lock();
+      } else {
+        node->getMutex().lock_shared();
+      }
+    };
+    auto unlockNode = [](BNode<T, Degree> *node, const bool &exclusive) {
+      if (exclusive) {
+        node->getMutex().unlock();
+      } else {
+        node->getMutex().unlock_shared();
+      }
+    };
+    depth = 0;
+    BNode<T, Degree> *node = _root.load();
+    //根就是叶子时直接加写锁
+    lockNode(node, node->isLeaf());
+    while (node != _root.load() || node->getMutex().isObsolete()) {
+      unlockNode(node, node->isLeaf());
+      node = _root.load();
+      lockNode(node, node->isLeaf());
+    }
+    while (true) {
+      const bool exclusive = node->isLeaf();
+      while (BNode<T, Degree> *right = node->moveRight(k, forSearch)) {
+        lockNode(right, exclusive);
+        unlockNode(node, exclusive);
+        node = right;
+      }
+      if (exclusive) {
+        return static_cast<LeafBNode<T, Degree> *>(node);
+      }
+      InnerBNode<T, Degree> *inner = static_cast<InnerBNode<T, Degree> *>(node);
+      BNode<T, Degree> *child = inner->getChild(
+          forSearch ? inner->getChildIndex(k) : inner->getInsertIndex(k));
+      path[depth++] = node;
+      lockNode(child, inner->getLevel() == 1);
+      unlockNode(node, false);
+      node = child;
+    }
+  }
+
+  /**
+   * @brief 不加锁地从根下降到叶子，记录路径上的节点
+   * 每个节点只校验自己的版本号，范围由高键、低键判断，不用回头校验父节点。
+   * 读到的关键字可能正在被改，只用于能按位读的定长关键字
+   * @param forSearch 查找时遇见相等的关键字向右走，插入时向左走
+   * @return 遇到正在被写的节点或走错了节点时返回nullptr，调用者应重启
+   */
+  LeafBNode<T, Degree> *descendOptimistic(const T &k, BNode<T, Degree> **path,
+                                          size_type &depth, uint64_t &version,
+                                          const bool &forSearch = false) const {
+    static_assert(is_trivially_copyable<T>::value,
+                  "string这类关键字要加锁下降");
+    depth = 0;
+    BNode<T, Degree> *node = _root.load();
+    if (!node->getMutex().readVersion(version) || node != _root.load()) {
+      return nullptr;
+    }
+    while (true) {
+      BNode<T, Degree> *right = node->moveRight(k, forSearch);
+      bool wrongNode = node->belowLowKey(k);
+      BNode<T, Degree> *child = nullptr;
+      if (!node->isLeaf()) {
+        InnerBNode<T, Degree> *inner =
+            static_cast<InnerBNode<T, Degree> *>(node);
+        child = inner->getChild(forSearch ? inner->getChildIndex(k)
+                                          : inner->getInsertIndex(k));
+      }
+      //校验通过后读到的指针才能解引用
+      if (!node->getMutex().validate(version) || wrongNode) {
+        return nullptr;
+      }
+      //节点分裂了新节点还没挂到父节点上，或者按旧的父节点走过来，沿右链找
+      if (right) {
+        node = right;
+        if (!node->getMutex().readVersion(version)) {
+          return nullptr;
+        }
+        continue;
+      }
+      if (!child) {
+        break;
+      }
+      if (depth == MAX_HEIGHT) {
+        return nullptr;
+      }
+      path[depth++] = node;
+      node = child;
+      if (!node->getMutex().readVersion(version)) {
+        return nullptr;
+      }
+    }
+    return static_cast<LeafBNode<T, Degree> *>(node);
+  }
+
+  /* 层序收集所有节点，同一层的节点连续，叶子按关键字顺序排在最后 */
+  vector<BNode<T, Degree> *> collectNodes() const {
+    vector<BNode<T, Degree> *> nodes;
+    nodes.push_back(_root);
+    for (size_type i = 0; i < nodes.size(); ++i) {
+      if (!nodes[i]->isLeaf()) {
+        InnerBNode<T, Degree> *inner =
+            static_cast<InnerBNode<T, Degree> *>(nodes[i]);
+        for (size_type j = 0; j < inner->getChildNum(); ++j) {
+          nodes.push_back(inner->getChild(j));
+        }
+      }
+    }
+    return nodes;
+  }
+
+  PageFileHeader makePageFileHeader(const page_id &root, const page_id &head,
+                                    const uint64_t &pageCount,
+                                    const uint64_t &checkpointLsn) const {
+    PageFileHeader header{};
+    header.magic = PAGE_FILE_MAGIC;
+    header.version = PAGE_FILE_VERSION;
+    header.pageSize = PageLayout<T>::pageSize(maxSize());
+    header.maxSize = maxSize();
+    header.keySize = sizeof(T);
+    header.root = root;
+    header.head = head;
+    header.pageCount = pageCount;
+    header.checkpointLsn = checkpointLsn;
+    return header;
+  }
+
+  /**
+   * @brief 把nodes按idOf给的页号1..n依次写成一个新的分页文件
+   * 页攒够一批再一次写出，整个文件是顺序写
+   * @param packKeys 叶子的关键字能打包时打包，见B_Plus_Tree_Save_Packed
+   */
+  template <typename IdOf>
+  bool writePageFile(const string &path,
+                     const vector<BNode<T, Degree> *> &nodes, IdOf idOf,
+                     const uint64_t &checkpointLsn,
+                     const bool &packKeys = false) const {
+    PageFile file;
+    if (!file.open(path, true)) {
+      cerr << "保存时" << path << "打开失败" << endl;
+      return false;
+    }
+    const size_t pageSize = PageLayout<T>::pageSize(maxSize());
+    const size_type batchPages =
+        max(PAGE_WRITE_BATCH / pageSize, static_cast<size_t>(1));
+    vector<char> buffer(pageSize * batchPages);
+    PageFileHeader header = makePageFileHeader(
+        idOf(_root), idOf(_Head), nodes.size() + 1, checkpointLsn);
+    if (packKeys) {
+      header.flags |= PAGE_FILE_PACKED_KEYS;
+    }
+    //第0页是文件头，之后第i页是nodes[i-1]
+    uint64_t offset = 0;
+    size_type filled = 0;
+    for (size_type i = 0; i <= nodes.size(); ++i) {
+      char *page = buffer.data() + filled * pageSize;
+      fill(page, page + pageSize, 0);
+      if (i) {
+        encodePage(nodes[i - 1], page, idOf, packKeys);
+      } else {
+        copy_n(reinterpret_cast<const char *>(&header), sizeof(header), page);
+      }
+      if (++filled == batchPages || i == nodes.size()) {
+        if (!file.writeAt(buffer.data(), filled * pageSize, offset)) {
+          cerr << "保存时" << path << "写入失败" << endl;
+          return false;
+        }
+        offset += filled * pageSize;
+        filled = 0;
+      }
+    }
+    return file.sync();
+  }
+
+  /* 整棵树按层序重新编页号写到临时文件，再替换检查点文件 */
+  bool checkpointFull(const uint64_t &lsn) {
+    vector<BNode<T, Degree> *> nodes = collectNodes();
+    for (size_type i = 0; i < nodes.size(); ++i) {
+      nodes[i]->setPageId(i + 1);
+    }
+    string temp = _checkpointPath + ".tmp";
+    //旧文件的页日志不能写回到新文件上
+    string journal = pageJournalPath(_checkpointPath);
+    if (!writePageFile(
+            temp, nodes,
+            [](BNode<T, Degree> *node) { return node->getPageId(); },
+            lsn) ||
+        (::remove(journal.c_str()) != 0 && errno != ENOENT) ||
+        ::rename(temp.c_str(), _checkpointPath.c_str()) != 0 ||
+        !syncParentDirectory(_checkpointPath)) {
+      return false;
+    }
+    _livePages.assign(nodes.size() + 1, true);
+    _livePages[INVALID_PAGE] = false;
+    _freePages.clear();
+    for (BNode<T, Degree> *node : nodes) {
+      node->clearDirty();
+    }
+    _checkpointSynced = true;
+    return true;
+  }
+
+  /**
+   * @brief 只写上次检查点之后改过的节点和刚回收的页
+   * 新节点先复用回收的页号，不够再往后分配；改过的页经页日志写回原位
+   */
+  bool checkpointDirty(const uint64_t &lsn) {
+    vector<BNode<T, Degree> *> nodes = collectNodes();
+    vector<bool> live(_livePages.size(), false);
+    for (BNode<T, Degree> *node : nodes) {
+      if (node->getPageId() >= live.size()) {
+        return false;
+      }
+      if (node->getPageId() != INVALID_PAGE) {
+        live[node->getPageId()] = true;
+      }
+    }
+    vector<page_id> freePages(_freePages);
+    for (page_id id = 1; id < _livePages.size(); ++id) {
+      if (_livePages[id] && !live[id]) {
+        freePages.push_back(id);
+      }
+    }
+    //新节点先分到页号，引用它的父节点和兄弟才能编码
+    uint64_t pageCount = _livePages.size();
+    for (BNode<T, Degree> *node : nodes) {
+      if (node->getPageId() == INVALID_PAGE) {
+        if (freePages.empty()) {
+          node->setPageId(pageCount++);
+        } else {
+          node->setPageId(freePages.back());
+          freePages.pop_back();
+        }
+      }
+    }
+    const size_t pageSize = PageLayout<T>::pageSize(maxSize());
+    auto idOf = [](BNode<T, Degree> *node) { return node->getPageId(); };
+    vector<page_id> ids;
+    vector<char> images;
+    for (BNode<T, Degree> *node : nodes) {
+      if (node->isDirty()) {
+        ids.push_back(node->getPageId());
+        images.resize(images.size() + pageSize, 0);
+        encodePage(node, images.data() + images.size() - pageSize, idOf);
+      }
+    }
+    //这次才回收的页标成空页，之前回收的已经标过了
+    for (const page_id &id : freePages) {
+      if (id < _livePages.size() && _livePages[id]) {
+        ids.push_back(id);
+        images.resize(images.size() + pageSize, 0);
+        PageLayout<T>::node(images.data() + images.size() - pageSize)->isFree =
+            1;
+      }
+    }
+    PageFileHeader header = makePageFileHeader(
+        idOf(_root), idOf(_Head), pageCount, lsn);
+    if (!writePageJournal(_checkpointPath, header, ids, images) ||
+        !applyPageJournal(_checkpointPath)) {
+      return false;
+    }
+    _livePages.assign(pageCount, false);
+    for (BNode<T, Degree> *node : nodes) {
+      _livePages[node->getPageId()] = true;
+      node->clearDirty();
+    }
+    _freePages = std::move(freePages);
+    return true;
+  }
+
+  /**
+   * @brief 把节点编码进一页，页已清零，idOf给出节点的页号
+   * @param packKeys 叶子的关键字打包后比原样存短时存打包的块
+   */
+  template <typename IdOf>
+  void encodePage(BNode<T, Degree> *node, char *page, IdOf idOf,
+                  const bool &packKeys = false) const {
+    typedef PageLayout<T> layout;
+    PageNode *header = layout::node(page);
+    header->isLeaf = node->isLeaf();
+    header->keyNum = node->getKeyNum();
+    header->level = node->getLevel();
+    const NodeArray<T> &keys = node->getAllKeys();
+    if constexpr (PackableKey<T>::value) {
+      string block;
+      if (packKeys && node->isLeaf() &&
+          ::packKeys(keys.begin(), keys.size(), block) &&
+          block.size() < keys.size() * sizeof(T)) {
+        header->keyEncoding = PAGE_KEYS_PACKED;
+        copy(block.begin(), block.end(),
+             reinterpret_cast<char *>(layout::keys(page)));
+      }
+    }
+    if (header->keyEncoding == PAGE_KEYS_RAW) {
+      copy(keys.begin(), keys.end(), layout::keys(page));
+    }
+    uint64_t *values = layout::values(page, maxSize());
+    if (node->isLeaf()) {
+      LeafBNode<T, Degree> *leaf = static_cast<LeafBNode<T, Degree> *>(node);
+      copy(leaf->getAllValues().begin(), leaf->getAllValues().end(), values);
+      header->next = leaf->getNext() ? idOf(leaf->getNext()) : INVALID_PAGE;
+      header->prev = leaf->getPrev() ? idOf(leaf->getPrev()) : INVALID_PAGE;
+    } else {
+      InnerBNode<T, Degree> *inner = static_cast<InnerBNode<T, Degree> *>(node);
+      for (size_type i = 0; i < inner->getChildNum(); ++i) {
+        values[i] = idOf(inner->getChild(i));
+      }
+    }
+  }
+
+  /* 把快照存下的节点内容编码进一页，同encodePage */
+  template <typename IdOf>
+  void encodeImage(const NodeImage<T, Degree> &image, char *page,
+                   IdOf idOf) const {
+    typedef PageLayout<T> layout;
+    PageNode *header = layout::node(page);
+    header->isLeaf = image.isLeaf;
+    header->keyNum = image.keys.size();
+    header->level = image.level;
+    copy(image.keys.begin(), image.keys.end(), layout::keys(page));
+    uint64_t *values = layout::values(page, maxSize());
+    if (image.isLeaf) {
+      copy(image.values.begin(), image.values.end(), values);
+      header->next = image.next ? idOf(image.next) : INVALID_PAGE;
+      header->prev = image.prev ? idOf(image.prev) : INVALID_PAGE;
+    } else {
+      for (size_type i = 0; i < image.children.size(); ++i) {
+        values[i] = idOf(image.children[i]);
+      }
+    }
+  }
+
+  /**
+   * @brief 按层序把快照开始时的树写到path的临时文件，再改名
+   * 每次只给一个节点加读锁：改过的节点用state里存下的内容，没改过的直接编码。
+   * 孩子在父节点编码时按发现的顺序分到页号，叶子都在最后一层，编码时左右兄弟都已分到
+   */
+  bool writeSnapshot(const string &path, BNode<T, Degree> *root,
+                     SnapshotState<T, Degree> &state, const uint64_t &lsn) {
+    string temp = path + ".tmp";
+    PageFile file;
+    if (!file.open(temp, true)) {
+      return false;
+    }
+    const size_t pageSize = PageLayout<T>::pageSize(maxSize());
+    const size_type batchPages =
+        max(PAGE_WRITE_BATCH / pageSize, static_cast<size_t>(1));
+    vector<char> buffer(pageSize * batchPages);
+    unordered_map<BNode<T, Degree> *, page_id> ids;
+    queue<BNode<T, Degree> *> q;
+    page_id pageCount = 1;
+    auto discover = [&](BNode<T, Degree> *node) {
+      if (ids.emplace(node, pageCount).second) {
+        ++pageCount;
+        q.push(node);
+      }
+    };
+    auto idOf = [&](BNode<T, Degree> *node) {
+      auto it = ids.find(node);
+      return it == ids.end() ? INVALID_PAGE : it->second;
+    };
+    discover(root);
+    page_id head = INVALID_PAGE;
+    //第0页是文件头，最后再写
+    uint64_t offset = pageSize;
+    size_type filled = 0;
+    while (!q.empty()) {
+      BNode<T, Degree> *node = q.front();
+      q.pop();
+      char *page = buffer.data() + filled * pageSize;
+      fill(page, page + pageSize, 0);
+      {
+        shared_lock<OptLock> r_lock(node->getMutex());
+        const NodeImage<T, Degree> *image =
+            node->getSnapshotEpoch() == state.epoch()
+                                        ? state.find(node)
+                                        : nullptr;
+        if (image) {
+          for (BNode<T, Degree> *child : image->children) {
+            discover(child);
+          }
+          encodeImage(*image, page, idOf);
+        } else {
+          if (!node->isLeaf()) {
+            InnerBNode<T, Degree> *inner =
+                static_cast<InnerBNode<T, Degree> *>(node);
+            for (size_type i = 0; i < inner->getChildNum(); ++i) {
+              discover(inner->getChild(i));
+            }
+          }
+          encodePage(node, page, idOf);
+        }
+      }
+      if (node->isLeaf() && head == INVALID_PAGE) {
+        head = ids[node];
+      }
+      if (++filled == batchPages || q.empty()) {
+        if (!file.writeAt(buffer.data(), filled * pageSize, offset)) {
+          return false;
+        }
+        offset += filled * pageSize;
+        filled = 0;
+      }
+    }
+    PageFileHeader header = makePageFileHeader(1, head, pageCount, lsn);
+    vector<char> headerPage(pageSize, 0);
+    copy_n(reinterpret_cast<const char *>(&header), sizeof(header),
+           headerPage.data());
+    bool ok = file.writeAt(headerPage.data(), pageSize, 0) && file.sync();
+    file.close();
+    return ok && ::rename(temp.c_str(), path.c_str()) == 0 &&
+           syncParentDirectory(path);
+  }
+
+  /**
+   * @brief 从一页建节点，内部节点的孩子调用时已经建好
+   * @param nextId 叶子右兄弟的页号
+   * @param referenced 记录哪些页已经被父节点引用过
+   * @return 页内容不合法或节点过满返回nullptr
+   */
+  BNode<T, Degree> *decodePage(const char *page,
+                               const vector<BNode<T, Degree> *> &nodes,
+                               page_id &nextId,
+                               vector<uint8_t> &referenced) const {
+    typedef PageLayout<T> layout;
+    const PageNode *header = layout::node(page);
+    const T *keys = layout::keys(page);
+    const uint64_t *values = layout::values(page, maxSize());
+    //内存树的节点到maxSize个关键字就分裂
+    if (header->keyNum >= maxSize()) {
+      return nullptr;
+    }
+    if (header->keyEncoding != PAGE_KEYS_RAW &&
+        (header->keyEncoding != PAGE_KEYS_PACKED || !header->isLeaf)) {
+      return nullptr;
+    }
+    if (header->isLeaf) {
+      if (header->next >= nodes.size()) {
+        return nullptr;
+      }
+      vector<T> unpacked;
+      if (header->keyEncoding == PAGE_KEYS_PACKED) {
+        if constexpr (PackableKey<T>::value) {
+          const char *block = reinterpret_cast<const char *>(keys);
+          if (!checkPackedBlockIn<T>(block, layout::keyBytes(maxSize()),
+                                     header->keyNum)) {
+            return nullptr;
+          }
+          unpacked.resize(header->keyNum);
+          unpackKeys(block, 0, header->keyNum, unpacked.data());
+          keys = unpacked.data();
+        } else {
+          return nullptr;
+        }
+      }
+      LeafBNode<T, Degree> *leaf =
+          new (maxSize()) LeafBNode<T, Degree>(maxSize());
+      for (size_type i = 0; i < header->keyNum; ++i) {
+        leaf->appendKeyValue(make_pair(keys[i], values[i]));
+      }
+      nextId = header->next;
+      return leaf;
+    }
+    for (size_type i = 0; i <= header->keyNum; ++i) {
+      if (values[i] >= nodes.size() || !nodes[values[i]] ||
+          referenced[values[i]] ||
+          nodes[values[i]]->getLevel() + 1 != header->level) {
+        return nullptr;
+      }
+      referenced[values[i]] = 1;
+    }
+    InnerBNode<T, Degree> *inner =
+        new (maxSize()) InnerBNode<T, Degree>(header->level, maxSize());
+    inner->appendChild(T(), nodes[values[0]]);
+    for (size_type i = 0; i < header->keyNum; ++i) {
+      inner->appendChild(keys[i], nodes[values[i + 1]]);
+    }
+    return inner;
+  }
+
+  /* 按层把内部节点的右链串起来，再设好各节点的高键、低键 */
+  void linkInnerRights() {
+    queue<BNode<T, Degree> *> q;
+    q.push(_root);
+    InnerBNode<T, Degree> *last = nullptr;
+    while (!q.empty()) {
+      BNode<T, Degree> *temp = q.front();
+      q.pop();
+      if (temp->isLeaf()) {
+        continue;
+      }
+      InnerBNode<T, Degree> *tempInner =
+          static_cast<InnerBNode<T, Degree> *>(temp);
+      if (last && last->getLevel() == tempInner->getLevel()) {
+        last->setRight(tempInner);
+      }
+      last = tempInner;
+      for (size_type i = 0; i < tempInner->getChildNum(); ++i) {
+        q.push(tempInner->getChild(i));
+      }
+    }
+    setFences(_root, nullptr, nullptr);
+  }
+
+  /**
+   * @brief 建树或恢复后按父节点的分隔关键字设好子树里各节点的高键、低键
+   * @param low 和左兄弟之间的分隔关键字，同一层最左边的节点为空
+   * @param high 和右兄弟之间的分隔关键字，同一层最右边的节点为空
+   */
+  void setFences(BNode<T, Degree> *const &node, const T *low, const T *high) {
+    if (low) {
+      node->setLowKey(*low);
+    }
+    if (high) {
+      node->setHighKey(*high);
+    }
+    if (node->isLeaf()) {
+      return;
+    }
+    InnerBNode<T, Degree> *inner = static_cast<InnerBNode<T, Degree> *>(node);
+    const NodeArray<T> &keys = inner->getAllKeys();
+    for (size_type i = 0; i < inner->getChildNum(); ++i) {
+      setFences(inner->getChild(i), i ? &keys[i - 1] : low,
+                i < inner->getKeyNum() ? &keys[i] : high);
+    }
+  }
+
+  /* 构造时传入的度数，编译期定了度数时只能传0或Degree */
+  static size_type initDegree(const size_type &max_size) {
+    assert(!Degree || !max_size || max_size == Degree);
+    return Degree ? Degree : max_size;
+  }
+
+  /* 键值对只按关键字比较 */
+  static bool keyLess(const pair<T, uint64_t> &a, const pair<T, uint64_t> &b) {
+    return a.first < b.first;
+  }
+
+  /* 节点(根除外)最少的关键字数，和isSafe的删除条件一致 */
+  size_type minKeyNum() const { return BNode<T, Degree>::minKeyNum(_MAX_SIZE); }
+
+  /* 按填充率算每个节点放多少项，不低于最小填充的两倍，末尾节点匀过后也够 */
+  size_type fillCount(const size_type &maxCount, const size_type &minCount,
+                      const double &fillFactor) const {
+    size_type count = static_cast<size_type>(maxCount * fillFactor);
+    count = max(count, min(2 * minCount, maxCount));
+    return max(min(count, maxCount), static_cast<size_type>(1));
+  }
+
+  /**
+   * @brief 批量建树的叶子层：一遍扫描，每个叶子填满就换下一个
+   * @return 每个叶子和它的最小关键字
+   */
+  template <typename InputIt>
+  vector<pair<T, BNode<T, Degree> *>> buildLeaves(InputIt first, InputIt last,
+                                          const double &fillFactor) {
+    size_type perLeaf = fillCount(maxSize() - 1, minKeyNum(), fillFactor);
+    vector<pair<T, BNode<T, Degree> *>> leaves;
+    LeafBNode<T, Degree> *leaf = nullptr;
+    for (; first != last; ++first) {
+      const pair<T, uint64_t> &kv = *first;
+      if (!leaf || leaf->getKeyNum() == perLeaf) {
+        LeafBNode<T, Degree> *next =
+            new (maxSize()) LeafBNode<T, Degree>(maxSize());
+        if (leaf) {
+          leaf->setNext(next);
+          next->setPrev(leaf);
+        }
+        leaf = next;
+        leaves.push_back(make_pair(kv.first, leaf));
+      }
+      leaf->appendKeyValue(kv);
+    }
+    //最后一个叶子太空，从前一个叶子借到最小填充以上
+    if (leaves.size() > 1 && leaf->getKeyNum() < minKeyNum()) {
+      BNode<T, Degree> *prev = leaves[leaves.size() - 2].second;
+      while (leaf->getKeyNum() < prev->getKeyNum()) {
+        leaves.back().first = leaf->borrowKey(prev, false, leaves.back().first);
+      }
+    }
+    return leaves;
+  }
+
+  /**
+   * @brief 批量建树时由下一层建出上一层，孩子平均分到各节点，同层用右链连起来
+   * @param level 下一层的节点和它们子树的最小关键字
+   * @param threadNum 节点多时分给几个线程建
+   */
+  vector<pair<T, BNode<T, Degree> *>> buildInnerLevel(
+      const vector<pair<T, BNode<T, Degree> *>> &level,
+      const double &fillFactor, const size_type &threadNum = 1) {
+    size_type perNode = fillCount(maxSize(), minKeyNum() + 1, fillFactor);
+    size_type nodeNum = (level.size() + perNode - 1) / perNode;
+    size_type base = level.size() / nodeNum;
+    size_type extra = level.size() % nodeNum;
+    size_type height = level.front().second->getLevel() + 1;
+    vector<pair<T, BNode<T, Degree> *>> upper(nodeNum);
+    size_type workers = max(min(threadNum, level.size() / PARALLEL_MIN_ITEMS),
+                            static_cast<size_type>(1));
+    parallelFor(nodeNum, workers,
+                [&](size_type id, size_type from, size_type to) {
+                  size_type index = from * base + min(from, extra);
+                  for (size_type i = from; i < to; ++i) {
+                    InnerBNode<T, Degree> *node =
+                        new (maxSize()) InnerBNode<T, Degree>(height,
+                                                              maxSize());
+                    upper[i] = make_pair(level[index].first, node);
+                    for (size_type j = 0; j < base + (i < extra); ++j) {
+                      node->appendChild(level[index].first,
+                                        level[index].second);
+                      ++index;
+                    }
+                  }
+                });
+    for (size_type i = 1; i < nodeNum; ++i) {
+      static_cast<InnerBNode<T, Degree> *>(upper[i - 1].second)
+          ->setRight(static_cast<InnerBNode<T, Degree> *>(upper[i].second));
+    }
+    return upper;
+  }
+
+  /* 把[0, count)切成threadNum段，每段起一个线程执行func(段号, from, to) */
+  template <typename Func>
+  static void parallelFor(const size_type &count, const size_type &threadNum,
+                          Func func) {
+    if (threadNum <= 1) {
+      func(0, 0, count);
+      return;
+    }
+    vector<thread> workers;
+    for (size_type i = 0; i < threadNum; ++i) {
+      workers.push_back(thread(func, i, i * count / threadNum,
+                               (i + 1) * count / threadNum));
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  void setHead() { _Head = static_cast<LeafBNode<T, Degree> *>(_root.load()); }
+
+  /**
+   * @brief 解析一个节点文件，叶子直接建好，内部节点先存下关键字和孩子的文件名
+   * @return 0:打不开或内容不对 1:内部节点 2:叶子
+   */
+  uint8_t parseNodeFile(const string &path, ParsedInner &inner,
+                        LeafBNode<T, Degree> *&leaf) const {
+    if constexpr (!is_integral<T>::value) {
+      //protobuf的关键字是int32，存不下string
+      return 0;
+    } else {
+      ifstream fr(path, ios::in | ios::binary);
+      bplustree::BNode pb_bnode;
+      if (!fr || !pb_bnode.ParseFromIstream(&fr) ||
+          static_cast<size_type>(pb_bnode._key_size()) > maxSize()) {
+        return 0;
+      }
+      if (pb_bnode._isleaf()) {
+        if (pb_bnode._value_size() != pb_bnode._key_size()) {
+          return 0;
+        }
+        leaf = new (maxSize()) LeafBNode<T, Degree>(pb_bnode, maxSize());
+        return 2;
+      }
+      if (pb_bnode._child_size() != pb_bnode._key_size() + 1) {
+        return 0;
+      }
+      inner.keys.assign(pb_bnode._key().begin(), pb_bnode._key().end());
+      inner.children.assign(pb_bnode._child().begin(),
+                            pb_bnode._child().end());
+      inner.uuid = pb_bnode._uuid();
+      return 1;
+    }
+  }
+
+  /**
+   * @brief 开了日志时把一次修改追加到日志缓冲，不刷盘
+   * 增删改都在叶子还锁着时调用，同一叶子上的修改在日志里和内存里先后一致
+   * @return 记录末尾的LSN，没开日志返回0
+   */
+  uint64_t logRecord(const uint8_t &op, const T &k) {
+    if (!_wal) {
+      return 0;
+    }
+    string payload;
+    encodeLogKey(k, payload);
+    return _wal->append(op, payload);
+  }
+  uint64_t logRecord(const uint8_t &op, const T &k, const uint64_t &value) {
+    if (!_wal) {
+      return 0;
+    }
+    string payload;
+    encodeLogKey(k, payload);
+    payload.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    return _wal->append(op, payload);
+  }
+
+  /* 放开所有锁之后等日志落盘，并发的提交由日志合成一次刷盘 */
+  void commitLog(const uint64_t &lsn) {
+    if (lsn) {
+      _wal->commit(lsn);
+    }
+  }
+
+  /* 恢复时重做一条日志记录，此时还没开日志，不会再记一遍 */
+  bool replayRecord(const uint8_t &op, const char *payload,
+                    const size_t &size) {
+    const size_t valueSize = op == LOG_DELETE ? 0 : sizeof(uint64_t);
+    T k;
+    uint64_t value = 0;
+    if (size < valueSize || !decodeLogKey(payload, size - valueSize, k)) {
+      return false;
+    }
+    memcpy(&value, payload + size - valueSize, valueSize);
+    switch (op) {
+      case LOG_INSERT:
+        B_Plus_Tree_Insert(make_pair(k, value));
+        return true;
+      case LOG_DELETE:
+        B_Plus_Tree_Delete(k);
+        return true;
+      case LOG_UPDATE:
+        B_Plus_Tree_Update(k, value);
+        return true;
+      default:
+        return false;
+    }
+  }
+  /**
+   * @brief 利用层序遍历清空树
+   */
+  void B_Plus_Tree_Clear() {
+    typedef typename vector<T>::size_type size_type;
+    queue<BNode<T, Degree> *> q;
+    q.push(_root);
+    while (!q.empty()) {
+      BNode<T, Degree> *temp = q.front();
+      q.pop();
+      if (!temp->isLeaf()) {
+        InnerBNode<T, Degree> *tempInner =
+            static_cast<InnerBNode<T, Degree> *>(temp);
+        for (size_type i = 0; i < tempInner->getChildNum(); ++i) {
+          q.push(tempInner->getChild(i));
+        }
+      }
+      delete temp;
+    }
+    _root = nullptr;
+    _Head = nullptr;
+#ifndef NDEBUG
+    cout << "----------------B+树已清空----------------" << endl;
+#endif
+  }
+  /* 并行建树时每个线程至少分到的项数 */
+  static constexpr size_type PARALLEL_MIN_ITEMS = 4096;
+  /* 分页文件每次读写的字节数 */
+  static constexpr size_t PAGE_WRITE_BATCH = 1 << 20;
+  /* 扫描时默认提前预取的叶子个数 */
+  static constexpr size_type SCAN_PREFETCH_DISTANCE = 4;
+  size_type _scanPrefetch = SCAN_PREFETCH_DISTANCE;
+  /* 结构修改锁：分裂上推时持读锁，删除时持写锁 */
+  shared_mutex _smoMutex;
+  atomic<BNode<T, Degree> *> _root{nullptr};
+  const size_type _MAX_SIZE;
+  LeafBNode<T, Degree> *_Head = nullptr;
+  string _name;
+  OptLock _mutex;
+  /* 预写日志，没开时为空 */
+  unique_ptr<WriteAheadLog> _wal;
+  string _checkpointPath;
+  /* 节点的页号和_checkpointPath里的页对应上了，可以做增量检查点 */
+  bool _checkpointSynced = false;
+  /* 上次检查点里在用的页，下标是页号 */
+  vector<bool> _livePages;
+  /* 检查点文件里可以复用的空页 */
+  vector<page_id> _freePages;
+  /* 写操作持共享锁，快照开始和结束时关闸切换_snapshot */
+  WriteGate _writeGate;
+  /* 进行中的快照，没有时为空 */
+  SnapshotState<T, Degree> *_snapshot = nullptr;
+  /* 同一时间只做一个快照 */
+  mutex _snapshotMutex;
+  uint64_t _snapshotEpoch = 0;
+};
+
+/**
+ * @brief 叶子链上的游标，按关键字顺序逐条访问，不拷贝到容器
+ * 游标停在某个叶子上时持有它的读锁，前后移动时先加相邻叶子的读锁再放当前的。
+ * 删除会先锁右兄弟再锁左兄弟，所以相邻叶子只try_lock，拿不到就放掉当前叶子，
+ * 从根按关键字重新定位；有重复关键字时重新定位可能跳过其中几个。
+ * 走出两端后游标失效并放锁，要重新seek。
+ */
+template <typename T, size_t Degree>
+class BPlusTreeCursor {
+  typedef typename vector<T>::size_type size_type;
+
+ public:
+  explicit BPlusTreeCursor(const BPlusTree<T, Degree> &tree)
+      : _tree(tree), _leaf(nullptr), _index(0) {
+    setPrefetchDistance(tree._scanPrefetch);
+  }
+  BPlusTreeCursor(const BPlusTreeCursor &) = delete;
+  BPlusTreeCursor &operator=(const BPlusTreeCursor &) = delete;
+  ~BPlusTreeCursor() { release(); }
+
+  /* 设置沿叶子链提前预取的叶子个数，0表示不预取 */
+  void setPrefetchDistance(const size_type &distance) {
+    _distance = distance;
+    if (_distance && !_guard) {
+      _guard.emplace();
+    }
+  }
+
+  /* 定位到第一个不小于k的关键字 */
+  void seek(const T &k) {
+    release();
+    locate(k);
+    if (!valid()) {
+      release();
+    }
+  }
+
+  /* 定位到最小的关键字 */
+  void seekToFirst() {
+    release();
+    _leaf = _tree._Head;
+    _leaf->getMutex().lock_shared();
+    _index = 0;
+    prefetchAhead(true);
+    skipForward(true);
+  }
+
+  /* 定位到最后一个小于k的关键字，从这里用prev()往回扫 */
+  void seekForPrev(const T &k) {
+    release();
+    locate(k);
+    prefetchAhead(false);
+    prev();
+  }
+
+  /* 定位到最大的关键字 */
+  void seekToLast() {
+    release();
+    {
+      EpochGuard guard;
+      _leaf = _tree.lockLastLeafShared();
+    }
+    //最右叶子可能刚分裂，右兄弟还没挂到父节点上
+    _index = _leaf->getKeyNum();
+    skipForward(false);
+    prefetchAhead(false);
+    prev();
+  }
+
+  /* 是否停在某个关键字上 */
+  bool valid() const { return _leaf && _index < _leaf->getKeyNum(); }
+
+  /* 当前关键字和值，valid()时才能调用，引用在游标移动前有效 */
+  const T &key() const { return _leaf->getAllKeys()[_index]; }
+  uint64_t value() const { return _leaf->getAllValues()[_index]; }
+
+  /* 下一个关键字 */
+  void next() {
+    ++_index;
+    skipForward(true);
+  }
+
+  /* 上一个关键字 */
+  void prev() {
+    while (_leaf && !_index) {
+      LeafBNode<T, Degree> *prevLeaf = _leaf->getPrev();
+      if (!prevLeaf) {
+        release();
+        return;
+      }
+      if (prevLeaf->getMutex().try_lock_shared()) {
+        _leaf->getMutex().unlock_shared();
+        _leaf = prevLeaf;
+        _index = _leaf->getKeyNum();
+        prefetchAhead(false);
+        continue;
+      }
+      //左兄弟被写者占着，放锁后重新定位到当前关键字再往回走
+      T k = key();
+      release();
+      this_thread::yield();
+      locate(k);
+    }
+    if (_leaf) {
+      --_index;
+    }
+  }
+
+ private:
+  /**
+   * @brief 下降到k所在叶子，停在第一个不小于k的位置
+   * 没有不小于k的关键字时停在最右叶子的末尾，仍持有它的读锁
+   */
+  void locate(const T &k) {
+    EpochGuard guard;
+    _leaf = _tree.lockLeafShared(k);
+    _index = _leaf->getInsertIndex(k);
+    prefetchAhead(true);
+    //k比叶子里的都大时右兄弟里可能还有不小于k的
+    skipForward(false);
+  }
+
+  /**
+   * @brief 当前叶子走完了就换到右兄弟
+   * @param releaseAtEnd 走出右端后是否放锁，不放就停在最右叶子的末尾
+   */
+  void skipForward(const bool &releaseAtEnd) {
+    while (_leaf && _index == _leaf->getKeyNum()) {
+      LeafBNode<T, Degree> *nextLeaf = _leaf->getNext();
+      if (!nextLeaf) {
+        if (releaseAtEnd) {
+          release();
+        }
+        return;
+      }
+      if (nextLeaf->getMutex().try_lock_shared()) {
+        _leaf->getMutex().unlock_shared();
+        _leaf = nextLeaf;
+        _index = 0;
+        prefetchAhead(true);
+        continue;
+      }
+      //右兄弟被写者占着，放锁后重新定位到上次走过的关键字之后；
+      //空叶子里没走过关键字，从它的高键也就是右兄弟的下界开始
+      const bool empty = !_index;
+      T k = empty ? _leaf->getHighKey() : _leaf->getKey(_index - 1);
+      release();
+      this_thread::yield();
+      EpochGuard guard;
+      _leaf = _tree.lockLeafShared(k);
+      _index = _leaf->getInsertIndex(k);
+      while (!empty && _index < _leaf->getKeyNum() && !(k < key())) {
+        ++_index;
+      }
+      prefetchAhead(true);
+    }
+  }
+
+  /**
+   * @brief 换到新叶子后补齐前方的预取，保持前方有_distance个叶子在路上
+   * 前方的叶子不加锁，只读兄弟指针，游标持有EpochGuard保证它们没被释放；
+   * 指针读旧了只会预取错，不影响结果
+   * @param forward 沿右兄弟还是左兄弟预取，方向变了从当前叶子重新开始
+   */
+  void prefetchAhead(const bool &forward) {
+    if (!_distance) {
+      return;
+    }
+    if (_ahead && forward == _forward) {
+      --_ahead;
+    } else {
+      _frontier = _leaf;
+      _ahead = 0;
+      _forward = forward;
+    }
+    while (_ahead < _distance) {
+      LeafBNode<T, Degree> *leaf =
+          forward ? _frontier->getNext() : _frontier->getPrev();
+      if (!leaf) {
+        break;
+      }
+      LeafBNode<T, Degree>::prefetchWhole(leaf, _tree.maxSize());
+      _frontier = leaf;
+      ++_ahead;
+    }
+  }
+
+  void release() {
+    if (_leaf) {
+      _leaf->getMutex().unlock_shared();
+      _leaf = nullptr;
+    }
+    _ahead = 0;
+  }
+
+  const BPlusTree<T, Degree> &_tree;
+  LeafBNode<T, Degree> *_leaf;
+  size_type _index;
+  /* 预取：前方已预取到_frontier，和当前叶子隔_ahead个叶子 */
+  size_type _distance;
+  LeafBNode<T, Degree> *_frontier = nullptr;
+  size_type _ahead = 0;
+  bool _forward = true;
+  optional<EpochGuard> _guard;
 };
 
 #endif
\ No newline at end of file
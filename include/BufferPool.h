@@ -0,0 +1,412 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Latch.h"
+#include "PageFile.h"
+using namespace std;
+
+/**
+ * @brief 缓冲池里的一帧，缓存一页
+ * 帧的地址在缓冲池的生命周期里不变，固定(pin)住的帧不会被换出。
+ */
+struct Frame {
+  page_id id = INVALID_PAGE;
+  size_t pinCount = 0;
+  bool dirty = false;
+  /* clock算法的访问位 */
+  bool referenced = false;
+  /* 正在不持池锁读入或写回，要这一页的线程等它完成 */
+  bool io = false;
+  /* 页锁，和内存树的节点锁一样，下降时按父子顺序加锁 */
+  OptLock latch;
+  char *data = nullptr;
+};
+
+/**
+ * @brief 分页文件的缓冲池
+ * 帧数固定，用clock算法换出没被固定的页，换出脏页前先写回。
+ * 页表和各帧的元数据由池锁保护，页内容由帧上的页锁保护。
+ * 读写文件时先在池锁下占住帧并标成io，放开池锁再读写，不挡别的页的命中。
+ */
+class BufferPool {
+ public:
+  explicit BufferPool(const size_t &frameNum)
+      : _frames(max(frameNum, MIN_FRAMES)) {}
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+  ~BufferPool() { close(); }
+
+  /**
+   * @brief 打开已有的分页文件，有没写回完的页日志时先写回
+   * @return 打不开、页日志写回失败或文件头不对返回false
+   */
+  template <typename T>
+  bool open(const string &path) {
+    close();
+    if (!applyPageJournal(path)) {
+      cerr << "缓冲池打开时" << path << "的页日志写回失败" << endl;
+      return false;
+    }
+    if (!_file.open(path, false, true) ||
+        !_file.readAt(&_header, sizeof(_header), 0)) {
+      cerr << "缓冲池打开" << path << "失败" << endl;
+      _file.close();
+      return false;
+    }
+    if (!checkPageFileHeader<T>(_header) || _header.root == INVALID_PAGE ||
+        _file.size() < _header.pageCount * _header.pageSize) {
+      cerr << path << "不是分页文件" << endl;
+      _file.close();
+      return false;
+    }
+    allocFrames();
+    return true;
+  }
+
+  /**
+   * @brief 新建分页文件，只写文件头，节点页用newPage分配
+   */
+  bool create(const string &path, const PageFileHeader &header) {
+    close();
+    _header = header;
+    _header.pageCount = 1;
+    if (!_file.open(path, true) || !writeHeader()) {
+      cerr << "缓冲池新建" << path << "失败" << endl;
+      _file.close();
+      return false;
+    }
+    allocFrames();
+    return true;
+  }
+
+  /* 写回所有脏页后关闭文件 */
+  void close() {
+    if (_file.isOpen()) {
+      flush();
+      _file.close();
+    }
+    _pageTable.clear();
+    _memory.reset();
+  }
+
+  bool isOpen() const { return _file.isOpen(); }
+  size_t frameNum() const { return _frames.size(); }
+  uint32_t pageSize() const { return _header.pageSize; }
+  size_t maxSize() const { return _header.maxSize; }
+  uint64_t flags() const { return _header.flags; }
+
+  /* 读写文件头里的根和叶子链表头，持久化在flush时完成 */
+  page_id root() {
+    lock_guard<mutex> lock(_mutex);
+    return _header.root;
+  }
+  page_id head() {
+    lock_guard<mutex> lock(_mutex);
+    return _header.head;
+  }
+  void setRoot(const page_id &root, const page_id &head) {
+    lock_guard<mutex> lock(_mutex);
+    _header.root = root;
+    _header.head = head;
+  }
+
+  /**
+   * @brief 固定一页，不在池里时先换出一帧再从文件读
+   * 所有帧都被固定时等别的线程放开，等不到就失败。
+   * 这一页正在读入或写回时等它完成再查页表
+   * @return 页号越界、没有空闲帧或读失败返回nullptr
+   */
+  Frame *fetchPage(const page_id &id) {
+    unique_lock<mutex> lock(_mutex);
+    Frame *frame = nullptr;
+    while (true) {
+      if (id == INVALID_PAGE || id >= _header.pageCount) {
+        return nullptr;
+      }
+      auto it = _pageTable.find(id);
+      if (it != _pageTable.end()) {
+        if (it->second->io) {
+          _ioDone.wait(lock);
+          continue;
+        }
+        ++it->second->pinCount;
+        it->second->referenced = true;
+        ++_hits;
+        return it->second;
+      }
+      if (frame) {
+        break;
+      }
+      //victim可能放开过池锁，回头重查页表；别的线程已经读入这一页时，找到的空帧留给clock
+      frame = victim(lock);
+      if (!frame) {
+        return nullptr;
+      }
+    }
+    install(frame, id);
+    frame->io = true;
+    lock.unlock();
+    bool ok = _file.readAt(frame->data, _header.pageSize,
+                           id * _header.pageSize);
+    lock.lock();
+    frame->io = false;
+    _ioDone.notify_all();
+    if (!ok) {
+      cerr << "缓冲池读第" << id << "页失败" << endl;
+      _pageTable.erase(id);
+      frame->id = INVALID_PAGE;
+      frame->pinCount = 0;
+      _unpinned.notify_one();
+      return nullptr;
+    }
+    ++_misses;
+    return frame;
+  }
+
+  /**
+   * @brief 在文件末尾分配一页并固定，页内容清零、标脏
+   */
+  Frame *newPage() {
+    unique_lock<mutex> lock(_mutex);
+    Frame *frame = victim(lock);
+    if (!frame) {
+      return nullptr;
+    }
+    fill(frame->data, frame->data + _header.pageSize, 0);
+    install(frame, _header.pageCount++);
+    frame->dirty = true;
+    return frame;
+  }
+
+  /* 放开一页，dirty为true时标脏 */
+  void unpinPage(Frame *frame, const bool &dirty) {
+    lock_guard<mutex> lock(_mutex);
+    frame->dirty = frame->dirty || dirty;
+    if (!--frame->pinCount) {
+      _unpinned.notify_one();
+    }
+  }
+
+  /**
+   * @brief 写回所有脏页和文件头并刷盘
+   * 脏页的内容可能正在被改，调用者要保证此时没有写者；先等正在读写的帧完成
+   */
+  bool flush() {
+    unique_lock<mutex> lock(_mutex);
+    if (!_file.isOpen()) {
+      return false;
+    }
+    _ioDone.wait(lock, [this]() {
+      return none_of(_frames.begin(), _frames.end(),
+                     [](const Frame &frame) { return frame.io; });
+    });
+    bool ok = true;
+    for (Frame &frame : _frames) {
+      if (frame.id != INVALID_PAGE && frame.dirty) {
+        if (writePage(&frame)) {
+          frame.dirty = false;
+        } else {
+          ok = false;
+        }
+      }
+    }
+    return writeHeader() && _file.sync() && ok;
+  }
+
+  /* 命中和缺页的次数 */
+  uint64_t hits() {
+    lock_guard<mutex> lock(_mutex);
+    return _hits;
+  }
+  uint64_t misses() {
+    lock_guard<mutex> lock(_mutex);
+    return _misses;
+  }
+
+ private:
+  void allocFrames() {
+    _memory.reset(static_cast<char *>(::operator new(
+        _header.pageSize * _frames.size(), align_val_t(PAGE_ALIGN))));
+    for (size_t i = 0; i < _frames.size(); ++i) {
+      _frames[i].id = INVALID_PAGE;
+      _frames[i].pinCount = 0;
+      _frames[i].dirty = false;
+      _frames[i].referenced = false;
+      _frames[i].io = false;
+      _frames[i].data = _memory.get() + i * _header.pageSize;
+    }
+    _hand = 0;
+    _hits = _misses = 0;
+  }
+
+  /**
+   * @brief clock算法找一个可用的帧，脏页先写回，持有池锁调用
+   * 返回的帧不在页表里、没被固定，调用者在放开池锁前要用掉它。
+   * 转两圈还找不到就说明全被固定了，放开池锁等别的线程放开一帧再找，
+   * 超过VICTIM_WAIT还没有就返回nullptr，免得固定的页太多时互相等死
+   */
+  Frame *victim(unique_lock<mutex> &lock) {
+    auto deadline = chrono::steady_clock::now() + VICTIM_WAIT;
+    while (true) {
+      for (size_t step = 0; step < 2 * _frames.size(); ++step) {
+        Frame *frame = &_frames[_hand];
+        _hand = (_hand + 1) % _frames.size();
+        if (frame->pinCount) {
+          continue;
+        }
+        if (frame->referenced) {
+          frame->referenced = false;
+          continue;
+        }
+        if (frame->id != INVALID_PAGE) {
+          if (frame->dirty && !writeBack(frame, lock)) {
+            return nullptr;
+          }
+          _pageTable.erase(frame->id);
+          frame->id = INVALID_PAGE;
+        }
+        return frame;
+      }
+      if (_unpinned.wait_until(lock, deadline) == cv_status::timeout) {
+        cerr << "缓冲池的" << _frames.size() << "帧都被固定了" << endl;
+        return nullptr;
+      }
+    }
+  }
+
+  void install(Frame *frame, const page_id &id) {
+    frame->id = id;
+    frame->pinCount = 1;
+    frame->dirty = false;
+    frame->referenced = true;
+    _pageTable[id] = frame;
+  }
+
+  /**
+   * @brief 换出前写回脏页，持有池锁调用，写盘时放开池锁
+   * 写盘期间帧被固定、标成io，别的线程换不走它，要这一页的等着；
+   * 写完重新持锁时解除，帧仍没被固定，可以直接换出
+   */
+  bool writeBack(Frame *frame, unique_lock<mutex> &lock) {
+    frame->pinCount = 1;
+    frame->io = true;
+    lock.unlock();
+    bool ok = writePage(frame);
+    lock.lock();
+    frame->io = false;
+    frame->pinCount = 0;
+    frame->dirty = !ok;
+    _ioDone.notify_all();
+    return ok;
+  }
+
+  bool writePage(const Frame *frame) {
+    if (!_file.writeAt(frame->data, _header.pageSize,
+                       frame->id * _header.pageSize)) {
+      cerr << "缓冲池写第" << frame->id << "页失败" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  bool writeHeader() {
+    vector<char> page(_header.pageSize, 0);
+    copy_n(reinterpret_cast<const char *>(&_header), sizeof(_header),
+           page.data());
+    return _file.writeAt(page.data(), page.size(), 0);
+  }
+
+  struct AlignedDelete {
+    void operator()(char *p) const {
+      ::operator delete(p, align_val_t(PAGE_ALIGN));
+    }
+  };
+
+  /* 下降时每层最多固定两三页，帧太少会互相等死 */
+  static constexpr size_t MIN_FRAMES = 16;
+  /* 所有帧都被固定时最多等多久 */
+  static constexpr chrono::milliseconds VICTIM_WAIT{1000};
+  PageFile _file;
+  PageFileHeader _header{};
+  vector<Frame> _frames;
+  unique_ptr<char, AlignedDelete> _memory;
+  unordered_map<page_id, Frame *> _pageTable;
+  size_t _hand = 0;
+  uint64_t _hits = 0;
+  uint64_t _misses = 0;
+  mutex _mutex;
+  /* 有帧的固定数降到0时通知等着换出的线程 */
+  condition_variable _unpinned;
+  /* 帧的读入或写回完成时通知等这一页的线程 */
+  condition_variable _ioDone;
+};
+
+/**
+ * @brief 固定并锁住一页，析构时解锁、放开
+ */
+class PageGuard {
+ public:
+  PageGuard() = default;
+  PageGuard(BufferPool *pool, Frame *frame, const bool &exclusive)
+      : _pool(pool), _frame(frame), _exclusive(exclusive) {
+    if (_exclusive) {
+      _frame->latch.lock();
+    } else {
+      _frame->latch.lock_shared();
+    }
+  }
+  PageGuard(const PageGuard &) = delete;
+  PageGuard &operator=(const PageGuard &) = delete;
+  PageGuard(PageGuard &&other) noexcept { *this = std::move(other); }
+  PageGuard &operator=(PageGuard &&other) noexcept {
+    if (this != &other) {
+      release();
+      _pool = other._pool;
+      _frame = other._frame;
+      _exclusive = other._exclusive;
+      _dirty = other._dirty;
+      other._frame = nullptr;
+    }
+    return *this;
+  }
+  ~PageGuard() { release(); }
+
+  explicit operator bool() const { return _frame != nullptr; }
+  page_id id() const { return _frame->id; }
+  char *data() const { return _frame->data; }
+  /* 改了页内容要标脏，放开时才会写回 */
+  void markDirty() { _dirty = true; }
+
+  void release() {
+    if (!_frame) {
+      return;
+    }
+    if (_exclusive) {
+      _frame->latch.unlock();
+    } else {
+      _frame->latch.unlock_shared();
+    }
+    _pool->unpinPage(_frame, _dirty);
+    _frame = nullptr;
+    _dirty = false;
+  }
+
+ private:
+  BufferPool *_pool = nullptr;
+  Frame *_frame = nullptr;
+  bool _exclusive = false;
+  bool _dirty = false;
+};
+#endif
@@ -0,0 +1,162 @@
+#ifndef COMPACT_FILE_H
+#define COMPACT_FILE_H
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "KeyCodec.h"
+#include "PageFile.h"
+using namespace std;
+
+/**
+ * @brief 紧凑的单文件格式，用来做快照和冷启动
+ * 不按页对齐，节点按层序一个接一个存，指针都由层序隐含：内部节点只记第一个孩子的序号，
+ * 其余孩子紧跟在后面；叶子都在最后一层，按关键字顺序排，读回来时按顺序接上叶子链。
+ * 文件：[CompactFileHeader][节点记录]...
+ * 记录：[CompactNode][关键字块][叶子的值数组]，关键字块的字节数记在CompactNode里，
+ * 定长关键字按位存放，整数关键字打包(见KeyCodec.h)更短时存打包的块，
+ * string每个关键字前面是它的长度(u32)，节点有公共前缀时前缀只存一次。
+ * 所有整数按小端存放，只在小端机器上按位读写。
+ */
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "紧凑格式按小端存放");
+
+/* "BPTCMPT1" */
+constexpr uint64_t COMPACT_FILE_MAGIC = 0x3154504d43545042ULL;
+/* 版本2加了整数关键字打包，版本3加了string关键字去公共前缀，旧版本的文件仍能读 */
+constexpr uint32_t COMPACT_FILE_VERSION = 3;
+
+/* 关键字块的编码 */
+enum CompactKeyEncoding : uint8_t {
+  COMPACT_KEYS_RAW = 0,
+  COMPACT_KEYS_PACKED = 1,
+  /* 先存节点内的公共前缀，每个关键字只存去掉前缀的部分 */
+  COMPACT_KEYS_PREFIX = 2
+};
+
+struct CompactFileHeader {
+  uint64_t magic;
+  uint32_t version;
+  /* 定长关键字的字节数，string为0 */
+  uint32_t keySize;
+  uint64_t maxSize;
+  uint64_t nodeCount;
+};
+
+/* 节点记录头 */
+struct CompactNode {
+  uint8_t isLeaf;
+  /* CompactKeyEncoding，版本1里总是0 */
+  uint8_t keyEncoding;
+  uint8_t reserved[2];
+  uint32_t level;
+  uint32_t keyNum;
+  /* 关键字块的字节数 */
+  uint32_t keyBytes;
+  /* 内部节点第一个孩子的层序序号，根是0；叶子不用 */
+  uint64_t firstChild;
+};
+
+/* 关键字类型在文件头里的keySize */
+template <typename T>
+constexpr uint32_t compactKeySize() {
+  if constexpr (is_same<T, string>::value) {
+    return 0;
+  } else {
+    static_assert(is_trivially_copyable<T>::value,
+                  "紧凑格式只支持定长关键字和string");
+    return sizeof(T);
+  }
+}
+
+/* 追加一段带长度的字节 */
+inline void appendChunk(const char *data, const uint32_t &size, string &out) {
+  out.append(reinterpret_cast<const char *>(&size), sizeof(size));
+  out.append(data, size);
+}
+
+/**
+ * @brief 把string关键字编码成关键字块，定长关键字直接写节点里的数组，不用这个
+ * @param prefixLength 所有关键字的公共前缀长度，不为0时按COMPACT_KEYS_PREFIX编码
+ */
+template <typename It>
+void encodeStringKeys(It first, It last, string &out,
+                      const size_t &prefixLength = 0) {
+  if (prefixLength && first != last) {
+    appendChunk(first->data(), prefixLength, out);
+  }
+  for (; first != last; ++first) {
+    appendChunk(first->data() + prefixLength, first->size() - prefixLength,
+                out);
+  }
+}
+
+/**
+ * @brief 解码关键字块
+ * @return 编码不认识，或块的长度和关键字个数对不上返回false
+ */
+template <typename T>
+bool decodeKeyBlock(const char *data, const size_t &size,
+                    const size_t &keyNum, const uint8_t &encoding,
+                    vector<T> &keys) {
+  keys.resize(keyNum);
+  if constexpr (is_same<T, string>::value) {
+    size_t offset = 0;
+    //读一段带长度的字节追加到key后面
+    auto readChunk = [&](string &key) {
+      uint32_t length;
+      if (size - offset < sizeof(length)) {
+        return false;
+      }
+      memcpy(&length, data + offset, sizeof(length));
+      offset += sizeof(length);
+      if (size - offset < length) {
+        return false;
+      }
+      key.append(data + offset, length);
+      offset += length;
+      return true;
+    };
+    string prefix;
+    if ((encoding != COMPACT_KEYS_RAW && encoding != COMPACT_KEYS_PREFIX) ||
+        (encoding == COMPACT_KEYS_PREFIX && !readChunk(prefix))) {
+      return false;
+    }
+    for (size_t i = 0; i < keyNum; ++i) {
+      keys[i] = prefix;
+      if (!readChunk(keys[i])) {
+        return false;
+      }
+    }
+    return offset == size;
+  } else {
+    if constexpr (PackableKey<T>::value) {
+      if (encoding == COMPACT_KEYS_PACKED) {
+        if (!checkPackedBlock<T>(data, size, keyNum)) {
+          return false;
+        }
+        unpackKeys(data, 0, keyNum, keys.data());
+        return true;
+      }
+    }
+    if (encoding != COMPACT_KEYS_RAW || size != keyNum * sizeof(T)) {
+      return false;
+    }
+    //记录之间不对齐，按字节拷贝
+    memcpy(keys.data(), data, size);
+    return true;
+  }
+}
+
+/* 读文件头 */
+inline bool readCompactFileHeader(const string &path,
+                                  CompactFileHeader &header) {
+  PageFile file;
+  return file.open(path, false) && file.readAt(&header, sizeof(header), 0) &&
+         header.magic == COMPACT_FILE_MAGIC;
+}
+#endif
@@ -83,9 +83,9 @@ void interface() {
       // cout << "请输入要查找的键:" << endl;
       // cin >> key;
       line >> key;
-      pair<T, uint64_t *> ans = tree->B_Plus_Tree_Search(key);
-      if (ans.second) {
-        cout << "关键字" << ans.first << "对应的值为" << *ans.second << endl;
+      optional<uint64_t> ans = tree->B_Plus_Tree_Search(key);
+      if (ans) {
+        cout << "关键字" << key << "对应的值为" << *ans << endl;
       } else {
         cout << "没有该关键字" << endl;
       }
@@ -156,6 +156,72 @@ void interface() {
       } else {
         cerr << "open error:./" + tree_name + "/" + tree_name << endl;
       }
+    } else if (option == string("save")) {
+      if (!tree) {
+        cout << "您还没有建树" << endl;
+        continue;
+      }
+      string path = "./" + tree->getName() + ".db";
+      line >> path;
+      if (tree->B_Plus_Tree_Save(path)) {
+        cout << "已保存到" << path << endl;
+      }
+    } else if (option == string("load")) {
+      string path;
+      string name("testTree");
+      line >> path >> name;
+      PageFileHeader header;
+      if (!readPageFileHeader(path, header)) {
+        cerr << "open error:" << path << endl;
+        continue;
+      }
+      if (tree) {
+        cout << "您当前的树还没有保存，请问是否舍弃？" << endl;
+        string discard;
+        getline(cin, discard);
+        if (discard != "yes") {
+          continue;
+        }
+        delete tree;
+      }
+      tree = new BPlusTree<T>(header.maxSize, name);
+      if (!tree->B_Plus_Tree_Load(path)) {
+        delete tree;
+        tree = nullptr;
+      }
+    } else if (option == string("save_compact")) {
+      if (!tree) {
+        cout << "您还没有建树" << endl;
+        continue;
+      }
+      string path = "./" + tree->getName() + ".bpt";
+      line >> path;
+      if (tree->B_Plus_Tree_Save_Compact(path)) {
+        cout << "已保存到" << path << endl;
+      }
+    } else if (option == string("load_compact")) {
+      string path;
+      string name("testTree");
+      line >> path >> name;
+      CompactFileHeader header;
+      if (!readCompactFileHeader(path, header)) {
+        cerr << "open error:" << path << endl;
+        continue;
+      }
+      if (tree) {
+        cout << "您当前的树还没有保存，请问是否舍弃？" << endl;
+        string discard;
+        getline(cin, discard);
+        if (discard != "yes") {
+          continue;
+        }
+        delete tree;
+      }
+      tree = new BPlusTree<T>(header.maxSize, name);
+      if (!tree->B_Plus_Tree_Load_Compact(path)) {
+        delete tree;
+        tree = nullptr;
+      }
     }
 
     // else if (option == string("test")) {
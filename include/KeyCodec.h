@@ -0,0 +1,182 @@
+#ifndef KEY_CODEC_H
+#define KEY_CODEC_H
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+#include "KeySearch.h"
+using namespace std;
+
+/**
+ * @brief 有序整数关键字的压缩：以第一个关键字为基准(frame of reference)，
+ * 其余关键字只存和基准的差，差按最大差需要的位数紧挨着存(bit-packing)。
+ * 块：[基准T][位宽u8][打包的差，按小端位序][PACKED_SLACK字节空白]
+ * 末尾留空白，解码时每个差都能直接读8字节再移位，不用判断是否越界。
+ * 位宽超过PACKED_MAX_WIDTH时移位后放不进8字节，不压缩。
+ */
+
+/* 能压缩的关键字类型 */
+template <typename T>
+struct PackableKey {
+  static constexpr bool value =
+      is_integral<T>::value && (sizeof(T) == 4 || sizeof(T) == 8);
+};
+
+constexpr uint32_t PACKED_MAX_WIDTH = 56;
+constexpr size_t PACKED_SLACK = 7;
+
+/* n个差的位宽，关键字有序时只看首尾 */
+template <typename T>
+uint32_t packedWidth(const T *keys, const size_t &n) {
+  if (n < 2) {
+    return 0;
+  }
+  uint64_t range = static_cast<uint64_t>(keys[n - 1]) -
+                   static_cast<uint64_t>(keys[0]);
+  return range ? 64 - __builtin_clzll(range) : 0;
+}
+
+/* n个关键字按width位打包后块的字节数 */
+template <typename T>
+size_t packedBytes(const size_t &n, const uint32_t &width) {
+  return sizeof(T) + 1 + (n * width + 7) / 8 + PACKED_SLACK;
+}
+
+/**
+ * @brief 把有序的n个关键字打包追加到out
+ * @return 位宽太大不能压缩时返回false，out不变
+ */
+template <typename T>
+bool packKeys(const T *keys, const size_t &n, string &out) {
+  static_assert(PackableKey<T>::value, "只有定长整数关键字能压缩");
+  const uint32_t width = packedWidth(keys, n);
+  if (width > PACKED_MAX_WIDTH) {
+    return false;
+  }
+  size_t begin = out.size();
+  out.resize(begin + packedBytes<T>(n, width), 0);
+  char *block = &out[begin];
+  T base = n ? keys[0] : T();
+  memcpy(block, &base, sizeof(T));
+  block[sizeof(T)] = static_cast<char>(width);
+  char *bits = block + sizeof(T) + 1;
+  for (size_t i = 0; i < n && width; ++i) {
+    uint64_t delta =
+        static_cast<uint64_t>(keys[i]) - static_cast<uint64_t>(base);
+    size_t bit = i * width;
+    uint64_t word;
+    memcpy(&word, bits + bit / 8, sizeof(word));
+    word |= delta << (bit % 8);
+    memcpy(bits + bit / 8, &word, sizeof(word));
+  }
+  return true;
+}
+
+/* 块的位宽 */
+inline uint32_t packedBlockWidth(const char *block, const size_t &keySize) {
+  return static_cast<uint8_t>(block[keySize]);
+}
+
+/* 块的长度和位宽是否对得上n个关键字 */
+template <typename T>
+bool checkPackedBlock(const char *block, const size_t &size, const size_t &n) {
+  if (size < sizeof(T) + 1) {
+    return false;
+  }
+  uint32_t width = packedBlockWidth(block, sizeof(T));
+  return width <= PACKED_MAX_WIDTH && size == packedBytes<T>(n, width);
+}
+
+/* 放在capacity字节的区域里、后面可能还有空白的块是否对得上n个关键字 */
+template <typename T>
+bool checkPackedBlockIn(const char *block, const size_t &capacity,
+                        const size_t &n) {
+  if (capacity < sizeof(T) + 1) {
+    return false;
+  }
+  uint32_t width = packedBlockWidth(block, sizeof(T));
+  return width <= PACKED_MAX_WIDTH && packedBytes<T>(n, width) <= capacity;
+}
+
+/* 第i个关键字 */
+template <typename T>
+T packedKeyAt(const char *block, const size_t &i) {
+  T base;
+  memcpy(&base, block, sizeof(T));
+  const uint32_t width = packedBlockWidth(block, sizeof(T));
+  const char *bits = block + sizeof(T) + 1;
+  size_t bit = i * width;
+  uint64_t word;
+  memcpy(&word, bits + bit / 8, sizeof(word));
+  uint64_t mask = (1ULL << width) - 1;
+  return static_cast<T>(static_cast<uint64_t>(base) +
+                        ((word >> (bit % 8)) & mask));
+}
+
+/**
+ * @brief 解出从from开始的count个关键字
+ * AVX2下一次用gather读4个差所在的8字节，再按各自的位偏移右移、取低width位
+ */
+template <typename T>
+void unpackKeys(const char *block, const size_t &from, const size_t &count,
+                T *out) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  T base;
+  memcpy(&base, block, sizeof(T));
+  const uint32_t width = packedBlockWidth(block, sizeof(T));
+  const long long *bits =
+      reinterpret_cast<const long long *>(block + sizeof(T) + 1);
+  const __m256i mask = _mm256_set1_epi64x((1LL << width) - 1);
+  const __m256i seven = _mm256_set1_epi64x(7);
+  const __m256i step = _mm256_set1_epi64x(4LL * width);
+  const __m256i vbase = _mm256_set1_epi64x(static_cast<int64_t>(base));
+  __m256i bit = _mm256_set_epi64x((from + 3) * width, (from + 2) * width,
+                                  (from + 1) * width, from * width);
+  for (; i + 4 <= count; i += 4) {
+    __m256i word = _mm256_i64gather_epi64(bits, _mm256_srli_epi64(bit, 3), 1);
+    __m256i delta =
+        _mm256_and_si256(_mm256_srlv_epi64(word, _mm256_and_si256(bit, seven)),
+                         mask);
+    __m256i keys = _mm256_add_epi64(vbase, delta);
+    if constexpr (sizeof(T) == 8) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), keys);
+    } else {
+      //取每个64位的低32位
+      __m256i low = _mm256_permutevar8x32_epi32(
+          keys, _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                       _mm256_castsi256_si128(low));
+    }
+    bit = _mm256_add_epi64(bit, step);
+  }
+#endif
+  for (; i < count; ++i) {
+    out[i] = packedKeyAt<T>(block, from + i);
+  }
+}
+
+/**
+ * @brief 在打包的n个有序关键字里找第一个不小于k的位置，不用整块解码
+ * 和keyLowerBound一样先二分缩到SIMD_WINDOW以内，只解出这个窗口再用SIMD计数
+ */
+template <typename T>
+size_t packedLowerBound(const char *block, const size_t &n, const T &k) {
+  size_t base = 0;
+  size_t len = n;
+  while (len > SIMD_WINDOW) {
+    size_t half = len / 2;
+    base = packedKeyAt<T>(block, base + half - 1) < k ? base + half : base;
+    len -= half;
+  }
+  T window[SIMD_WINDOW];
+  unpackKeys(block, base, len, window);
+  if constexpr (SimdKey<T>::value) {
+    return base + countLess(window, len, k);
+  } else {
+    return base + countLessScalar(window, len, k);
+  }
+}
+#endif
@@ -0,0 +1,247 @@
+#ifndef KEY_SEARCH_H
+#define KEY_SEARCH_H
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+using namespace std;
+
+/**
+ * @brief 节点内关键字查找
+ * 先用无分支的二分把范围缩到SIMD_WINDOW以内，再用SIMD数窗口里小于k的关键字个数。
+ * int32_t/int64_t/uint64_t（及同宽度的整型）走SIMD，编译时按__AVX2__、
+ * __SSE4_2__选择指令集，都没有时退回标量计数；其它类型用普通二分。
+ * string关键字由KeyIndex<string>在去掉公共前缀后的8字节键头上查找，见文件末尾。
+ */
+
+/* SIMD计数的窗口大小 */
+constexpr size_t SIMD_WINDOW = 16;
+
+/* 能用SIMD比较的关键字类型 */
+template <typename T>
+struct SimdKey {
+  static constexpr bool value =
+      is_integral<T>::value &&
+      ((sizeof(T) == 4 && is_signed<T>::value) || sizeof(T) == 8);
+};
+
+/* 标量计数，SIMD的尾部和没有SIMD时使用 */
+template <typename T>
+size_t countLessScalar(const T *keys, const size_t &n, const T &k) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    count += keys[i] < k;
+  }
+  return count;
+}
+
+#if defined(__AVX2__)
+/* 32位有符号：一次比较8个 */
+inline size_t countLess32(const int32_t *keys, const size_t &n,
+                          const int32_t &k) {
+  const __m256i target = _mm256_set1_epi32(k);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i));
+    __m256i less = _mm256_cmpgt_epi32(target, v);
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(less));
+    count += __builtin_popcount(mask);
+  }
+  return count + countLessScalar(keys + i, n - i, k);
+}
+
+/* 64位：一次比较4个，无符号先翻转符号位 */
+template <bool isSigned>
+size_t countLess64(const int64_t *keys, const size_t &n, const int64_t &k) {
+  const __m256i flip =
+      _mm256_set1_epi64x(isSigned ? 0 : static_cast<int64_t>(1ULL << 63));
+  const __m256i target = _mm256_xor_si256(_mm256_set1_epi64x(k), flip);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)), flip);
+    __m256i less = _mm256_cmpgt_epi64(target, v);
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(less));
+    count += __builtin_popcount(mask);
+  }
+  return count + (isSigned ? countLessScalar(keys + i, n - i, k)
+                           : countLessScalar(
+                                 reinterpret_cast<const uint64_t *>(keys + i),
+                                 n - i, static_cast<uint64_t>(k)));
+}
+#elif defined(__SSE4_2__)
+/* 32位有符号：一次比较4个 */
+inline size_t countLess32(const int32_t *keys, const size_t &n,
+                          const int32_t &k) {
+  const __m128i target = _mm_set1_epi32(k);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(target, v)));
+    count += __builtin_popcount(mask);
+  }
+  return count + countLessScalar(keys + i, n - i, k);
+}
+
+/* 64位：一次比较2个，无符号先翻转符号位 */
+template <bool isSigned>
+size_t countLess64(const int64_t *keys, const size_t &n, const int64_t &k) {
+  const __m128i flip =
+      _mm_set1_epi64x(isSigned ? 0 : static_cast<int64_t>(1ULL << 63));
+  const __m128i target = _mm_xor_si128(_mm_set1_epi64x(k), flip);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i v = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i)), flip);
+    int mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(target, v)));
+    count += __builtin_popcount(mask);
+  }
+  return count + (isSigned ? countLessScalar(keys + i, n - i, k)
+                           : countLessScalar(
+                                 reinterpret_cast<const uint64_t *>(keys + i),
+                                 n - i, static_cast<uint64_t>(k)));
+}
+#endif
+
+/* 窗口内小于k的关键字个数 */
+template <typename T>
+size_t countLess(const T *keys, const size_t &n, const T &k) {
+#if defined(__AVX2__) || defined(__SSE4_2__)
+  if constexpr (sizeof(T) == 4) {
+    return countLess32(reinterpret_cast<const int32_t *>(keys), n,
+                       static_cast<int32_t>(k));
+  } else {
+    return countLess64<is_signed<T>::value>(
+        reinterpret_cast<const int64_t *>(keys), n, static_cast<int64_t>(k));
+  }
+#else
+  return countLessScalar(keys, n, k);
+#endif
+}
+
+/**
+ * @brief 有序数组中第一个不小于k的位置
+ * @param n 关键字个数
+ */
+template <typename T>
+size_t keyLowerBound(const T *keys, const size_t &n, const T &k) {
+  if constexpr (SimdKey<T>::value) {
+    //答案始终在[base, base + len]里
+    const T *base = keys;
+    size_t len = n;
+    while (len > SIMD_WINDOW) {
+      size_t half = len / 2;
+      base = base[half - 1] < k ? base + half : base;
+      len -= half;
+    }
+    return (base - keys) + countLess(base, len, k);
+  } else {
+    size_t l = 0;
+    size_t r = n;
+    while (l < r) {
+      size_t mid = (l + r) / 2;
+      if (keys[mid] < k) {
+        l = mid + 1;
+      } else {
+        r = mid;
+      }
+    }
+    return l;
+  }
+}
+
+/**
+ * @brief 节点内关键字的查找索引，和关键字数组放在节点的同一次分配里，
+ * 节点继承它，关键字改动后由节点调用rebuild
+ * 通用版本什么也不存，直接在关键字数组上查找
+ */
+template <typename T>
+class KeyIndex {
+ public:
+  /* capacity个关键字需要的额外空间，放在关键字数组后面 */
+  static constexpr size_t storageSize(const size_t &capacity) { return 0; }
+  KeyIndex(T *keys, const size_t &capacity) {}
+
+  void rebuild(const T *keys, const size_t &n) {}
+  size_t lowerBound(const T *keys, const size_t &n, const T &k) const {
+    return keyLowerBound(keys, n, k);
+  }
+};
+
+/* 两个字符串的公共前缀长度 */
+inline size_t commonPrefixLength(const string &a, const string &b) {
+  size_t n = min(a.size(), b.size());
+  return mismatch(a.data(), a.data() + n, b.data()).first - a.data();
+}
+
+/**
+ * @brief 键头：从offset开始的8个字节按大端拼成整数，不够8字节补0
+ * 关键字的字典序和键头的大小一致(键头相等时要比完整的关键字)
+ */
+inline uint64_t keyHead(const string &k, const size_t &offset) {
+  uint64_t head = 0;
+  if (offset < k.size()) {
+    memcpy(&head, k.data() + offset, min<size_t>(k.size() - offset, 8));
+  }
+  return __builtin_bswap64(head);
+}
+
+/**
+ * @brief string关键字的索引：去掉节点内所有关键字的公共前缀，
+ * 每个关键字接下来的8个字节存成键头，键头连续存放，用uint64_t的SIMD查找，
+ * 只有键头相等时才比较完整的string
+ */
+template <>
+class KeyIndex<string> {
+ public:
+  static constexpr size_t storageSize(const size_t &capacity) {
+    return sizeof(uint64_t) * capacity;
+  }
+  KeyIndex(string *keys, const size_t &capacity)
+      : _heads(reinterpret_cast<uint64_t *>(keys + capacity)) {}
+
+  /* 关键字有序，公共前缀就是首尾两个的公共前缀 */
+  void rebuild(const string *keys, const size_t &n) {
+    _prefixLength = n ? commonPrefixLength(keys[0], keys[n - 1]) : 0;
+    for (size_t i = 0; i < n; ++i) {
+      _heads[i] = keyHead(keys[i], _prefixLength);
+    }
+  }
+
+  size_t lowerBound(const string *keys, const size_t &n,
+                    const string &k) const {
+    if (!n) {
+      return 0;
+    }
+    //前缀不同时k比所有关键字都小或都大
+    int order = k.compare(0, _prefixLength, keys[0], 0, _prefixLength);
+    if (order) {
+      return order < 0 ? 0 : n;
+    }
+    const uint64_t head = keyHead(k, _prefixLength);
+    size_t first = keyLowerBound(_heads, n, head);
+    size_t last = first;
+    while (last < n && _heads[last] == head) {
+      ++last;
+    }
+    return lower_bound(keys + first, keys + last, k) - keys;
+  }
+
+  /* 节点内关键字的公共前缀长度 */
+  size_t getPrefixLength() const { return _prefixLength; }
+
+ private:
+  uint64_t *_heads;
+  size_t _prefixLength = 0;
+};
+#endif
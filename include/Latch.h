@@ -0,0 +1,255 @@
+#ifndef LATCH_H
+#define LATCH_H
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+using namespace std;
+
+/**
+ * @brief 带版本号的节点锁
+ * 写锁加锁、解锁时版本号各加一，奇数表示有写者。
+ * 乐观读者先读版本号，再读节点内容，最后校验版本号没变，全程不写共享内存。
+ * 读锁(lock_shared)不改版本号，原先的 shared_lock 用法不变。
+ */
+class OptLock {
+ public:
+  OptLock() = default;
+  OptLock(const OptLock &) = delete;
+  OptLock &operator=(const OptLock &) = delete;
+
+  /* 写锁 */
+  void lock() {
+    _mutex.lock();
+    bumpVersion();
+  }
+  bool try_lock() {
+    if (!_mutex.try_lock()) {
+      return false;
+    }
+    bumpVersion();
+    return true;
+  }
+  void unlock() {
+    bumpVersion();
+    _mutex.unlock();
+  }
+
+  /* 读锁 */
+  void lock_shared() { _mutex.lock_shared(); }
+  bool try_lock_shared() { return _mutex.try_lock_shared(); }
+  void unlock_shared() { _mutex.unlock_shared(); }
+
+  /**
+   * @brief 乐观读：取当前版本号
+   * @return 节点正在被写或已被废弃时返回false，调用者应重启
+   */
+  bool readVersion(uint64_t &version) const {
+    version = _version.load(memory_order_acquire);
+    return !(version & 1) && !_obsolete.load(memory_order_acquire);
+  }
+
+  /* 校验读期间版本号没有变化 */
+  bool validate(const uint64_t &version) const {
+    atomic_thread_fence(memory_order_acquire);
+    return _version.load(memory_order_relaxed) == version;
+  }
+
+  /* 版本号仍是version时加写锁，相当于乐观读升级成写锁 */
+  bool lockIfVersion(const uint64_t &version) {
+    _mutex.lock();
+    if (_version.load(memory_order_relaxed) != version ||
+        _obsolete.load(memory_order_relaxed)) {
+      _mutex.unlock();
+      return false;
+    }
+    bumpVersion();
+    return true;
+  }
+
+  /* 节点被合并或删除时解锁，之后的乐观读者都会重启 */
+  void unlockObsolete() {
+    _obsolete.store(true, memory_order_release);
+    unlock();
+  }
+
+  /* 是否已被废弃 */
+  bool isObsolete() const { return _obsolete.load(memory_order_acquire); }
+
+ private:
+  void bumpVersion() {
+    _version.store(_version.load(memory_order_relaxed) + 1,
+                   memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+  }
+
+  atomic<uint64_t> _version{0};
+  atomic<bool> _obsolete{false};
+  shared_mutex _mutex;
+};
+
+/**
+ * @brief 基于epoch的延迟回收
+ * 乐观读者不持锁访问节点，被合并掉的节点不能马上delete，
+ * 先挂到退休链表，等退休之前进入的操作都退出后再释放。
+ */
+class EpochManager {
+  typedef void (*deleter_type)(void *);
+
+ public:
+  static EpochManager &instance() {
+    static EpochManager manager;
+    return manager;
+  }
+  ~EpochManager() {
+    for (auto &retired : _retired) {
+      retired.second.second(retired.second.first);
+    }
+  }
+
+  /* 进入临界区，返回占用的槽位 */
+  size_t enter() {
+    static atomic<size_t> nextHint{0};
+    thread_local size_t hint = nextHint.fetch_add(1) % SLOT_NUM;
+    while (true) {
+      for (size_t i = 0; i < SLOT_NUM; ++i) {
+        size_t slot = (hint + i) % SLOT_NUM;
+        uint64_t expected = 0;
+        if (_slots[slot].epoch.load(memory_order_relaxed) == 0 &&
+            _slots[slot].epoch.compare_exchange_strong(
+                expected, _globalEpoch.load())) {
+          hint = slot;
+          return slot;
+        }
+      }
+      this_thread::yield();
+    }
+  }
+
+  /* 退出临界区 */
+  void exit(const size_t &slot) {
+    _slots[slot].epoch.store(0, memory_order_release);
+  }
+
+  /* 退休一个已经从树上摘下的节点 */
+  template <typename N>
+  void retire(N *node) {
+    deleter_type deleter = [](void *p) { delete static_cast<N *>(p); };
+    lock_guard<mutex> guard(_retireMutex);
+    _retired.push_back(make_pair(_globalEpoch.fetch_add(1),
+                                 make_pair(static_cast<void *>(node), deleter)));
+    if (_retired.size() >= RECLAIM_THRESHOLD) {
+      reclaim();
+    }
+  }
+
+ private:
+  EpochManager() = default;
+
+  /* 释放所有活跃操作都看不到的节点，调用时持有_retireMutex */
+  void reclaim() {
+    uint64_t minEpoch = _globalEpoch.load();
+    for (size_t i = 0; i < SLOT_NUM; ++i) {
+      uint64_t epoch = _slots[i].epoch.load();
+      if (epoch && epoch < minEpoch) {
+        minEpoch = epoch;
+      }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < _retired.size(); ++i) {
+      if (_retired[i].first < minEpoch) {
+        _retired[i].second.second(_retired[i].second.first);
+      } else {
+        _retired[kept++] = _retired[i];
+      }
+    }
+    _retired.resize(kept);
+  }
+
+  static constexpr size_t SLOT_NUM = 128;
+  static constexpr size_t RECLAIM_THRESHOLD = 64;
+  struct alignas(64) Slot {
+    atomic<uint64_t> epoch{0};
+  };
+  atomic<uint64_t> _globalEpoch{1};
+  Slot _slots[SLOT_NUM];
+  mutex _retireMutex;
+  vector<pair<uint64_t, pair<void *, deleter_type>>> _retired;
+};
+
+/* 进入epoch临界区的RAII封装 */
+class EpochGuard {
+ public:
+  EpochGuard() : _slot(EpochManager::instance().enter()) {}
+  ~EpochGuard() { EpochManager::instance().exit(_slot); }
+  EpochGuard(const EpochGuard &) = delete;
+  EpochGuard &operator=(const EpochGuard &) = delete;
+
+ private:
+  size_t _slot;
+};
+
+/**
+ * @brief 写操作的闸门，用法同shared_mutex
+ * 写操作持共享锁，进出只改自己线程分到的计数，不和别的线程抢同一个缓存行；
+ * 持独占锁的一方关闸拦住新的写操作，等已经进来的都出去，在写操作之间切出一个时间点
+ */
+class WriteGate {
+ public:
+  WriteGate() = default;
+  WriteGate(const WriteGate &) = delete;
+  WriteGate &operator=(const WriteGate &) = delete;
+
+  void lock_shared() {
+    Stripe &stripe = _stripes[stripeIndex()];
+    while (true) {
+      stripe.count.fetch_add(1);
+      if (!_closed.load()) {
+        return;
+      }
+      //正在关闸，退出来等开闸，不然关闸的一方等不到计数归零
+      stripe.count.fetch_sub(1);
+      while (_closed.load(memory_order_acquire)) {
+        this_thread::yield();
+      }
+    }
+  }
+  void unlock_shared() {
+    _stripes[stripeIndex()].count.fetch_sub(1, memory_order_release);
+  }
+
+  /* 关闸并等正在进行的写操作结束 */
+  void lock() {
+    _closeMutex.lock();
+    _closed.store(true);
+    for (Stripe &stripe : _stripes) {
+      while (stripe.count.load()) {
+        this_thread::yield();
+      }
+    }
+  }
+  void unlock() {
+    _closed.store(false, memory_order_release);
+    _closeMutex.unlock();
+  }
+
+ private:
+  static size_t stripeIndex() {
+    static atomic<size_t> next{0};
+    thread_local size_t index = next.fetch_add(1) % STRIPE_NUM;
+    return index;
+  }
+
+  static constexpr size_t STRIPE_NUM = 16;
+  struct alignas(64) Stripe {
+    atomic<int64_t> count{0};
+  };
+  Stripe _stripes[STRIPE_NUM];
+  atomic<bool> _closed{false};
+  mutex _closeMutex;
+};
+#endif
@@ -0,0 +1,235 @@
+#ifndef MAPPED_TREE_H
+#define MAPPED_TREE_H
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "KeyCodec.h"
+#include "KeySearch.h"
+#include "PageFile.h"
+using namespace std;
+
+/**
+ * @brief 只读打开分页文件，不反序列化，直接在映射的页上查找
+ * 打开时只读文件头，节点页在访问时才由缺页载入，多个进程映射同一个文件时共享页缓存。
+ * 叶子的关键字打包时(见B_Plus_Tree_Save_Packed)查找只解出二分剩下的窗口。
+ * 映射期间文件不能被改写，在原位写页的增量检查点不能指向正在映射的文件。
+ */
+template <typename T>
+class MappedBPlusTree {
+  typedef typename vector<T>::size_type size_type;
+  typedef PageLayout<T> layout;
+
+ public:
+  MappedBPlusTree() = default;
+  MappedBPlusTree(const MappedBPlusTree &) = delete;
+  MappedBPlusTree &operator=(const MappedBPlusTree &) = delete;
+  ~MappedBPlusTree() { close(); }
+
+  /**
+   * @brief 映射B_Plus_Tree_Save存下的文件，有没写回完的页日志时先写回
+   * @return 打不开、页日志写回失败或格式不对返回false
+   */
+  bool open(const string &path) {
+    static_assert(is_trivially_copyable<T>::value,
+                  "分页文件只支持定长关键字");
+    close();
+    if (!applyPageJournal(path)) {
+      cerr << "映射时" << path << "的页日志写回失败" << endl;
+      return false;
+    }
+    PageFile file;
+    PageFileHeader header;
+    if (!file.open(path, false) || !file.readAt(&header, sizeof(header), 0)) {
+      cerr << "映射时" << path << "打开失败" << endl;
+      return false;
+    }
+    if (!checkPageFileHeader<T>(header) || header.root == INVALID_PAGE ||
+        file.size() < header.pageCount * header.pageSize) {
+      cerr << path << "不是分页文件" << endl;
+      return false;
+    }
+    size_t length = header.pageCount * header.pageSize;
+    void *base = mmap(nullptr, length, PROT_READ, MAP_SHARED, file.fd(), 0);
+    if (base == MAP_FAILED) {
+      cerr << "映射" << path << "失败" << endl;
+      return false;
+    }
+    //按关键字查找是随机访问，不要预读
+    madvise(base, length, MADV_RANDOM);
+    _base = static_cast<const char *>(base);
+    _length = length;
+    _header = header;
+    return true;
+  }
+
+  void close() {
+    if (_base) {
+      munmap(const_cast<char *>(_base), _length);
+      _base = nullptr;
+      _length = 0;
+    }
+  }
+
+  bool isOpen() const { return _base != nullptr; }
+  size_type getMAX_SIZE() const { return _header.maxSize; }
+
+  /**
+   * @brief 查找关键字
+   * @return 查找成功返回值，失败或文件内容损坏返回空
+   */
+  optional<uint64_t> B_Plus_Tree_Search(const T &k) const {
+    const char *leaf = findLeaf(k);
+    if (!leaf) {
+      return nullopt;
+    }
+    const PageNode *node = layout::node(leaf);
+    const uint64_t *values = layout::values(leaf, _header.maxSize);
+    if (node->keyEncoding == PAGE_KEYS_RAW) {
+      const T *keys = layout::keys(leaf);
+      size_type index = keyLowerBound(keys, node->keyNum, k);
+      if (index < node->keyNum && keys[index] == k) {
+        return values[index];
+      }
+      return nullopt;
+    }
+    if constexpr (PackableKey<T>::value) {
+      const char *block = packedBlock(leaf);
+      if (block) {
+        size_type index = packedLowerBound(block, node->keyNum, k);
+        if (index < node->keyNum && packedKeyAt<T>(block, index) == k) {
+          return values[index];
+        }
+      }
+    }
+    return nullopt;
+  }
+
+  /**
+   * @brief 流式范围扫描，对[l, r)里的每个键值对按顺序调用func
+   * 损坏的文件里叶子链表可能成环，最多走pageCount个叶子
+   * @param func bool(const T &k, const uint64_t &value)，返回false时提前结束
+   */
+  template <typename Func>
+  void B_Plus_Tree_Scan(const T &l, const T &r, Func func) const {
+    const char *leaf = findLeaf(l);
+    if (!leaf) {
+      return;
+    }
+    //打包的叶子整个解到这里再扫
+    vector<T> unpacked;
+    bool first = true;
+    size_type index = 0;
+    for (uint64_t step = 0; leaf && step < _header.pageCount; ++step) {
+      const PageNode *node = layout::node(leaf);
+      const T *keys = leafKeys(leaf, unpacked);
+      const uint64_t *values = layout::values(leaf, _header.maxSize);
+      if (!keys || !node->isLeaf) {
+        return;
+      }
+      if (first) {
+        index = keyLowerBound(keys, node->keyNum, l);
+        first = false;
+      }
+      for (; index < node->keyNum; ++index) {
+        if (!(keys[index] < r) || !func(keys[index], values[index])) {
+          return;
+        }
+      }
+      leaf = page(node->next);
+      index = 0;
+    }
+  }
+
+  /**
+   * @brief 范围查询[l, r)
+   */
+  vector<pair<T, uint64_t>> B_Plus_Tree_Search_For_Range(const T &l,
+                                                        const T &r) const {
+    vector<pair<T, uint64_t>> result;
+    B_Plus_Tree_Scan(l, r, [&](const T &k, const uint64_t &value) {
+      result.push_back(make_pair(k, value));
+      return true;
+    });
+    return result;
+  }
+
+ private:
+  /* 页号对应的页，越界返回nullptr */
+  const char *page(const page_id &id) const {
+    if (id == INVALID_PAGE || id >= _header.pageCount) {
+      return nullptr;
+    }
+    return _base + id * _header.pageSize;
+  }
+
+  /**
+   * @brief 叶子的关键字数组，打包的先解到unpacked里
+   * @return 关键字数或打包的块不对返回nullptr
+   */
+  const T *leafKeys(const char *leaf, vector<T> &unpacked) const {
+    const PageNode *node = layout::node(leaf);
+    if (node->keyNum > _header.maxSize) {
+      return nullptr;
+    }
+    if (node->keyEncoding == PAGE_KEYS_RAW) {
+      return layout::keys(leaf);
+    }
+    if constexpr (PackableKey<T>::value) {
+      const char *block = packedBlock(leaf);
+      if (block) {
+        unpacked.resize(node->keyNum);
+        unpackKeys(block, 0, node->keyNum, unpacked.data());
+        return unpacked.data();
+      }
+    }
+    return nullptr;
+  }
+
+  /* 叶子里打包的关键字块，编码或长度不对返回nullptr */
+  const char *packedBlock(const char *leaf) const {
+    const PageNode *node = layout::node(leaf);
+    const char *block = reinterpret_cast<const char *>(layout::keys(leaf));
+    if (node->keyEncoding != PAGE_KEYS_PACKED || !node->isLeaf ||
+        !checkPackedBlockIn<T>(block, layout::keyBytes(_header.maxSize),
+                               node->keyNum)) {
+      return nullptr;
+    }
+    return block;
+  }
+
+  /* 从根下降到k所在叶子，遇见相等的关键字向右走 */
+  const char *findLeaf(const T &k) const {
+    const char *current = page(_header.root);
+    for (size_type depth = 0; current && depth < MAX_DEPTH; ++depth) {
+      const PageNode *node = layout::node(current);
+      if (node->keyNum > _header.maxSize) {
+        return nullptr;
+      }
+      if (node->isLeaf) {
+        return current;
+      }
+      const T *keys = layout::keys(current);
+      size_type index = keyLowerBound(keys, node->keyNum, k);
+      if (index < node->keyNum && keys[index] == k) {
+        ++index;
+      }
+      current = page(layout::values(current, _header.maxSize)[index]);
+    }
+    return nullptr;
+  }
+
+  /* 损坏的文件里孩子页号可能成环，下降超过这个深度就放弃 */
+  static constexpr size_type MAX_DEPTH = 64;
+  const char *_base = nullptr;
+  size_t _length = 0;
+  PageFileHeader _header{};
+};
+#endif
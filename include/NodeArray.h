@@ -0,0 +1,115 @@
+#ifndef NODE_ARRAY_H
+#define NODE_ARRAY_H
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <new>
+#include <utility>
+using namespace std;
+
+/**
+ * @brief 定长数组，内存由节点提供
+ * 节点和它的关键字、值、孩子数组在同一次分配里，数组只记录起始位置和长度，
+ * 不会重新分配，乐观读者读到的地址始终有效。
+ * @tparam E 元素类型
+ */
+template <typename E>
+class NodeArray {
+ public:
+  typedef size_t size_type;
+  typedef E *iterator;
+  typedef const E *const_iterator;
+
+  NodeArray(E *data, const size_type &capacity)
+      : _data(data), _size(0), _capacity(capacity) {}
+  template <typename InputIt>
+  NodeArray(E *data, const size_type &capacity, InputIt first, InputIt last)
+      : NodeArray(data, capacity) {
+    assign(first, last);
+  }
+  NodeArray(const NodeArray &) = delete;
+  NodeArray &operator=(const NodeArray &) = delete;
+  ~NodeArray() { clear(); }
+
+  iterator begin() { return _data; }
+  iterator end() { return _data + _size; }
+  const_iterator begin() const { return _data; }
+  const_iterator end() const { return _data + _size; }
+
+  size_type size() const { return _size; }
+  size_type capacity() const { return _capacity; }
+  bool empty() const { return !_size; }
+
+  E &operator[](const size_type &index) { return _data[index]; }
+  const E &operator[](const size_type &index) const { return _data[index]; }
+  E &back() { return _data[_size - 1]; }
+  const E &back() const { return _data[_size - 1]; }
+
+  void push_back(const E &value) {
+    new (_data + _size) E(value);
+    ++_size;
+  }
+
+  /* 在pos前插入，后面的元素整体后移 */
+  iterator insert(iterator pos, const E &value) {
+    if (pos == end()) {
+      push_back(value);
+      return pos;
+    }
+    E copy(value);
+    new (end()) E(std::move(back()));
+    move_backward(pos, end() - 1, end());
+    *pos = std::move(copy);
+    ++_size;
+    return pos;
+  }
+  template <typename InputIt>
+  iterator insert(iterator pos, InputIt first, InputIt last) {
+    iterator it = pos;
+    for (; first != last; ++first, ++it) {
+      insert(it, *first);
+    }
+    return pos;
+  }
+
+  iterator erase(iterator pos) { return erase(pos, pos + 1); }
+  iterator erase(iterator first, iterator last) {
+    iterator newEnd = std::move(last, end(), first);
+    destroy(newEnd, end());
+    _size = newEnd - _data;
+    return first;
+  }
+
+  template <typename InputIt>
+  void assign(InputIt first, InputIt last) {
+    clear();
+    for (; first != last; ++first) {
+      push_back(*first);
+    }
+  }
+
+  void clear() {
+    destroy(begin(), end());
+    _size = 0;
+  }
+
+ private:
+  static void destroy(iterator first, iterator last) {
+    for (; first != last; ++first) {
+      first->~E();
+    }
+  }
+
+  E *_data;
+  size_type _size;
+  size_type _capacity;
+};
+
+/* 节点按缓存行对齐分配 */
+constexpr size_t CACHE_LINE = 64;
+
+/* 把offset向上对齐到align */
+constexpr size_t alignUp(const size_t &offset, const size_t &align) {
+  return (offset + align - 1) / align * align;
+}
+#endif
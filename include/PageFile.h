@@ -0,0 +1,370 @@
+#ifndef PAGE_FILE_H
+#define PAGE_FILE_H
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "NodeArray.h"
+using namespace std;
+
+/**
+ * @brief 单文件分页存储格式
+ * 文件由定长页组成，第0页是文件头，其余每页放一个节点，节点之间用页号互相引用。
+ * 页内布局：[PageNode][关键字数组][值数组或孩子页号数组]，按本机字节序存放，
+ * 只支持定长(可按位拷贝)的关键字。叶子的关键字区也可以放KeyCodec.h打包的块，
+ * 这样的文件只读。
+ */
+
+typedef uint64_t page_id;
+
+/* 第0页是文件头，页号0也表示空 */
+constexpr page_id INVALID_PAGE = 0;
+/* "BPTPAGE1" */
+constexpr uint64_t PAGE_FILE_MAGIC = 0x3145474150545042ULL;
+constexpr uint32_t PAGE_FILE_VERSION = 1;
+/* 页大小按扇区对齐 */
+constexpr size_t PAGE_ALIGN = 512;
+
+/* 文件头，放在第0页 */
+struct PageFileHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t pageSize;
+  uint64_t maxSize;
+  uint64_t keySize;
+  page_id root;
+  page_id head;
+  /* 包括文件头在内的页数 */
+  uint64_t pageCount;
+  /* 作为检查点时已包含的日志位置，从这里开始回放预写日志 */
+  uint64_t checkpointLsn;
+  /* PageFileFlag，旧文件这里是0 */
+  uint64_t flags;
+};
+
+enum PageFileFlag : uint64_t {
+  /* 有叶子的关键字是打包的，缓冲池模式不能打开，也不能在上面做增量检查点 */
+  PAGE_FILE_PACKED_KEYS = 1
+};
+
+/* 节点页关键字区的编码 */
+enum PageKeyEncoding : uint8_t {
+  PAGE_KEYS_RAW = 0,
+  /* 只有叶子用，关键字区是KeyCodec.h打包的块 */
+  PAGE_KEYS_PACKED = 1
+};
+
+/* 节点页的页头 */
+struct PageNode {
+  uint8_t isLeaf;
+  /* 节点已删除，页可以复用，恢复时跳过 */
+  uint8_t isFree;
+  /* PageKeyEncoding */
+  uint8_t keyEncoding;
+  uint8_t reserved;
+  uint32_t keyNum;
+  uint32_t level;
+  uint32_t reserved2;
+  /* 叶子的左右兄弟，内部节点不用 */
+  page_id next;
+  page_id prev;
+};
+
+/**
+ * @brief 节点页的布局
+ * 一页最多放maxSize个关键字，叶子放同样多的值，内部节点放maxSize+1个孩子页号
+ */
+template <typename T>
+struct PageLayout {
+  static size_t keyOffset() {
+    return alignUp(sizeof(PageNode), max(alignof(T), alignof(uint64_t)));
+  }
+  static size_t valueOffset(const size_t &maxSize) {
+    return alignUp(keyOffset() + sizeof(T) * maxSize, alignof(uint64_t));
+  }
+  /* 关键字区的字节数，打包的块不能超过它 */
+  static size_t keyBytes(const size_t &maxSize) {
+    return valueOffset(maxSize) - keyOffset();
+  }
+  static size_t nodeSize(const size_t &maxSize) {
+    return valueOffset(maxSize) + sizeof(uint64_t) * (maxSize + 1);
+  }
+  static uint32_t pageSize(const size_t &maxSize) {
+    return alignUp(max(nodeSize(maxSize), sizeof(PageFileHeader)), PAGE_ALIGN);
+  }
+
+  static PageNode *node(char *page) {
+    return reinterpret_cast<PageNode *>(page);
+  }
+  static const PageNode *node(const char *page) {
+    return reinterpret_cast<const PageNode *>(page);
+  }
+  static T *keys(char *page) {
+    return reinterpret_cast<T *>(page + keyOffset());
+  }
+  static const T *keys(const char *page) {
+    return reinterpret_cast<const T *>(page + keyOffset());
+  }
+  /* 叶子是值，内部节点是孩子页号 */
+  static uint64_t *values(char *page, const size_t &maxSize) {
+    return reinterpret_cast<uint64_t *>(page + valueOffset(maxSize));
+  }
+  static const uint64_t *values(const char *page, const size_t &maxSize) {
+    return reinterpret_cast<const uint64_t *>(page + valueOffset(maxSize));
+  }
+};
+
+/* 文件头是否和这棵树的参数对得上 */
+template <typename T>
+bool checkPageFileHeader(const PageFileHeader &header) {
+  return header.magic == PAGE_FILE_MAGIC &&
+         header.version == PAGE_FILE_VERSION &&
+         header.keySize == sizeof(T) && header.maxSize > 1 &&
+         header.pageSize == PageLayout<T>::pageSize(header.maxSize) &&
+         header.root < header.pageCount && header.head < header.pageCount;
+}
+
+/**
+ * @brief 分页文件的读写，按偏移量pread/pwrite，不移动文件指针，可以多线程同时读
+ */
+class PageFile {
+ public:
+  PageFile() = default;
+  PageFile(const PageFile &) = delete;
+  PageFile &operator=(const PageFile &) = delete;
+  ~PageFile() { close(); }
+
+  /**
+   * @brief 打开文件
+   * @param create 为true时创建或清空文件用于写，否则打开已有文件
+   * @param writable 打开已有文件时是否可写
+   */
+  bool open(const string &path, const bool &create,
+            const bool &writable = false) {
+    close();
+    if (create) {
+      _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    } else {
+      _fd = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+    }
+    return _fd >= 0;
+  }
+
+  void close() {
+    if (_fd >= 0) {
+      ::close(_fd);
+      _fd = -1;
+    }
+  }
+
+  bool isOpen() const { return _fd >= 0; }
+  int fd() const { return _fd; }
+
+  /* 从offset开始读size字节，读不满返回false */
+  bool readAt(void *buf, size_t size, uint64_t offset) const {
+    char *p = static_cast<char *>(buf);
+    while (size) {
+      ssize_t n = ::pread(_fd, p, size, offset);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      p += n;
+      size -= n;
+      offset += n;
+    }
+    return true;
+  }
+
+  /* 从offset开始写size字节 */
+  bool writeAt(const void *buf, size_t size, uint64_t offset) {
+    const char *p = static_cast<const char *>(buf);
+    while (size) {
+      ssize_t n = ::pwrite(_fd, p, size, offset);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      p += n;
+      size -= n;
+      offset += n;
+    }
+    return true;
+  }
+
+  /**
+   * @brief 把iov里的多段数据从offset开始连续写出，每次pwritev最多IOV_MAX段
+   * 写了一部分时调整iov接着写，iov的内容会被改掉
+   */
+  bool writeVAt(vector<iovec> &iov, uint64_t offset) {
+    iovec *segment = iov.data();
+    size_t count = iov.size();
+    while (true) {
+      while (count && !segment->iov_len) {
+        ++segment;
+        --count;
+      }
+      if (!count) {
+        return true;
+      }
+      ssize_t n = ::pwritev(_fd, segment, min<size_t>(count, IOV_MAX), offset);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return false;
+      }
+      offset += n;
+      for (size_t done = n; done;) {
+        size_t step = min(done, segment->iov_len);
+        segment->iov_base = static_cast<char *>(segment->iov_base) + step;
+        segment->iov_len -= step;
+        done -= step;
+        if (!segment->iov_len) {
+          ++segment;
+          --count;
+        }
+      }
+    }
+  }
+
+  /* 把写入的数据刷到磁盘 */
+  bool sync() { return ::fdatasync(_fd) == 0; }
+
+  /* 文件大小 */
+  uint64_t size() const {
+    struct stat st;
+    return ::fstat(_fd, &st) == 0 ? st.st_size : 0;
+  }
+
+ private:
+  int _fd = -1;
+};
+
+/* 改名后刷目录，新文件名才算落盘 */
+inline bool syncParentDirectory(const string &path) {
+  string::size_type slash = path.rfind('/');
+  string dir = slash == string::npos ? "." : path.substr(0, slash + 1);
+  int fd = ::open(dir.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = ::fsync(fd) == 0;
+  ::close(fd);
+  return ok;
+}
+
+/* 读文件头 */
+inline bool readPageFileHeader(const string &path, PageFileHeader &header) {
+  PageFile file;
+  return file.open(path, false) && file.readAt(&header, sizeof(header), 0);
+}
+
+/**
+ * @brief 页日志，增量检查点用
+ * 要改的页和新文件头先整体写进页日志，改名生效后再写回分页文件原来的位置，
+ * 写回到一半崩溃时下次打开从页日志重做，分页文件不会停在新旧混合的状态。
+ * 格式：[PageJournalHeader][页号数组][页内容]
+ */
+
+/* "BPTJRNL1" */
+constexpr uint64_t PAGE_JOURNAL_MAGIC = 0x314c4e524a545042ULL;
+
+struct PageJournalHeader {
+  uint64_t magic;
+  uint64_t pageNum;
+  /* 写回后分页文件的文件头 */
+  PageFileHeader header;
+};
+
+inline string pageJournalPath(const string &path) { return path + ".journal"; }
+
+/**
+ * @brief 写页日志，先写临时文件再改名，改名成功即检查点生效
+ * @param images 和ids一一对应的页内容，每页header.pageSize字节
+ */
+inline bool writePageJournal(const string &path, const PageFileHeader &header,
+                             const vector<page_id> &ids,
+                             const vector<char> &images) {
+  string journal = pageJournalPath(path);
+  string temp = journal + ".tmp";
+  PageJournalHeader journalHeader{PAGE_JOURNAL_MAGIC, ids.size(), header};
+  const uint64_t idBytes = ids.size() * sizeof(page_id);
+  PageFile file;
+  bool ok = file.open(temp, true) &&
+            file.writeAt(&journalHeader, sizeof(journalHeader), 0) &&
+            file.writeAt(ids.data(), idBytes, sizeof(journalHeader)) &&
+            file.writeAt(images.data(), images.size(),
+                         sizeof(journalHeader) + idBytes) &&
+            file.sync();
+  file.close();
+  return ok && ::rename(temp.c_str(), journal.c_str()) == 0 &&
+         syncParentDirectory(journal);
+}
+
+/**
+ * @brief 把页日志写回分页文件后删掉，没有页日志时什么也不做
+ * 写回可以重做任意多次
+ * @return 页日志损坏或写回失败返回false
+ */
+inline bool applyPageJournal(const string &path) {
+  string journal = pageJournalPath(path);
+  PageFile file;
+  if (!file.open(journal, false)) {
+    return errno == ENOENT;
+  }
+  PageJournalHeader journalHeader;
+  if (!file.readAt(&journalHeader, sizeof(journalHeader), 0) ||
+      journalHeader.magic != PAGE_JOURNAL_MAGIC) {
+    return false;
+  }
+  const uint64_t pageSize = journalHeader.header.pageSize;
+  const uint64_t pageNum = journalHeader.pageNum;
+  if (pageSize < sizeof(PageFileHeader) ||
+      file.size() !=
+          sizeof(journalHeader) + pageNum * (sizeof(page_id) + pageSize)) {
+    return false;
+  }
+  vector<page_id> ids(pageNum);
+  vector<char> images(pageNum * pageSize);
+  const uint64_t idBytes = pageNum * sizeof(page_id);
+  if (!file.readAt(ids.data(), idBytes, sizeof(journalHeader)) ||
+      !file.readAt(images.data(), images.size(),
+                   sizeof(journalHeader) + idBytes)) {
+    return false;
+  }
+  PageFile pages;
+  if (!pages.open(path, false, true)) {
+    return false;
+  }
+  for (uint64_t i = 0; i < pageNum; ++i) {
+    if (ids[i] == INVALID_PAGE ||
+        !pages.writeAt(images.data() + i * pageSize, pageSize,
+                       ids[i] * pageSize)) {
+      return false;
+    }
+  }
+  vector<char> headerPage(pageSize, 0);
+  copy_n(reinterpret_cast<const char *>(&journalHeader.header),
+         sizeof(journalHeader.header), headerPage.data());
+  if (!pages.writeAt(headerPage.data(), pageSize, 0) || !pages.sync()) {
+    return false;
+  }
+  file.close();
+  return ::remove(journal.c_str()) == 0 && syncParentDirectory(journal);
+}
+#endif
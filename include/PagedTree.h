@@ -0,0 +1,460 @@
+#ifndef PAGED_TREE_H
+#define PAGED_TREE_H
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "BufferPool.h"
+#include "KeySearch.h"
+#include "PageFile.h"
+using namespace std;
+
+/**
+ * @brief 分页模式的B+树，节点放在分页文件里，经缓冲池读写
+ * 孩子和兄弟用页号引用，只有常用的页(通常是上面几层)留在内存里，树可以比内存大。
+ * 页格式和B_Plus_Tree_Save相同，节点也和内存树一样最多MAX_SIZE-1个关键字，
+ * MappedBPlusTree能直接打开；删过关键字后节点可能不到半满，B_Plus_Tree_Load会拒绝。
+ * 并发沿用内存树的锁耦合：先锁孩子页再放父亲页，插入先只给叶子加写锁，
+ * 叶子要分裂时从根加写锁重来，遇到不会分裂的节点就放开上面的页。
+ * 删除不合并节点，叶子删空了也留在链表里。
+ * 同时操作的线程数乘以树高不能超过缓冲池的帧数，插入分裂时每个线程
+ * 还要多固定两页，帧不够时等不到空闲帧的操作会失败返回。
+ */
+template <typename T>
+class PagedBPlusTree {
+  typedef typename vector<T>::size_type size_type;
+  typedef PageLayout<T> layout;
+
+  /* 节点分裂后要插进父亲的关键字和右半边 */
+  struct Split {
+    bool happened = false;
+    T key{};
+    page_id right = INVALID_PAGE;
+  };
+
+ public:
+  explicit PagedBPlusTree(const size_t &frameNum) : _pool(frameNum) {}
+  PagedBPlusTree(const PagedBPlusTree &) = delete;
+  PagedBPlusTree &operator=(const PagedBPlusTree &) = delete;
+  ~PagedBPlusTree() { close(); }
+
+  /**
+   * @brief 新建一棵空树，已有的文件会被清空
+   */
+  bool create(const string &path, const size_type &max_size) {
+    static_assert(is_trivially_copyable<T>::value,
+                  "分页文件只支持定长关键字");
+    if (max_size < 3) {
+      cerr << "分页模式的度数至少是3" << endl;
+      return false;
+    }
+    PageFileHeader header{};
+    header.magic = PAGE_FILE_MAGIC;
+    header.version = PAGE_FILE_VERSION;
+    header.pageSize = layout::pageSize(max_size);
+    header.maxSize = max_size;
+    header.keySize = sizeof(T);
+    if (!_pool.create(path, header)) {
+      return false;
+    }
+    _MAX_SIZE = max_size;
+    Frame *frame = _pool.newPage();
+    if (!frame) {
+      return false;
+    }
+    PageGuard root(&_pool, frame, true);
+    layout::node(root.data())->isLeaf = 1;
+    _root = _head = root.id();
+    _pool.setRoot(_root, _head);
+    root.release();
+    return _pool.flush();
+  }
+
+  /**
+   * @brief 打开已有的分页文件，叶子关键字打包的只读文件打不开
+   */
+  bool open(const string &path) {
+    static_assert(is_trivially_copyable<T>::value,
+                  "分页文件只支持定长关键字");
+    if (!_pool.template open<T>(path) || _pool.maxSize() < 3) {
+      return false;
+    }
+    if (_pool.flags() & PAGE_FILE_PACKED_KEYS) {
+      cerr << path << "的叶子关键字是打包的，只能只读打开" << endl;
+      _pool.close();
+      return false;
+    }
+    _MAX_SIZE = _pool.maxSize();
+    _root = _pool.root();
+    _head = _pool.head();
+    return true;
+  }
+
+  /**
+   * @brief 写回脏页和文件头并刷盘，调用期间不能有写者
+   */
+  bool flush() { return _pool.flush(); }
+  void close() { _pool.close(); }
+  bool isOpen() const { return _pool.isOpen(); }
+  size_type getMAX_SIZE() const { return _MAX_SIZE; }
+  /* 命中率等统计 */
+  BufferPool &getPool() { return _pool; }
+
+  /**
+   * @brief 查找关键字
+   * @return 查找成功返回值，失败、读页出错返回空
+   */
+  optional<uint64_t> B_Plus_Tree_Search(const T &k) {
+    PageGuard leaf = findLeaf(k, false);
+    if (!leaf) {
+      return nullopt;
+    }
+    const PageNode *node = layout::node(leaf.data());
+    const T *keys = layout::keys(leaf.data());
+    size_type index = keyLowerBound(keys, node->keyNum, k);
+    if (index < node->keyNum && keys[index] == k) {
+      return layout::values(leaf.data(), _MAX_SIZE)[index];
+    }
+    return nullopt;
+  }
+
+  /**
+   * @brief 插入键值对，和内存树一样允许重复的关键字
+   * @return 读写页出错返回false
+   */
+  bool B_Plus_Tree_Insert(const pair<T, uint64_t> &data) {
+    PageGuard leaf = findLeaf(data.first, true);
+    if (!leaf) {
+      return false;
+    }
+    if (!isFull(leaf.data())) {
+      Split split;
+      return insertIntoLeaf(leaf, data, split);
+    }
+    leaf.release();
+    return insertPessimistic(data);
+  }
+
+  /**
+   * @brief 删除关键字，不合并节点
+   * @return 没找到返回false
+   */
+  bool B_Plus_Tree_Delete(const T &k) {
+    PageGuard leaf = findLeaf(k, true);
+    if (!leaf) {
+      return false;
+    }
+    PageNode *node = layout::node(leaf.data());
+    T *keys = layout::keys(leaf.data());
+    uint64_t *values = layout::values(leaf.data(), _MAX_SIZE);
+    size_type index = keyLowerBound(keys, node->keyNum, k);
+    if (index == node->keyNum || !(keys[index] == k)) {
+      return false;
+    }
+    copy(keys + index + 1, keys + node->keyNum, keys + index);
+    copy(values + index + 1, values + node->keyNum, values + index);
+    --node->keyNum;
+    leaf.markDirty();
+    return true;
+  }
+
+  /**
+   * @brief 流式范围扫描，对[l, r)里的每个键值对按顺序调用func
+   * 沿叶子链表先锁右兄弟再放当前叶子，func在叶子的读锁下调用
+   * @param func bool(const T &k, const uint64_t &value)，返回false时提前结束
+   */
+  template <typename Func>
+  void B_Plus_Tree_Scan(const T &l, const T &r, Func func) {
+    PageGuard leaf = findLeaf(l, false);
+    if (!leaf) {
+      return;
+    }
+    size_type index = keyLowerBound(layout::keys(leaf.data()),
+                                    layout::node(leaf.data())->keyNum, l);
+    while (leaf) {
+      const PageNode *node = layout::node(leaf.data());
+      const T *keys = layout::keys(leaf.data());
+      const uint64_t *values = layout::values(leaf.data(), _MAX_SIZE);
+      for (; index < node->keyNum; ++index) {
+        if (!(keys[index] < r) || !func(keys[index], values[index])) {
+          return;
+        }
+      }
+      if (node->next == INVALID_PAGE) {
+        return;
+      }
+      leaf = fetch(node->next, false);
+      if (leaf && layout::node(leaf.data())->keyNum > _MAX_SIZE) {
+        return;
+      }
+      index = 0;
+    }
+  }
+
+  /**
+   * @brief 范围查询[l, r)
+   */
+  vector<pair<T, uint64_t>> B_Plus_Tree_Search_For_Range(const T &l,
+                                                        const T &r) {
+    vector<pair<T, uint64_t>> result;
+    B_Plus_Tree_Scan(l, r, [&](const T &k, const uint64_t &value) {
+      result.push_back(make_pair(k, value));
+      return true;
+    });
+    return result;
+  }
+
+ private:
+  /* 固定并锁住一页，失败返回空的PageGuard */
+  PageGuard fetch(const page_id &id, const bool &exclusive) {
+    Frame *frame = _pool.fetchPage(id);
+    return frame ? PageGuard(&_pool, frame, exclusive) : PageGuard();
+  }
+
+  /* 页头是否可信，文件损坏时不越界 */
+  bool checkNode(const PageGuard &guard) const {
+    return guard && layout::node(guard.data())->keyNum <= _MAX_SIZE;
+  }
+
+  /* 和内存树一样，节点到MAX_SIZE-1个关键字就算满了，再插入要分裂 */
+  bool isFull(const char *page) const {
+    return layout::node(page)->keyNum + 1 >= _MAX_SIZE;
+  }
+
+  /* 内部节点里k所在孩子的下标，遇见相等的关键字向右走 */
+  size_type childIndex(const char *page, const T &k) const {
+    const T *keys = layout::keys(page);
+    size_type keyNum = layout::node(page)->keyNum;
+    size_type index = keyLowerBound(keys, keyNum, k);
+    if (index < keyNum && keys[index] == k) {
+      ++index;
+    }
+    return index;
+  }
+
+  /**
+   * @brief 锁耦合下降到k所在叶子，内部节点加读锁
+   * @param exclusive 是否给叶子加写锁
+   * @return 读页出错或文件损坏返回空的PageGuard
+   */
+  PageGuard findLeaf(const T &k, const bool &exclusive) {
+    shared_lock<shared_mutex> rootLock(_rootLatch);
+    PageGuard current = fetch(_root, false);
+    //根就是叶子时改加写锁，拿着根锁根不会变
+    if (exclusive && checkNode(current) &&
+        layout::node(current.data())->isLeaf) {
+      current.release();
+      current = fetch(_root, true);
+    }
+    rootLock.unlock();
+    for (size_type depth = 0; checkNode(current); ++depth) {
+      const PageNode *node = layout::node(current.data());
+      if (node->isLeaf) {
+        return current;
+      }
+      if (depth == MAX_DEPTH) {
+        break;
+      }
+      page_id child =
+          layout::values(current.data(), _MAX_SIZE)[childIndex(
+              current.data(), k)];
+      current = fetch(child, exclusive && node->level == 1);
+    }
+    return PageGuard();
+  }
+
+  /**
+   * @brief 悲观插入，从根加写锁下降
+   * 孩子不满时它不会分裂，放开它上面所有的页和根锁
+   */
+  bool insertPessimistic(const pair<T, uint64_t> &data) {
+    unique_lock<shared_mutex> rootLock(_rootLatch);
+    vector<PageGuard> path;
+    vector<size_type> indices;
+    PageGuard current = fetch(_root, true);
+    while (true) {
+      if (!checkNode(current) || path.size() > MAX_DEPTH) {
+        return false;
+      }
+      const PageNode *node = layout::node(current.data());
+      if (!isFull(current.data())) {
+        path.clear();
+        indices.clear();
+        if (rootLock.owns_lock()) {
+          rootLock.unlock();
+        }
+      }
+      if (node->isLeaf) {
+        path.push_back(std::move(current));
+        break;
+      }
+      size_type index = childIndex(current.data(), data.first);
+      page_id child = layout::values(current.data(), _MAX_SIZE)[index];
+      path.push_back(std::move(current));
+      indices.push_back(index);
+      current = fetch(child, true);
+    }
+    Split split;
+    if (!insertIntoLeaf(path.back(), data, split)) {
+      return false;
+    }
+    for (size_type i = path.size() - 1; split.happened; --i) {
+      //一路满到根，这时还拿着根锁
+      if (!i) {
+        return growRoot(path[0], split);
+      }
+      Split up;
+      if (!insertIntoInner(path[i - 1], indices[i - 1], split, up)) {
+        return false;
+      }
+      split = up;
+    }
+    return true;
+  }
+
+  /**
+   * @brief 键值对插进叶子，叶子满了先分裂
+   * @param split 分裂时带回右半边
+   */
+  bool insertIntoLeaf(PageGuard &leaf, const pair<T, uint64_t> &data,
+                      Split &split) {
+    PageNode *node = layout::node(leaf.data());
+    T *keys = layout::keys(leaf.data());
+    uint64_t *values = layout::values(leaf.data(), _MAX_SIZE);
+    size_type keyNum = node->keyNum;
+    size_type index = keyLowerBound(keys, keyNum, data.first);
+    leaf.markDirty();
+    if (!isFull(leaf.data())) {
+      copy_backward(keys + index, keys + keyNum, keys + keyNum + 1);
+      copy_backward(values + index, values + keyNum, values + keyNum + 1);
+      keys[index] = data.first;
+      values[index] = data.second;
+      ++node->keyNum;
+      return true;
+    }
+    //满了先合到临时数组里再对半分
+    vector<T> allKeys(keys, keys + keyNum);
+    vector<uint64_t> allValues(values, values + keyNum);
+    allKeys.insert(allKeys.begin() + index, data.first);
+    allValues.insert(allValues.begin() + index, data.second);
+    PageGuard right = newNode(true, 0);
+    if (!right) {
+      return false;
+    }
+    size_type mid = allKeys.size() / 2;
+    PageNode *rightNode = layout::node(right.data());
+    copy(allKeys.begin(), allKeys.begin() + mid, keys);
+    copy(allValues.begin(), allValues.begin() + mid, values);
+    node->keyNum = mid;
+    copy(allKeys.begin() + mid, allKeys.end(), layout::keys(right.data()));
+    copy(allValues.begin() + mid, allValues.end(),
+         layout::values(right.data(), _MAX_SIZE));
+    rightNode->keyNum = allKeys.size() - mid;
+    //叶子总是从左往右加锁，和扫描的顺序一致
+    if (node->next != INVALID_PAGE) {
+      PageGuard next = fetch(node->next, true);
+      if (!checkNode(next)) {
+        return false;
+      }
+      layout::node(next.data())->prev = right.id();
+      next.markDirty();
+    }
+    rightNode->next = node->next;
+    rightNode->prev = leaf.id();
+    node->next = right.id();
+    split.happened = true;
+    split.key = allKeys[mid];
+    split.right = right.id();
+    return true;
+  }
+
+  /**
+   * @brief 孩子分裂出的关键字和右半边插进父亲，父亲满了也分裂
+   * @param index 分裂的孩子在父亲里的下标
+   */
+  bool insertIntoInner(PageGuard &inner, const size_type &index,
+                       const Split &child, Split &split) {
+    PageNode *node = layout::node(inner.data());
+    T *keys = layout::keys(inner.data());
+    uint64_t *children = layout::values(inner.data(), _MAX_SIZE);
+    size_type keyNum = node->keyNum;
+    inner.markDirty();
+    if (!isFull(inner.data())) {
+      copy_backward(keys + index, keys + keyNum, keys + keyNum + 1);
+      copy_backward(children + index + 1, children + keyNum + 1,
+                    children + keyNum + 2);
+      keys[index] = child.key;
+      children[index + 1] = child.right;
+      ++node->keyNum;
+      return true;
+    }
+    vector<T> allKeys(keys, keys + keyNum);
+    vector<uint64_t> allChildren(children, children + keyNum + 1);
+    allKeys.insert(allKeys.begin() + index, child.key);
+    allChildren.insert(allChildren.begin() + index + 1, child.right);
+    PageGuard right = newNode(false, node->level);
+    if (!right) {
+      return false;
+    }
+    //中间的关键字上移，不留在任何一边
+    size_type mid = allKeys.size() / 2;
+    copy(allKeys.begin(), allKeys.begin() + mid, keys);
+    copy(allChildren.begin(), allChildren.begin() + mid + 1, children);
+    node->keyNum = mid;
+    copy(allKeys.begin() + mid + 1, allKeys.end(), layout::keys(right.data()));
+    copy(allChildren.begin() + mid + 1, allChildren.end(),
+         layout::values(right.data(), _MAX_SIZE));
+    layout::node(right.data())->keyNum = allKeys.size() - mid - 1;
+    split.happened = true;
+    split.key = allKeys[mid];
+    split.right = right.id();
+    return true;
+  }
+
+  /* 根分裂了，新建一个根，调用时拿着根锁 */
+  bool growRoot(PageGuard &oldRoot, const Split &split) {
+    PageGuard root = newNode(false, layout::node(oldRoot.data())->level + 1);
+    if (!root) {
+      return false;
+    }
+    layout::node(root.data())->keyNum = 1;
+    layout::keys(root.data())[0] = split.key;
+    uint64_t *children = layout::values(root.data(), _MAX_SIZE);
+    children[0] = oldRoot.id();
+    children[1] = split.right;
+    _root = root.id();
+    _pool.setRoot(_root, _head);
+    return true;
+  }
+
+  /* 分配一页做新节点，加写锁返回 */
+  PageGuard newNode(const bool &isLeaf, const uint32_t &level) {
+    Frame *frame = _pool.newPage();
+    if (!frame) {
+      return PageGuard();
+    }
+    PageGuard guard(&_pool, frame, true);
+    PageNode *node = layout::node(guard.data());
+    node->isLeaf = isLeaf;
+    node->level = level;
+    guard.markDirty();
+    return guard;
+  }
+
+  /* 损坏的文件里孩子页号可能成环，下降超过这个深度就放弃 */
+  static constexpr size_type MAX_DEPTH = 64;
+  BufferPool _pool;
+  size_type _MAX_SIZE = 0;
+  /* 根锁保护_root，换根时加写锁 */
+  shared_mutex _rootLatch;
+  page_id _root = INVALID_PAGE;
+  page_id _head = INVALID_PAGE;
+};
+#endif
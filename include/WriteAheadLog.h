@@ -0,0 +1,267 @@
+#ifndef WRITE_AHEAD_LOG_H
+#define WRITE_AHEAD_LOG_H
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "PageFile.h"
+using namespace std;
+
+/**
+ * @brief 预写日志
+ * 文件开头是LogHeader，之后是一条条记录：
+ * [负载长度u32][校验和u32][操作u8][关键字][值u64，只有插入和修改有]
+ * LSN是记录在逻辑日志流里的字节位置，截断日志后从baseLsn接着算，不会回退。
+ * 并发提交时只有一个线程当组长，把攒下的记录一次写入并fdatasync，
+ * 其余线程等组长刷完，多个提交共用一次刷盘。
+ */
+
+/* "BPTWAL01" */
+constexpr uint64_t LOG_FILE_MAGIC = 0x31304c4157545042ULL;
+
+enum LogOp : uint8_t { LOG_INSERT = 1, LOG_DELETE = 2, LOG_UPDATE = 3 };
+
+struct LogHeader {
+  uint64_t magic;
+  /* 文件里第一条记录的LSN */
+  uint64_t baseLsn;
+};
+
+/* 记录头的字节数，负载长度、校验和、操作 */
+constexpr size_t LOG_RECORD_HEADER = 9;
+
+/**
+ * @brief 写一个只有文件头的空日志
+ * 先写临时文件刷盘再改名替换，崩溃时留下的不是旧日志就是新日志，不会是空文件
+ */
+inline bool writeEmptyLog(const string &path, const uint64_t &baseLsn) {
+  string temp = path + ".tmp";
+  LogHeader header{LOG_FILE_MAGIC, baseLsn};
+  PageFile file;
+  bool ok = file.open(temp, true) &&
+            file.writeAt(&header, sizeof(header), 0) && file.sync();
+  file.close();
+  return ok && ::rename(temp.c_str(), path.c_str()) == 0 &&
+         syncParentDirectory(path);
+}
+
+/* CRC32(IEEE)，检查日志尾部是否写了一半；crc传上一段的结果可以接着算 */
+inline uint32_t logChecksum(const char *data, size_t size,
+                            uint32_t crc = 0) {
+  static const array<uint32_t, 256> table = [] {
+    array<uint32_t, 256> t{};
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int j = 0; j < 8; ++j) {
+        c = c & 1 ? 0xEDB88320U ^ (c >> 1) : c >> 1;
+      }
+      t[i] = c;
+    }
+    return t;
+  }();
+  crc ^= 0xFFFFFFFFU;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+  }
+  return crc ^ 0xFFFFFFFFU;
+}
+
+/* 关键字编码进日志，定长关键字按字节拷贝，string按原样存，长度由负载长度推出 */
+template <typename T>
+void encodeLogKey(const T &k, string &out) {
+  if constexpr (is_same<T, string>::value) {
+    out.append(k);
+  } else {
+    static_assert(is_trivially_copyable<T>::value,
+                  "日志只支持定长关键字和string");
+    out.append(reinterpret_cast<const char *>(&k), sizeof(T));
+  }
+}
+
+template <typename T>
+bool decodeLogKey(const char *data, const size_t &size, T &k) {
+  if constexpr (is_same<T, string>::value) {
+    k.assign(data, size);
+    return true;
+  } else {
+    if (size != sizeof(T)) {
+      return false;
+    }
+    memcpy(&k, data, sizeof(T));
+    return true;
+  }
+}
+
+class WriteAheadLog {
+ public:
+  WriteAheadLog() = default;
+  WriteAheadLog(const WriteAheadLog &) = delete;
+  WriteAheadLog &operator=(const WriteAheadLog &) = delete;
+  ~WriteAheadLog() { close(); }
+
+  /**
+   * @brief 打开日志，按顺序对每条完整的记录调用func，截掉写了一半的尾巴
+   * 文件不存在时新建
+   * @param func void(const uint64_t &lsn, const uint8_t &op,
+   *                  const char *payload, const size_t &size)
+   * @return 打不开或不是日志文件返回false
+   */
+  template <typename Func>
+  bool open(const string &path, Func func) {
+    close();
+    LogHeader header{};
+    if (!_file.open(path, false, true)) {
+      if (!writeEmptyLog(path, 0) || !_file.open(path, false, true)) {
+        cerr << "日志" << path << "新建失败" << endl;
+        _file.close();
+        return false;
+      }
+    }
+    if (!_file.readAt(&header, sizeof(header), 0) ||
+               header.magic != LOG_FILE_MAGIC) {
+      cerr << path << "不是日志文件" << endl;
+      _file.close();
+      return false;
+    }
+    vector<char> content(_file.size() - sizeof(header));
+    if (!_file.readAt(content.data(), content.size(), sizeof(header))) {
+      _file.close();
+      return false;
+    }
+    size_t offset = 0;
+    while (offset + LOG_RECORD_HEADER <= content.size()) {
+      uint32_t size, checksum;
+      memcpy(&size, content.data() + offset, sizeof(size));
+      memcpy(&checksum, content.data() + offset + 4, sizeof(checksum));
+      const char *body = content.data() + offset + 8;
+      if (offset + LOG_RECORD_HEADER + size > content.size() ||
+          logChecksum(body, size + 1) != checksum) {
+        break;
+      }
+      func(header.baseLsn + offset, static_cast<uint8_t>(body[0]), body + 1,
+           static_cast<size_t>(size));
+      offset += LOG_RECORD_HEADER + size;
+    }
+    //崩溃时最后一批可能只写了一部分，截掉以免后面追加的记录接在坏记录后面
+    if (offset != content.size() &&
+        ::ftruncate(_file.fd(), sizeof(header) + offset) != 0) {
+      _file.close();
+      return false;
+    }
+    _path = path;
+    _endLsn = _durableLsn = header.baseLsn + offset;
+    _fileOffset = sizeof(header) + offset;
+    _failed = false;
+    return true;
+  }
+
+  void close() {
+    if (_file.isOpen()) {
+      commit(_endLsn);
+      _file.close();
+    }
+    _buffer.clear();
+  }
+
+  bool isOpen() const { return _file.isOpen(); }
+
+  /**
+   * @brief 追加一条记录到内存缓冲，不刷盘
+   * @return 记录末尾的LSN，传给commit等它落盘
+   */
+  uint64_t append(const uint8_t &op, const string &payload) {
+    char header[LOG_RECORD_HEADER];
+    uint32_t size = payload.size();
+    memcpy(header, &size, sizeof(size));
+    header[8] = static_cast<char>(op);
+    //校验和覆盖操作和负载
+    uint32_t checksum = logChecksum(payload.data(), payload.size(),
+                                    logChecksum(header + 8, 1));
+    memcpy(header + 4, &checksum, sizeof(checksum));
+    lock_guard<mutex> lock(_mutex);
+    _buffer.append(header, LOG_RECORD_HEADER);
+    _buffer.append(payload);
+    _endLsn += LOG_RECORD_HEADER + payload.size();
+    return _endLsn;
+  }
+
+  /**
+   * @brief 等lsn之前的记录都落盘，组提交
+   * 没有组长时自己当组长，写出缓冲里所有的记录；有组长时等它刷完再看
+   * @return 写盘失败返回false，之后的提交也都失败
+   */
+  bool commit(const uint64_t &lsn) {
+    unique_lock<mutex> lock(_mutex);
+    while (_durableLsn < lsn && !_failed) {
+      if (_flushing) {
+        _flushed.wait(lock);
+        continue;
+      }
+      _flushing = true;
+      string batch;
+      batch.swap(_buffer);
+      uint64_t end = _endLsn;
+      uint64_t offset = _fileOffset;
+      _fileOffset += batch.size();
+      lock.unlock();
+      bool ok = _file.writeAt(batch.data(), batch.size(), offset) &&
+                _file.sync();
+      lock.lock();
+      _flushing = false;
+      if (ok) {
+        _durableLsn = end;
+      } else {
+        cerr << "日志写盘失败" << endl;
+        _failed = true;
+      }
+      _flushed.notify_all();
+    }
+    return !_failed;
+  }
+
+  /**
+   * @brief 检查点已经包含了endLsn之前的修改，清空日志，LSN接着endLsn算
+   * 新的空日志改名替换旧日志后重新打开，调用期间不能有追加
+   */
+  bool reset() {
+    if (!commit(_endLsn)) {
+      return false;
+    }
+    lock_guard<mutex> lock(_mutex);
+    if (!writeEmptyLog(_path, _endLsn) || !_file.open(_path, false, true)) {
+      cerr << "日志" << _path << "清空失败" << endl;
+      _failed = true;
+      return false;
+    }
+    _fileOffset = sizeof(LogHeader);
+    return true;
+  }
+
+  /* 已追加的记录末尾的LSN */
+  uint64_t endLsn() {
+    lock_guard<mutex> lock(_mutex);
+    return _endLsn;
+  }
+
+ private:
+  PageFile _file;
+  string _path;
+  uint64_t _endLsn = 0;
+  uint64_t _durableLsn = 0;
+  uint64_t _fileOffset = 0;
+  /* 还没写盘的记录 */
+  string _buffer;
+  bool _flushing = false;
+  bool _failed = false;
+  mutex _mutex;
+  condition_variable _flushed;
+};
+#endif
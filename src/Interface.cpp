@@ -16,6 +16,11 @@ void interfaceInit() {
   op["reset"] = "重置树 eg:reset";
   op["serialize"] = "序列化树 eg:serialize";
   op["deserialize"] = "反序列化某个树 eg:serialize testTree";
+  op["save"] = "保存成分页文件 eg:save ./testTree.db";
+  op["load"] = "从分页文件恢复 eg:load ./testTree.db testTree";
+  op["save_compact"] = "保存成紧凑格式 eg:save_compact ./testTree.bpt";
+  op["load_compact"] =
+      "从紧凑格式恢复 eg:load_compact ./testTree.bpt testTree";
 }
 
 void help() {
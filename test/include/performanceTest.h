@@ -14,6 +14,7 @@
 #define CONCURRENT_DEGREE 10  //并发时的度数
 
 BPlusTree<int> *TestInsert(int degree);
+BPlusTree<int> *TestBulkLoad(int degree);
 void TestSearch(BPlusTree<int> *bplustree);
 void TestDelete(BPlusTree<int> *bplustree);
 void initVector();
@@ -18,6 +18,14 @@ BPlusTree<int> *TestInsert(int degree) {
   return bplustree;
 }
 
+BPlusTree<int> *TestBulkLoad(int degree) {
+  vector<pair<int, uint64_t>> data;
+  for (int i = 0; i < NUMBER_SAMPLES; ++i) {
+    data.push_back(make_pair(i, i));
+  }
+  return new BPlusTree<int>(degree, "testTree", data.begin(), data.end());
+}
+
 void TestSearch(BPlusTree<int> *bplustree) {
   for (int i = 0; i < NUMBER_SAMPLES; ++i) {
     bplustree->B_Plus_Tree_Search(srcData[i]);
@@ -32,6 +40,41 @@ void TestDelete(BPlusTree<int> *bplustree) {
   }
 }
 
+/* 插入再查找所有样本，返回两段的耗时，单位微秒 */
+template <size_t Degree>
+pair<long long, long long> TestInsertAndSearch(BPlusTree<int, Degree> &tree) {
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < NUMBER_SAMPLES; ++i) {
+    tree.B_Plus_Tree_Insert(make_pair(srcData[i], srcData[i]));
+  }
+  auto middle = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < NUMBER_SAMPLES; ++i) {
+    tree.B_Plus_Tree_Search(srcData[i]);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  return make_pair(
+      std::chrono::duration_cast<std::chrono::microseconds>(middle - start)
+          .count(),
+      std::chrono::duration_cast<std::chrono::microseconds>(end - middle)
+          .count());
+}
+
+/* 每个度数一行：运行时度数的插入、查找，编译期度数的插入、查找 */
+template <size_t... Degrees>
+void TestDegreeCompare(ofstream &fw) {
+  auto compare = [&fw](auto degree) {
+    BPlusTree<int> dynamicTree(degree.value, "testTree");
+    BPlusTree<int, decltype(degree)::value> staticTree(degree.value,
+                                                       "testTree");
+    pair<long long, long long> dynamicTime = TestInsertAndSearch(dynamicTree);
+    pair<long long, long long> staticTime = TestInsertAndSearch(staticTree);
+    fw << degree.value << " " << dynamicTime.first << " "
+       << dynamicTime.second << " " << staticTime.first << " "
+       << staticTime.second << endl;
+  };
+  (compare(integral_constant<size_t, Degrees>()), ...);
+}
+
 void performanceTest() {
   initVector();
   vector<BPlusTree<int> *> bplustrees;
@@ -52,6 +95,21 @@ void performanceTest() {
   }
   fw.close();
 
+  //---------------------------批量建树--------------------------
+  system("rm -rf ./performance_bulk_load");
+  fw.open("./performance_bulk_load", ios::out);
+  for (int i = MIN_DEGREE; i < MAX_DEGREE; i += 5) {
+    auto start = std::chrono::high_resolution_clock::now();
+    BPlusTree<int> *testTree = TestBulkLoad(i);
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start)
+            .count();
+    fw << duration << endl;
+    delete testTree;
+  }
+  fw.close();
+
   int num_tree = bplustrees.size();
   //---------------------------查找--------------------------
   system("rm -rf ./performance_search");
@@ -68,6 +126,53 @@ void performanceTest() {
   }
   fw.close();
 
+  //---------------------------压缩关键字查找--------------------------
+  //按度数把有序关键字切成叶子，比较在原数组和打包块上查找，每行两列，单位微秒
+  system("rm -rf ./performance_packed_search");
+  fw.open("./performance_packed_search", ios::out);
+  vector<int> sortedKeys(srcData);
+  sort(sortedKeys.begin(), sortedKeys.end());
+  for (int i = MIN_DEGREE; i < MAX_DEGREE; i += 5) {
+    vector<string> blocks;
+    for (int from = 0; from < NUMBER_SAMPLES; from += i) {
+      blocks.emplace_back();
+      packKeys(sortedKeys.data() + from, min(i, NUMBER_SAMPLES - from),
+               blocks.back());
+    }
+    size_t found = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int j = 0; j < NUMBER_SAMPLES; ++j) {
+      int from = srcData[j] / i * i;
+      found += keyLowerBound(sortedKeys.data() + from,
+                             min(i, NUMBER_SAMPLES - from), srcData[j]);
+    }
+    auto middle = std::chrono::high_resolution_clock::now();
+    for (int j = 0; j < NUMBER_SAMPLES; ++j) {
+      int from = srcData[j] / i * i;
+      found -= packedLowerBound(blocks[from / i].data(),
+                                min(i, NUMBER_SAMPLES - from), srcData[j]);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    fw << std::chrono::duration_cast<std::chrono::microseconds>(middle - start)
+              .count()
+       << " "
+       << std::chrono::duration_cast<std::chrono::microseconds>(end - middle)
+              .count()
+       << endl;
+#ifndef NDEBUG
+    if (found) {
+      cerr << "打包查找结果不一致" << endl;
+    }
+#endif
+  }
+  fw.close();
+
+  //---------------------------编译期度数--------------------------
+  system("rm -rf ./performance_degree_compare");
+  fw.open("./performance_degree_compare", ios::out);
+  TestDegreeCompare<8, 16, 32, 64, 128, 256>(fw);
+  fw.close();
+
   //---------------------------删除--------------------------
   system("rm -rf ./performance_delete");
   fw.open("./performance_delete", ios::out);
@@ -164,6 +269,27 @@ void performanceTest() {
   fw.close();
   delete testTree;
 
+  //---------------------------并行批量建树--------------------------
+  system("rm -rf ./performance_bulk_load_concurrent");
+  fw.open("./performance_bulk_load_concurrent", ios::out);
+  vector<pair<int, uint64_t>> sortedData;
+  for (int i = 0; i < NUMBER_SAMPLES; ++i) {
+    sortedData.push_back(make_pair(i, i));
+  }
+  for (int i = 1; i < NUMBER_THREADS; ++i) {
+    testTree = new BPlusTree<int>(CONCURRENT_DEGREE, "testTree");
+    auto start = std::chrono::high_resolution_clock::now();
+    testTree->B_Plus_Tree_Bulk_Load_Parallel(sortedData.begin(),
+                                             sortedData.end(), i);
+    auto end = std::chrono::high_resolution_clock::now();
+    auto duration =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start)
+            .count();
+    fw << duration << endl;
+    delete testTree;
+  }
+  fw.close();
+
   //---------------------------并发删除--------------------------
   system("rm -rf ./performance_delete_concurrent");
   fw.open("./performance_delete_concurrent", ios::out);
@@ -1,9 +1,18 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <set>
 #include <thread>
 #include <utility>
 
 #include "B_Plus_Tree.h"
+#include "MappedTree.h"
+#include "PagedTree.h"
 #include "bplustree.pb.h"
 #include "gmock/gmock.h"
 const bool NneedOutput = true;
@@ -57,15 +66,57 @@ TEST_F(NULLTREE, insert_test) {
 
 TEST_F(SEARCH_TREE, search_test) {
   for (int i = 0; i < 100; i++) {
-    EXPECT_EQ(*(_test_tree->B_Plus_Tree_Search(i).second), i)
+    EXPECT_EQ(_test_tree->B_Plus_Tree_Search(i).value_or(-1), i)
         << "test search succeed";
   }
-  EXPECT_THAT(_test_tree->B_Plus_Tree_Search(-1).second, testing::IsNull())
+  EXPECT_FALSE(_test_tree->B_Plus_Tree_Search(-1).has_value())
       << "test search failed";
-  EXPECT_THAT(_test_tree->B_Plus_Tree_Search(1000001).second, testing::IsNull())
+  EXPECT_FALSE(_test_tree->B_Plus_Tree_Search(1000001).has_value())
       << "test search failed";
 }
 
+TEST_F(SEARCH_TREE, update_test) {
+  for (int i = 0; i < 100; i += 2) {
+    EXPECT_TRUE(_test_tree->B_Plus_Tree_Update(i, i * 10));
+  }
+  for (int i = 0; i < 100; i++) {
+    EXPECT_EQ(_test_tree->B_Plus_Tree_Search(i).value_or(-1),
+              i % 2 ? i : i * 10)
+        << "test update";
+  }
+  EXPECT_FALSE(_test_tree->B_Plus_Tree_Update(-1, 0)) << "test update failed";
+}
+
+TEST_F(SEARCH_TREE, multi_search_test) {
+  vector<int> keys;
+  for (int i = 120; i >= -20; --i) {
+    keys.push_back(i);
+  }
+  //一边查一边插入，触发分裂时的右移和重启
+  thread writer([this]() {
+    for (int i = 100; i < 3000; ++i) {
+      _test_tree->B_Plus_Tree_Insert(make_pair(i, i));
+    }
+  });
+  for (int round = 0; round < 50; ++round) {
+    vector<optional<uint64_t>> result =
+        _test_tree->B_Plus_Tree_MultiSearch(keys);
+    ASSERT_EQ(result.size(), keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      if (keys[i] >= 0 && keys[i] < 100) {
+        ASSERT_EQ(result[i].value_or(-1), keys[i]);
+      } else if (keys[i] < 0) {
+        ASSERT_FALSE(result[i].has_value());
+      }
+    }
+  }
+  writer.join();
+  vector<optional<uint64_t>> result = _test_tree->B_Plus_Tree_MultiSearch(keys);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    EXPECT_EQ(result[i].has_value(), keys[i] >= 0);
+  }
+}
+
 TEST_F(SEARCH_TREE, range_search_test) {
   // _test_tree->BFS(NneedOutput);
   vector<pair<int, uint64_t>> ans;
@@ -105,6 +156,112 @@ TEST_F(SEARCH_TREE, range_search_test) {
             ans);
 }
 
+TEST_F(SEARCH_TREE, scan_test) {
+  uint64_t sum = 0;
+  _test_tree->B_Plus_Tree_Scan(10, 20, [&](const int& k, const uint64_t& v) {
+    sum += v;
+    return true;
+  });
+  EXPECT_EQ(sum, 145);
+
+  vector<int> limited;
+  _test_tree->B_Plus_Tree_Scan(30, 1000, [&](const int& k, const uint64_t& v) {
+    limited.push_back(k);
+    return limited.size() < 5;
+  });
+  EXPECT_EQ(limited, vector<int>({30, 31, 32, 33, 34})) << "stop early";
+
+  int calls = 0;
+  _test_tree->B_Plus_Tree_Scan(200, 300, [&](const int& k, const uint64_t& v) {
+    ++calls;
+    return true;
+  });
+  EXPECT_EQ(calls, 0);
+}
+
+TEST_F(SEARCH_TREE, reverse_scan_test) {
+  vector<int> keys;
+  _test_tree->B_Plus_Tree_Scan_Reverse(
+      10, 20, [&](const int& k, const uint64_t& v) {
+        keys.push_back(k);
+        return true;
+      });
+  vector<int> ans;
+  for (int i = 19; i >= 10; --i) {
+    ans.push_back(i);
+  }
+  EXPECT_EQ(keys, ans);
+
+  vector<pair<int, uint64_t>> last =
+      _test_tree->B_Plus_Tree_Search_Last_N(50, 3);
+  vector<pair<int, uint64_t>> lastAns = {{49, 49}, {48, 48}, {47, 47}};
+  EXPECT_EQ(last, lastAns) << "last n before x";
+  EXPECT_EQ(_test_tree->B_Plus_Tree_Search_Last_N(1000, 1).front().first, 99);
+  EXPECT_EQ(_test_tree->B_Plus_Tree_Search_Last_N(2, 10).size(), 2);
+  EXPECT_TRUE(_test_tree->B_Plus_Tree_Search_Last_N(0, 10).empty());
+
+  BPlusTreeCursor<int> cursor(*_test_tree);
+  cursor.seekToLast();
+  ASSERT_TRUE(cursor.valid());
+  EXPECT_EQ(cursor.key(), 99);
+  cursor.seekForPrev(60);
+  ASSERT_TRUE(cursor.valid());
+  EXPECT_EQ(cursor.key(), 59);
+}
+
+TEST_F(SEARCH_TREE, cursor_test) {
+  BPlusTreeCursor<int> cursor(*_test_tree);
+  cursor.seek(42);
+  for (int i = 42; i < 100; ++i) {
+    ASSERT_TRUE(cursor.valid());
+    EXPECT_EQ(cursor.key(), i);
+    EXPECT_EQ(cursor.value(), i);
+    cursor.next();
+  }
+  EXPECT_FALSE(cursor.valid()) << "walk off the right end";
+
+  cursor.seek(57);
+  for (int i = 57; i >= 0; --i) {
+    ASSERT_TRUE(cursor.valid());
+    EXPECT_EQ(cursor.key(), i);
+    cursor.prev();
+  }
+  EXPECT_FALSE(cursor.valid()) << "walk off the left end";
+
+  cursor.seek(200);
+  EXPECT_FALSE(cursor.valid()) << "seek past the last key";
+  cursor.seekToFirst();
+  ASSERT_TRUE(cursor.valid());
+  EXPECT_EQ(cursor.key(), 0);
+  cursor.next();
+  cursor.next();
+  cursor.prev();
+  EXPECT_EQ(cursor.key(), 1);
+
+  //一边插入一边前后扫，扫到的关键字始终有序
+  thread writer([this]() {
+    for (int i = 100; i < 5000; ++i) {
+      _test_tree->B_Plus_Tree_Insert(make_pair(i, i));
+    }
+  });
+  for (int round = 0; round < 20; ++round) {
+    BPlusTreeCursor<int> scan(*_test_tree);
+    int count = 0;
+    int last = -1;
+    for (scan.seekToFirst(); scan.valid(); scan.next(), ++count) {
+      ASSERT_LT(last, scan.key());
+      last = scan.key();
+    }
+    EXPECT_GE(count, 100);
+    for (scan.seek(last); scan.valid(); scan.prev()) {
+      ASSERT_GE(last, scan.key());
+      last = scan.key() - 1;
+    }
+    EXPECT_EQ(last, -1);
+  }
+  writer.join();
+}
+
 TEST_F(SEARCH_TREE, output_all_the_keys_test) {
   vector<int> ans;
   for (int i = 0; i < 100; i++) {
@@ -112,6 +269,12 @@ TEST_F(SEARCH_TREE, output_all_the_keys_test) {
   }
   ASSERT_EQ(_test_tree->OutPutAllTheKeys(NneedOutput), ans)
       << "output all the keys of leafnodes";
+  //预取距离只影响速度
+  for (int distance : {0, 1, 3, 64}) {
+    _test_tree->B_Plus_Tree_Set_Scan_Prefetch(distance);
+    EXPECT_EQ(_test_tree->OutPutAllTheKeys(NneedOutput), ans);
+    EXPECT_EQ(_test_tree->B_Plus_Tree_Search_Last_N(100, 100).size(), 100);
+  }
 }
 
 TEST_F(NULLTREE, delete_test) {
@@ -224,6 +387,484 @@ TEST_F(SEARCH_TREE, serialize_and_deserialize_test) {
   }
 }
 
+TEST(SERIALIZE, parallel_deserialize_test) {
+  BPlusTree<int> tree(8, "parallelTree");
+  for (int i = 0; i < 20000; ++i) {
+    tree.B_Plus_Tree_Insert(make_pair(i, i * 2));
+  }
+  tree.serializeAll();
+  ifstream fr("./parallelTree/parallelTree", ios::in | ios::binary);
+  bplustree::BPlusTree pb_bplustree;
+  ASSERT_TRUE(pb_bplustree.ParseFromIstream(&fr));
+  //没有全局状态，两棵树可以同时恢复
+  BPlusTree<int> first(8, "first"), second(8, "second");
+  bool loaded[2] = {false, false};
+  thread other([&]() {
+    loaded[1] = second.B_Plus_Tree_Deserialize(pb_bplustree, 3);
+  });
+  loaded[0] = first.B_Plus_Tree_Deserialize(pb_bplustree, 4);
+  other.join();
+  ASSERT_TRUE(loaded[0] && loaded[1]);
+  EXPECT_EQ(first.BFS(NneedOutput), tree.BFS(NneedOutput));
+  EXPECT_EQ(second.OutPutAllTheKeys(NneedOutput),
+            tree.OutPutAllTheKeys(NneedOutput));
+  EXPECT_EQ(first.B_Plus_Tree_Search_For_Range(100, 5000, NneedOutput),
+            tree.B_Plus_Tree_Search_For_Range(100, 5000, NneedOutput));
+  for (int i = 0; i < 20000; i += 3) {
+    first.B_Plus_Tree_Delete(i);
+  }
+  EXPECT_EQ(first.OutPutAllTheKeys(NneedOutput).size(), 13333);
+  //缺了一个节点文件时失败，树不变
+  ifstream root("./parallelTree/" + pb_bplustree._root());
+  bplustree::BNode pb_root;
+  ASSERT_TRUE(pb_root.ParseFromIstream(&root));
+  remove(("./parallelTree/" + pb_root._child(1)).c_str());
+  EXPECT_FALSE(second.B_Plus_Tree_Deserialize(pb_bplustree));
+  EXPECT_EQ(second.OutPutAllTheKeys(NneedOutput).size(), 20000);
+  system("rm -rf ./parallelTree");
+}
+
+TEST_F(SEARCH_TREE, page_file_test) {
+  string path = "./testTree.db";
+  ASSERT_TRUE(_test_tree->B_Plus_Tree_Save(path));
+  PageFileHeader header;
+  ASSERT_TRUE(readPageFileHeader(path, header));
+  EXPECT_EQ(header.maxSize, 5);
+  PageFile file;
+  ASSERT_TRUE(file.open(path, false));
+  EXPECT_EQ(file.size(), header.pageCount * header.pageSize);
+
+  BPlusTree<int> loaded(5, "loaded");
+  ASSERT_TRUE(loaded.B_Plus_Tree_Load(path));
+  EXPECT_EQ(_test_tree->BFS(NneedOutput), loaded.BFS(NneedOutput));
+  EXPECT_EQ(_test_tree->OutPutAllTheKeys(NneedOutput),
+            loaded.OutPutAllTheKeys(NneedOutput));
+  EXPECT_EQ(loaded.B_Plus_Tree_Search_Last_N(1000, 100).size(), 100)
+      << "prev chain restored";
+  //恢复的树可以接着改
+  for (int i = 100; i < 300; ++i) {
+    loaded.B_Plus_Tree_Insert(make_pair(i, i));
+  }
+  for (int i = 0; i < 300; i += 3) {
+    loaded.B_Plus_Tree_Delete(i);
+  }
+  for (int i = 0; i < 300; ++i) {
+    EXPECT_EQ(loaded.B_Plus_Tree_Search(i).has_value(), i % 3 != 0);
+  }
+
+  BPlusTree<int> otherDegree(7, "other");
+  EXPECT_FALSE(otherDegree.B_Plus_Tree_Load(path)) << "degree mismatch";
+  EXPECT_FALSE(otherDegree.B_Plus_Tree_Load("./no_such_file.db"));
+  EXPECT_EQ(otherDegree.OutPutAllTheKeys(NneedOutput), vector<int>());
+  remove(path.c_str());
+}
+
+TEST_F(SEARCH_TREE, compact_file_test) {
+  string path = "./testTree.bpt";
+  for (int i = 0; i < 100; i += 7) {
+    _test_tree->B_Plus_Tree_Delete(i);
+  }
+  ASSERT_TRUE(_test_tree->B_Plus_Tree_Save_Compact(path));
+  BPlusTree<int> loaded(5, "loaded");
+  ASSERT_TRUE(loaded.B_Plus_Tree_Load_Compact(path));
+  EXPECT_EQ(_test_tree->BFS(NneedOutput), loaded.BFS(NneedOutput));
+  EXPECT_EQ(_test_tree->OutPutAllTheKeys(NneedOutput),
+            loaded.OutPutAllTheKeys(NneedOutput));
+  EXPECT_EQ(loaded.B_Plus_Tree_Search_Last_N(1000, 100).size(), 85)
+      << "prev chain restored";
+  EXPECT_EQ(loaded.B_Plus_Tree_Search(50).value(), 50);
+  loaded.B_Plus_Tree_Insert(make_pair(1000, 1000));
+  EXPECT_TRUE(loaded.B_Plus_Tree_Search(1000).has_value());
+
+
+  //截断的文件不能恢复，树不变
+  ASSERT_TRUE(_test_tree->B_Plus_Tree_Save_Compact(path));
+  PageFile file;
+  ASSERT_TRUE(file.open(path, false, true));
+  ASSERT_EQ(truncate(path.c_str(), file.size() - 1), 0);
+  EXPECT_FALSE(loaded.B_Plus_Tree_Load_Compact(path));
+  EXPECT_TRUE(loaded.B_Plus_Tree_Search(1000).has_value());
+  BPlusTree<int> otherDegree(7, "other");
+  ASSERT_TRUE(_test_tree->B_Plus_Tree_Save_Compact(path));
+  EXPECT_FALSE(otherDegree.B_Plus_Tree_Load_Compact(path)) << "degree mismatch";
+  remove(path.c_str());
+}
+
+TEST_F(SEARCH_TREE, write_ahead_log_test) {
+  string checkpoint = "./walTree.db", log = "./walTree.log";
+  remove(checkpoint.c_str());
+  remove(log.c_str());
+  //没有检查点时先把当前的树存成检查点
+  ASSERT_TRUE(_test_tree->B_Plus_Tree_Open_Log(checkpoint, log));
+  vector<thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.push_back(thread([&, t]() {
+      for (int i = 100 + t; i < 300; i += 4) {
+        _test_tree->B_Plus_Tree_Insert(make_pair(i, i));
+      }
+    }));
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  ASSERT_TRUE(_test_tree->B_Plus_Tree_Checkpoint());
+  for (int i = 0; i < 300; i += 3) {
+    _test_tree->B_Plus_Tree_Delete(i);
+  }
+  EXPECT_TRUE(_test_tree->B_Plus_Tree_Update(299, 1000));
+  //每次修改返回前日志已落盘，此时直接从文件恢复相当于进程崩溃后重启
+  PageFile file;
+  ASSERT_TRUE(file.open(log, false, true));
+  //删不存在的关键字什么也没改，不记日志
+  uint64_t logSize = file.size();
+  _test_tree->B_Plus_Tree_Delete(3);
+  _test_tree->B_Plus_Tree_Delete(-1);
+  EXPECT_EQ(file.size(), logSize) << "no log record for a missing key";
+  char torn[5] = {20, 0, 0, 0, 1};
+  ASSERT_TRUE(file.writeAt(torn, sizeof(torn), file.size()));
+  file.close();
+  {
+    BPlusTree<int> recovered(5, "recovered");
+    ASSERT_TRUE(recovered.B_Plus_Tree_Open_Log(checkpoint, log));
+    EXPECT_EQ(recovered.OutPutAllTheKeys(NneedOutput),
+              _test_tree->OutPutAllTheKeys(NneedOutput));
+    EXPECT_EQ(recovered.B_Plus_Tree_Search(299).value_or(0), 1000);
+    recovered.B_Plus_Tree_Insert(make_pair(1000, 1000));
+  }
+  BPlusTree<int> reopened(5, "reopened");
+  ASSERT_TRUE(reopened.B_Plus_Tree_Open_Log(checkpoint, log));
+  EXPECT_EQ(reopened.B_Plus_Tree_Search(1000).value_or(0), 1000)
+      << "appended after the torn tail was cut";
+  EXPECT_FALSE(reopened.B_Plus_Tree_Search(3).has_value());
+  remove(checkpoint.c_str());
+  remove(log.c_str());
+}
+
+TEST_F(SEARCH_TREE, concurrent_update_log_test) {
+  string checkpoint = "./updateTree.db", log = "./updateTree.log";
+  remove(checkpoint.c_str());
+  remove(log.c_str());
+  ASSERT_TRUE(_test_tree->B_Plus_Tree_Open_Log(checkpoint, log));
+  //多个线程反复改同一批关键字，重做日志后每个关键字的值要和内存里一样
+  vector<thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.push_back(thread([&, t]() {
+      for (int round = 0; round < 200; ++round) {
+        for (int i = 0; i < 10; ++i) {
+          _test_tree->B_Plus_Tree_Update(i, round * 4 + t);
+        }
+      }
+    }));
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  BPlusTree<int> recovered(5, "recovered");
+  ASSERT_TRUE(recovered.B_Plus_Tree_Open_Log(checkpoint, log));
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_EQ(recovered.B_Plus_Tree_Search(i),
+              _test_tree->B_Plus_Tree_Search(i))
+        << "replayed updates in a different order";
+  }
+  remove(checkpoint.c_str());
+  remove(log.c_str());
+}
+
+TEST(CHECKPOINT, incremental_checkpoint_test) {
+  string checkpoint = "./ckptTree.db", log = "./ckptTree.log";
+  remove(checkpoint.c_str());
+  remove(log.c_str());
+  BPlusTree<int> tree(5, "ckptTree");
+  for (int i = 0; i < 3000; ++i) {
+    tree.B_Plus_Tree_Insert(make_pair(i, i));
+  }
+  ASSERT_TRUE(tree.B_Plus_Tree_Open_Log(checkpoint, log));
+  auto readAll = [&]() {
+    PageFile file;
+    file.open(checkpoint, false);
+    string content(file.size(), '\0');
+    file.readAt(&content[0], content.size(), 0);
+    return content;
+  };
+  string before = readAll();
+  //少量修改，包括会合并节点的删除
+  for (int i = 100; i < 120; ++i) {
+    tree.B_Plus_Tree_Delete(i);
+  }
+  tree.B_Plus_Tree_Insert(make_pair(5000, 5000));
+  EXPECT_TRUE(tree.B_Plus_Tree_Update(2000, 7));
+  ASSERT_TRUE(tree.B_Plus_Tree_Checkpoint());
+  string after = readAll();
+  PageFileHeader header;
+  ASSERT_TRUE(readPageFileHeader(checkpoint, header));
+  size_t changed = 0;
+  for (uint64_t id = 1; id < header.pageCount; ++id) {
+    if (before.compare(id * header.pageSize, header.pageSize, after,
+                       id * header.pageSize, header.pageSize)) {
+      ++changed;
+    }
+  }
+  EXPECT_LT(changed * 10, header.pageCount) << "only dirty pages rewritten";
+
+  BPlusTree<int> loaded(5, "loaded");
+  ASSERT_TRUE(loaded.B_Plus_Tree_Load(checkpoint));
+  EXPECT_EQ(loaded.OutPutAllTheKeys(NneedOutput),
+            tree.OutPutAllTheKeys(NneedOutput));
+  EXPECT_EQ(loaded.B_Plus_Tree_Search(2000).value_or(0), 7);
+
+  //页日志已生效但还没写回时崩溃：打开时先重做页日志
+  vector<page_id> ids;
+  vector<char> images;
+  for (uint64_t id = 1; id < header.pageCount; ++id) {
+    if (id * header.pageSize >= before.size() ||
+        before.compare(id * header.pageSize, header.pageSize, after,
+                       id * header.pageSize, header.pageSize)) {
+      ids.push_back(id);
+      images.insert(images.end(), after.begin() + id * header.pageSize,
+                    after.begin() + (id + 1) * header.pageSize);
+    }
+  }
+  auto crash = [&]() {
+    PageFile file;
+    return file.open(checkpoint, true) &&
+           file.writeAt(before.data(), before.size(), 0) &&
+           writePageJournal(checkpoint, header, ids, images);
+  };
+  ASSERT_TRUE(crash());
+  BPlusTree<int> recovered(5, "recovered");
+  ASSERT_TRUE(recovered.B_Plus_Tree_Load(checkpoint));
+  EXPECT_EQ(recovered.OutPutAllTheKeys(NneedOutput),
+            tree.OutPutAllTheKeys(NneedOutput));
+  EXPECT_EQ(readAll(), after);
+  //映射和缓冲池打开时同样先重做页日志
+  ASSERT_TRUE(crash());
+  MappedBPlusTree<int> mapped;
+  ASSERT_TRUE(mapped.open(checkpoint));
+  EXPECT_EQ(mapped.B_Plus_Tree_Search(2000).value_or(0), 7);
+  EXPECT_FALSE(mapped.B_Plus_Tree_Search(110).has_value());
+  mapped.close();
+  EXPECT_EQ(readAll(), after);
+  ASSERT_TRUE(crash());
+  PagedBPlusTree<int> paged(16);
+  ASSERT_TRUE(paged.open(checkpoint));
+  EXPECT_EQ(paged.B_Plus_Tree_Search(2000).value_or(0), 7);
+  EXPECT_TRUE(paged.B_Plus_Tree_Search(5000).has_value());
+  paged.close();
+  EXPECT_EQ(readAll(), after);
+  remove(checkpoint.c_str());
+  remove(log.c_str());
+}
+
+TEST(SNAPSHOT, background_snapshot_test) {
+  string checkpoint = "./snapTree.db", log = "./snapTree.log",
+         snapshot = "./snapTree.snap";
+  remove(checkpoint.c_str());
+  remove(log.c_str());
+  remove(snapshot.c_str());
+  const int threadNum = 4, steps = 3000, base = 100000;
+  vector<int> finalKeys;
+  {
+    BPlusTree<int> tree(8, "snapTree");
+    for (int i = 0; i < 20000; ++i) {
+      tree.B_Plus_Tree_Insert(make_pair(i, i));
+    }
+    ASSERT_TRUE(tree.B_Plus_Tree_Open_Log(checkpoint, log));
+    //每个线程依次插入一个新关键字、删除一个旧关键字，快照里每个线程都停在某一步上
+    atomic<int> started(0);
+    vector<thread> threads;
+    for (int t = 0; t < threadNum; ++t) {
+      threads.push_back(thread([&, t]() {
+        for (int i = 0; i < steps; ++i) {
+          tree.B_Plus_Tree_Insert(make_pair(base + t * steps + i, i));
+          tree.B_Plus_Tree_Delete(t + i * threadNum);
+          if (i == steps / 10) {
+            ++started;
+          }
+        }
+      }));
+    }
+    while (started < threadNum) {
+      this_thread::yield();
+    }
+    future<bool> done = tree.B_Plus_Tree_Snapshot_Async(snapshot);
+    EXPECT_TRUE(done.get());
+    for (auto& t : threads) {
+      t.join();
+    }
+    finalKeys = tree.OutPutAllTheKeys(NneedOutput);
+  }
+  BPlusTree<int> frozen(8, "frozen");
+  ASSERT_TRUE(frozen.B_Plus_Tree_Load(snapshot));
+  for (int t = 0; t < threadNum; ++t) {
+    int inserted = 0, deleted = 0;
+    while (inserted < steps &&
+           frozen.B_Plus_Tree_Search(base + t * steps + inserted)) {
+      ++inserted;
+    }
+    while (deleted < steps &&
+           !frozen.B_Plus_Tree_Search(t + deleted * threadNum)) {
+      ++deleted;
+    }
+    for (int i = inserted; i < steps; ++i) {
+      ASSERT_FALSE(frozen.B_Plus_Tree_Search(base + t * steps + i));
+    }
+    for (int i = deleted; i < steps; ++i) {
+      ASSERT_TRUE(frozen.B_Plus_Tree_Search(t + i * threadNum));
+    }
+    EXPECT_TRUE(inserted == deleted || inserted == deleted + 1)
+        << "snapshot is a point in time of every writer";
+  }
+  //快照记下了开始时的日志位置，接着回放日志得到最终的树
+  BPlusTree<int> recovered(8, "recovered");
+  ASSERT_TRUE(recovered.B_Plus_Tree_Open_Log(snapshot, log));
+  EXPECT_EQ(recovered.OutPutAllTheKeys(NneedOutput), finalKeys);
+  remove(checkpoint.c_str());
+  remove(log.c_str());
+  remove(snapshot.c_str());
+}
+
+TEST_F(SEARCH_TREE, mapped_tree_test) {
+  string path = "./testTree.db";
+  ASSERT_TRUE(_test_tree->B_Plus_Tree_Save(path));
+  MappedBPlusTree<int> mapped;
+  ASSERT_TRUE(mapped.open(path));
+  EXPECT_EQ(mapped.getMAX_SIZE(), 5);
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(mapped.B_Plus_Tree_Search(i).value_or(-1), i);
+  }
+  EXPECT_FALSE(mapped.B_Plus_Tree_Search(-1).has_value());
+  EXPECT_FALSE(mapped.B_Plus_Tree_Search(100).has_value());
+  EXPECT_EQ(mapped.B_Plus_Tree_Search_For_Range(31, 90),
+            _test_tree->B_Plus_Tree_Search_For_Range(31, 90, NneedOutput));
+  EXPECT_EQ(mapped.B_Plus_Tree_Search_For_Range(-10, 200).size(), 100);
+  int count = 0;
+  mapped.B_Plus_Tree_Scan(10, 100, [&](const int& k, const uint64_t& v) {
+    return ++count < 3;
+  });
+  EXPECT_EQ(count, 3) << "stop early";
+  mapped.close();
+  //损坏的文件里叶子链表成环，扫描也要结束
+  PageFile file;
+  ASSERT_TRUE(file.open(path, false, true));
+  PageFileHeader header;
+  ASSERT_TRUE(file.readAt(&header, sizeof(header), 0));
+  PageNode node;
+  page_id last = header.head;
+  ASSERT_TRUE(file.readAt(&node, sizeof(node), last * header.pageSize));
+  while (node.next != INVALID_PAGE) {
+    last = node.next;
+    ASSERT_TRUE(file.readAt(&node, sizeof(node), last * header.pageSize));
+  }
+  node.next = header.head;
+  ASSERT_TRUE(file.writeAt(&node, sizeof(node), last * header.pageSize));
+  file.close();
+  ASSERT_TRUE(mapped.open(path));
+  EXPECT_GE(mapped.B_Plus_Tree_Search_For_Range(-10, 200).size(), 100);
+  mapped.close();
+  EXPECT_FALSE(mapped.open("./no_such_file.db"));
+  remove(path.c_str());
+}
+
+TEST(MAPPED_TREE, packed_leaf_test) {
+  string path = "./packedTree.db";
+  BPlusTree<int> tree(64, "packedTree");
+  for (int i = 0; i < 5000; ++i) {
+    tree.B_Plus_Tree_Insert(make_pair(i * 3 - 5000, i));
+  }
+  ASSERT_TRUE(tree.B_Plus_Tree_Save_Packed(path));
+  PageFileHeader header;
+  ASSERT_TRUE(readPageFileHeader(path, header));
+  EXPECT_TRUE(header.flags & PAGE_FILE_PACKED_KEYS);
+  PageFile file;
+  ASSERT_TRUE(file.open(path, false));
+  PageNode node;
+  ASSERT_TRUE(file.readAt(&node, sizeof(node), header.head * header.pageSize));
+  file.close();
+  EXPECT_EQ(node.keyEncoding, PAGE_KEYS_PACKED);
+
+  MappedBPlusTree<int> mapped;
+  ASSERT_TRUE(mapped.open(path));
+  for (int i = 0; i < 5000; ++i) {
+    ASSERT_EQ(mapped.B_Plus_Tree_Search(i * 3 - 5000).value_or(-1), i);
+    ASSERT_FALSE(mapped.B_Plus_Tree_Search(i * 3 - 4999).has_value());
+  }
+  EXPECT_EQ(mapped.B_Plus_Tree_Search_For_Range(-100, 7000),
+            tree.B_Plus_Tree_Search_For_Range(-100, 7000, NneedOutput));
+  EXPECT_EQ(mapped.B_Plus_Tree_Search_For_Range(-10000, 20000).size(), 5000);
+  mapped.close();
+
+  //能恢复成内存树，但缓冲池模式要改页，打不开
+  BPlusTree<int> loaded(64, "loaded");
+  ASSERT_TRUE(loaded.B_Plus_Tree_Load(path));
+  EXPECT_EQ(loaded.OutPutAllTheKeys(NneedOutput),
+            tree.OutPutAllTheKeys(NneedOutput));
+  PagedBPlusTree<int> paged(16);
+  EXPECT_FALSE(paged.open(path));
+  remove(path.c_str());
+}
+
+TEST(PAGED_TREE, paged_tree_test) {
+  string path = "./pagedTree.db";
+  const int n = 20000;
+  vector<int> keys(n);
+  iota(keys.begin(), keys.end(), 0);
+  shuffle(keys.begin(), keys.end(), mt19937(7));
+  {
+    //度数8、2万个关键字的树最多8层，4个线程每个最多固定8+2页，
+    //48帧够用，又远小于树的页数，插入时会不断换出脏页
+    PagedBPlusTree<int> paged(48);
+    ASSERT_TRUE(paged.create(path, 8));
+    vector<thread> threads;
+    atomic<int> failed(0);
+    for (int t = 0; t < 4; ++t) {
+      threads.push_back(thread([&, t]() {
+        for (int i = t; i < n; i += 4) {
+          if (!paged.B_Plus_Tree_Insert(make_pair(keys[i], keys[i] * 2))) {
+            ++failed;
+          }
+        }
+      }));
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    EXPECT_EQ(failed, 0);
+    EXPECT_GT(paged.getPool().misses(), paged.getPool().frameNum());
+    //只插入过的文件节点填充和内存树一样，可以直接恢复成内存树
+    ASSERT_TRUE(paged.flush());
+    BPlusTree<int> loaded(8, "loaded");
+    ASSERT_TRUE(loaded.B_Plus_Tree_Load(path));
+    EXPECT_EQ(loaded.OutPutAllTheKeys(NneedOutput).size(), n);
+    EXPECT_EQ(loaded.B_Plus_Tree_Search(keys[0]).value_or(0), keys[0] * 2);
+    for (int i = 0; i < n; i += 3) {
+      EXPECT_TRUE(paged.B_Plus_Tree_Delete(i));
+    }
+    EXPECT_FALSE(paged.B_Plus_Tree_Delete(n));
+    ASSERT_TRUE(paged.flush());
+  }
+  PagedBPlusTree<int> paged(16);
+  ASSERT_TRUE(paged.open(path));
+  EXPECT_EQ(paged.getMAX_SIZE(), 8);
+  vector<pair<int, uint64_t>> expect;
+  for (int i = 0; i < n; ++i) {
+    EXPECT_EQ(paged.B_Plus_Tree_Search(i).has_value(), i % 3 != 0);
+    if (i % 3 && i >= 100 && i < 5000) {
+      expect.push_back(make_pair(i, i * 2));
+    }
+  }
+  EXPECT_EQ(paged.B_Plus_Tree_Search_For_Range(100, 5000), expect);
+  paged.close();
+  //页格式和B_Plus_Tree_Save一样，可以直接映射
+  MappedBPlusTree<int> mapped;
+  ASSERT_TRUE(mapped.open(path));
+  EXPECT_EQ(mapped.B_Plus_Tree_Search_For_Range(100, 5000), expect);
+  mapped.close();
+  //删除不合并，不到半满的节点不能恢复成内存树
+  BPlusTree<int> underfull(8, "underfull");
+  EXPECT_FALSE(underfull.B_Plus_Tree_Load(path));
+  remove(path.c_str());
+}
+
 void search(BPlusTree<int>*& tree) {
   for (int i = 0; i < 100; ++i) {
     tree->B_Plus_Tree_Search(i);
@@ -283,9 +924,440 @@ TEST_F(SEARCH_TREE, Concurrent) {
   //---------------------------------范围查找的并发放弃了！！！-------------------
 }
 
+TEST_F(NULLTREE, optimistic_concurrent_insert) {
+  BPlusTree<int> tree(4, "testTree");
+  vector<int> keys;
+  for (int i = 0; i < 20000; ++i) {
+    keys.push_back(i);
+  }
+  shuffle(keys.begin(), keys.end(), mt19937(2024));
+  vector<thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.push_back(thread([&, t]() {
+      for (size_t i = t; i < keys.size(); i += 8) {
+        tree.B_Plus_Tree_Insert(make_pair(keys[i], keys[i]));
+      }
+    }));
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  sort(keys.begin(), keys.end());
+  EXPECT_EQ(tree.OutPutAllTheKeys(NneedOutput), keys)
+      << "concurrent optimistic insert";
+  for (int i = 0; i < 20000; ++i) {
+    ASSERT_TRUE(tree.B_Plus_Tree_Search(i).has_value());
+  }
+}
+
+TEST_F(NULLTREE, insert_batch_test) {
+  BPlusTree<int> tree(4, "testTree");
+  vector<pair<int, uint64_t>> data;
+  for (int i = 0; i < 20000; ++i) {
+    data.push_back(make_pair(i, i * 2));
+  }
+  shuffle(data.begin(), data.end(), mt19937(2025));
+  //一半按批插入，一半单个插入，交错进行
+  vector<thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.push_back(thread([&, t]() {
+      for (size_t i = t * 500; i < data.size(); i += 4000) {
+        auto first = data.begin() + i;
+        if (t % 2) {
+          tree.B_Plus_Tree_Insert_Batch(first, first + 500);
+        } else {
+          for (auto it = first; it != first + 500; ++it) {
+            tree.B_Plus_Tree_Insert(*it);
+          }
+        }
+      }
+    }));
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  vector<int> keys(20000);
+  iota(keys.begin(), keys.end(), 0);
+  EXPECT_EQ(tree.OutPutAllTheKeys(NneedOutput), keys) << "batch insert";
+  for (int i = 0; i < 20000; ++i) {
+    ASSERT_EQ(tree.B_Plus_Tree_Search(i).value_or(-1), i * 2);
+  }
+}
+
+TEST_F(SEARCH_TREE, optimistic_search_during_insert) {
+  atomic<bool> done(false);
+  atomic<int> missed(0);
+  vector<thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.push_back(thread([&]() {
+      while (!done) {
+        for (int i = 0; i < 100; ++i) {
+          optional<uint64_t> value = _test_tree->B_Plus_Tree_Search(i);
+          if (value != static_cast<uint64_t>(i)) {
+            ++missed;
+          }
+        }
+      }
+    }));
+  }
+  for (int i = 100; i < 5000; ++i) {
+    _test_tree->B_Plus_Tree_Insert(make_pair(i, i));
+  }
+  done = true;
+  for (auto& t : readers) {
+    t.join();
+  }
+  EXPECT_EQ(missed, 0) << "search missed an existing key during inserts";
+}
+
+TEST_F(NULLTREE, concurrent_delete_test) {
+  BPlusTree<int> tree(4, "testTree");
+  const int n = 6000;
+  for (int i = 0; i < 3 * n; i += 3) {
+    tree.B_Plus_Tree_Insert(make_pair(i, i));
+    tree.B_Plus_Tree_Insert(make_pair(i + 1, i + 1));
+  }
+  //删3i+1，插3i+2，3i一直都在，查找不能漏掉
+  atomic<bool> done(false);
+  atomic<int> missed(0);
+  thread reader([&]() {
+    while (!done) {
+      for (int i = 0; i < 3 * n; i += 3) {
+        if (tree.B_Plus_Tree_Search(i) != static_cast<uint64_t>(i)) {
+          ++missed;
+        }
+      }
+    }
+  });
+  vector<thread> threads;
+  for (int t = 0; t < 3; ++t) {
+    threads.push_back(thread([&, t]() {
+      for (int i = t; i < n; i += 3) {
+        tree.B_Plus_Tree_Delete(3 * i + 1);
+      }
+    }));
+    threads.push_back(thread([&, t]() {
+      for (int i = t; i < n; i += 3) {
+        tree.B_Plus_Tree_Insert(make_pair(3 * i + 2, 3 * i + 2));
+      }
+    }));
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  done = true;
+  reader.join();
+  EXPECT_EQ(missed, 0) << "search missed a stable key during deletes";
+  vector<int> keys;
+  for (int i = 0; i < 3 * n; i += 3) {
+    keys.push_back(i);
+    keys.push_back(i + 2);
+  }
+  EXPECT_EQ(tree.OutPutAllTheKeys(NneedOutput), keys)
+      << "concurrent insert and delete";
+}
+
+TEST(KEY_SEARCH, lower_bound_test) {
+  mt19937_64 gen(1);
+  for (int n = 0; n < 100; ++n) {
+    vector<int> keys32(n);
+    vector<int64_t> keys64(n);
+    vector<uint64_t> keysu64(n);
+    for (int i = 0; i < n; ++i) {
+      keys32[i] = static_cast<int>(gen());
+      keys64[i] = static_cast<int64_t>(gen());
+      keysu64[i] = gen();
+    }
+    sort(keys32.begin(), keys32.end());
+    sort(keys64.begin(), keys64.end());
+    sort(keysu64.begin(), keysu64.end());
+    for (int q = 0; q < 20; ++q) {
+      int k32 = n && q % 2 ? keys32[gen() % n] : static_cast<int>(gen());
+      int64_t k64 =
+          n && q % 2 ? keys64[gen() % n] : static_cast<int64_t>(gen());
+      uint64_t ku64 = n && q % 2 ? keysu64[gen() % n] : gen();
+      ASSERT_EQ(
+          keyLowerBound(keys32.data(), n, k32),
+          lower_bound(keys32.begin(), keys32.end(), k32) - keys32.begin());
+      ASSERT_EQ(
+          keyLowerBound(keys64.data(), n, k64),
+          lower_bound(keys64.begin(), keys64.end(), k64) - keys64.begin());
+      ASSERT_EQ(
+          keyLowerBound(keysu64.data(), n, ku64),
+          lower_bound(keysu64.begin(), keysu64.end(), ku64) - keysu64.begin());
+    }
+  }
+}
+
+//有序整数打包后逐个取、分段解码、查找都和原数组一致，位宽从0到PACKED_MAX_WIDTH
+template <typename T>
+void checkPackedKeys(mt19937_64 &gen, const int &n, const uint32_t &width) {
+  vector<T> keys(n);
+  uint64_t mask = width ? (~0ULL >> (64 - width)) : 0;
+  //基准加上最大的差也不能溢出
+  uint64_t room = static_cast<uint64_t>(numeric_limits<T>::max()) -
+                  static_cast<uint64_t>(numeric_limits<T>::min()) - mask;
+  T base = static_cast<T>(static_cast<uint64_t>(numeric_limits<T>::min()) +
+                          (room == ~0ULL ? gen() : gen() % (room + 1)));
+  for (int i = 0; i < n; ++i) {
+    keys[i] = static_cast<T>(static_cast<uint64_t>(base) + (gen() & mask));
+  }
+  sort(keys.begin(), keys.end());
+  string block;
+  ASSERT_TRUE(packKeys(keys.data(), n, block));
+  ASSERT_TRUE(checkPackedBlock<T>(block.data(), block.size(), n));
+  vector<T> decoded(n);
+  unpackKeys(block.data(), 0, n, decoded.data());
+  ASSERT_EQ(decoded, keys);
+  for (int from = 0; from < n; from += 3) {
+    vector<T> part(n - from);
+    unpackKeys(block.data(), from, n - from, part.data());
+    ASSERT_TRUE(equal(part.begin(), part.end(), keys.begin() + from));
+  }
+  for (int q = 0; q < 20; ++q) {
+    T k = n && q % 2 ? keys[gen() % n]
+                     : static_cast<T>(static_cast<uint64_t>(base) +
+                                      (gen() & (mask * 2 + 1)));
+    ASSERT_EQ(packedLowerBound(block.data(), n, k),
+              lower_bound(keys.begin(), keys.end(), k) - keys.begin());
+  }
+}
+
+TEST(KEY_CODEC, packed_keys_test) {
+  mt19937_64 gen(1);
+  for (int n = 0; n < 70; n += 3) {
+    for (uint32_t width = 0; width <= PACKED_MAX_WIDTH; width += 5) {
+      checkPackedKeys<int>(gen, n, min<uint32_t>(width, 31));
+      checkPackedKeys<int64_t>(gen, n, width);
+      checkPackedKeys<uint64_t>(gen, n, width);
+    }
+  }
+  //稠密的关键字一个只占几位
+  vector<int> dense(64);
+  iota(dense.begin(), dense.end(), 1000);
+  string block;
+  ASSERT_TRUE(packKeys(dense.data(), dense.size(), block));
+  EXPECT_LT(block.size(), dense.size() * sizeof(int) / 4);
+  vector<int64_t> wide{INT64_MIN, 0, INT64_MAX};
+  EXPECT_FALSE(packKeys(wide.data(), wide.size(), block)) << "too wide";
+}
+
+TEST(STRING_KEY, string_key_test) {
+  BPlusTree<string> tree(5, "stringTree");
+  set<string> expected;
+  mt19937 gen(1);
+  //公共前缀很长，键头相等的关键字也不少
+  const string prefixes[] = {"https://example.com/users/", "https://x.org/",
+                             "ab", string("ab\0", 3), ""};
+  for (int i = 0; i < 3000; ++i) {
+    string k = prefixes[gen() % 5];
+    for (int len = gen() % 12; len--;) {
+      k += static_cast<char>('a' + gen() % 3);
+    }
+    if (gen() % 3 == 0) {
+      tree.B_Plus_Tree_Delete(k);
+      expected.erase(k);
+    } else if (expected.insert(k).second) {
+      tree.B_Plus_Tree_Insert(make_pair(k, k.size()));
+    }
+  }
+  vector<string> keys(expected.begin(), expected.end());
+  EXPECT_EQ(tree.OutPutAllTheKeys(NneedOutput), keys);
+  for (const string &k : keys) {
+    ASSERT_EQ(tree.B_Plus_Tree_Search(k).value(), k.size()) << k;
+  }
+  EXPECT_FALSE(tree.B_Plus_Tree_Search("https://example.com/").has_value());
+  EXPECT_FALSE(tree.B_Plus_Tree_Search(string("ab\0\0", 4)).has_value());
+
+  //紧凑格式去掉公共前缀存
+  string path = "./stringTree.bpt";
+  ASSERT_TRUE(tree.B_Plus_Tree_Save_Compact(path));
+  BPlusTree<string> loaded(5, "loaded");
+  ASSERT_TRUE(loaded.B_Plus_Tree_Load_Compact(path));
+  EXPECT_EQ(loaded.OutPutAllTheKeys(NneedOutput), keys);
+  EXPECT_EQ(loaded.B_Plus_Tree_Search(keys.back()).value(), keys.back().size());
+  BPlusTree<int> intTree(5, "intTree");
+  EXPECT_FALSE(intTree.B_Plus_Tree_Load_Compact(path)) << "key type mismatch";
+  remove(path.c_str());
+}
+
+TEST(STRING_KEY, concurrent_string_key_test) {
+  BPlusTree<string> tree(4, "stringTree");
+  auto keyOf = [](int i) { return "https://example.com/" + to_string(i); };
+  const int n = 3000;
+  for (int i = 0; i < n; i += 2) {
+    tree.B_Plus_Tree_Insert(make_pair(keyOf(i), i));
+  }
+  //删偶数插奇数，同时有人查，关键字边改边读
+  atomic<bool> done(false);
+  thread reader([&]() {
+    while (!done) {
+      for (int i = 0; i < n; i += 7) {
+        tree.B_Plus_Tree_Search(keyOf(i));
+      }
+    }
+  });
+  vector<thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.push_back(thread([&, t]() {
+      for (int i = t * 2; i < n; i += 8) {
+        tree.B_Plus_Tree_Delete(keyOf(i));
+        tree.B_Plus_Tree_Insert(make_pair(keyOf(i + 1), i + 1));
+      }
+    }));
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  done = true;
+  reader.join();
+  set<string> expected;
+  for (int i = 1; i < n; i += 2) {
+    expected.insert(keyOf(i));
+  }
+  EXPECT_EQ(tree.OutPutAllTheKeys(NneedOutput),
+            vector<string>(expected.begin(), expected.end()));
+  for (int i = 0; i < n; ++i) {
+    ASSERT_EQ(tree.B_Plus_Tree_Search(keyOf(i)).has_value(), i % 2 == 1)
+        << keyOf(i);
+  }
+}
+
+TEST(BULK_LOAD, bulk_load_test) {
+  for (int degree : {3, 4, 5, 10}) {
+    for (double fillFactor : {1.0, 0.5}) {
+      vector<pair<int, uint64_t>> data;
+      for (int i = 0; i < 2000; ++i) {
+        data.push_back(make_pair(i * 2, i));
+      }
+      BPlusTree<int> tree(degree, "testTree", data.begin(), data.end(),
+                          fillFactor);
+      vector<int> keys = tree.OutPutAllTheKeys(NneedOutput);
+      ASSERT_EQ(keys.size(), data.size()) << "bulk load size";
+      for (int i = 0; i < 2000; ++i) {
+        ASSERT_EQ(tree.B_Plus_Tree_Search(i * 2).value_or(-1), i);
+        ASSERT_FALSE(tree.B_Plus_Tree_Search(i * 2 + 1).has_value());
+      }
+      //建好的树能继续增删
+      for (int i = 0; i < 2000; ++i) {
+        tree.B_Plus_Tree_Insert(make_pair(i * 2 + 1, i));
+      }
+      for (int i = 0; i < 4000; i += 3) {
+        tree.B_Plus_Tree_Delete(i);
+      }
+      vector<int> ans;
+      for (int i = 0; i < 4000; ++i) {
+        if (i % 3) {
+          ans.push_back(i);
+        }
+      }
+      ASSERT_EQ(tree.OutPutAllTheKeys(NneedOutput), ans)
+          << "insert and delete after bulk load";
+    }
+  }
+  vector<pair<int, uint64_t>> unsorted;
+  for (int i = 0; i < 1000; ++i) {
+    unsorted.push_back(make_pair((i * 7919) % 1000, i));
+  }
+  BPlusTree<int> tree(4, "testTree", unsorted.begin(), unsorted.end(), 1.0,
+                      true);
+  vector<int> ans(1000);
+  iota(ans.begin(), ans.end(), 0);
+  EXPECT_EQ(tree.OutPutAllTheKeys(NneedOutput), ans) << "bulk load with sort";
+  EXPECT_FALSE(tree.B_Plus_Tree_Bulk_Load(unsorted.begin(), unsorted.end()))
+      << "reject unsorted input";
+  EXPECT_EQ(tree.OutPutAllTheKeys(NneedOutput), ans) << "tree unchanged";
+
+  //相同关键字都保留，和逐个插入的结果一样
+  vector<pair<int, uint64_t>> equal;
+  for (int i = 0; i < 1000; ++i) {
+    equal.push_back(make_pair(i % 10 ? i / 3 : 0, i));
+  }
+  BPlusTree<int> inserted(4, "testTree");
+  for (auto& kv : equal) {
+    inserted.B_Plus_Tree_Insert(kv);
+  }
+  ASSERT_TRUE(
+      tree.B_Plus_Tree_Bulk_Load(equal.begin(), equal.end(), 1.0, true));
+  EXPECT_EQ(tree.OutPutAllTheKeys(NneedOutput),
+            inserted.OutPutAllTheKeys(NneedOutput))
+      << "bulk load keeps equal keys";
+}
+
+TEST(BULK_LOAD, parallel_bulk_load_test) {
+  vector<pair<int, uint64_t>> data;
+  for (int i = 0; i < 100000; ++i) {
+    data.push_back(make_pair(i / 2, i));
+  }
+  vector<int> ans(100000);
+  for (int i = 0; i < 100000; ++i) {
+    ans[i] = i / 2;
+  }
+  for (int degree : {3, 4, 10}) {
+    BPlusTree<int> tree(degree, "testTree");
+    ASSERT_TRUE(
+        tree.B_Plus_Tree_Bulk_Load_Parallel(data.begin(), data.end(), 4));
+    ASSERT_EQ(tree.OutPutAllTheKeys(NneedOutput), ans)
+        << "parallel bulk load keeps equal keys";
+    for (int i = 0; i < 50000; i += 7) {
+      ASSERT_EQ(tree.B_Plus_Tree_Search(i).value_or(-1) / 2, i);
+    }
+    for (int i = 0; i < 50000; i += 2) {
+      tree.B_Plus_Tree_Delete(i);
+    }
+    EXPECT_EQ(tree.OutPutAllTheKeys(NneedOutput).size(), 75000)
+        << "delete after parallel bulk load";
+  }
+  swap(data[100], data[60000]);
+  BPlusTree<int> tree(4, "testTree");
+  EXPECT_FALSE(tree.B_Plus_Tree_Bulk_Load_Parallel(data.begin(), data.end(), 4))
+      << "reject unsorted input";
+  EXPECT_TRUE(tree.OutPutAllTheKeys(NneedOutput).empty());
+}
+
+TEST(STATIC_DEGREE, static_degree_test) {
+  //编译期度数的树和同样度数的运行时树结构完全一样
+  for (int round = 0; round < 2; ++round) {
+    BPlusTree<int, 5> fixed(round ? 0 : 5, "fixed");
+    BPlusTree<int> dynamic(5, "dynamic");
+    EXPECT_EQ(fixed.getMAX_SIZE(), 5) << "degree comes from the template";
+    mt19937 gen(round);
+    for (int i = 0; i < 3000; ++i) {
+      int k = gen() % 2000;
+      fixed.B_Plus_Tree_Insert(make_pair(k, k));
+      dynamic.B_Plus_Tree_Insert(make_pair(k, k));
+    }
+    for (int i = 0; i < 2000; ++i) {
+      int k = gen() % 2000;
+      fixed.B_Plus_Tree_Delete(k);
+      dynamic.B_Plus_Tree_Delete(k);
+    }
+    ASSERT_EQ(fixed.BFS(NneedOutput), dynamic.BFS(NneedOutput));
+    ASSERT_EQ(fixed.OutPutAllTheKeys(NneedOutput),
+              dynamic.OutPutAllTheKeys(NneedOutput));
+    for (int k = 0; k < 2000; ++k) {
+      ASSERT_EQ(fixed.B_Plus_Tree_Search(k), dynamic.B_Plus_Tree_Search(k));
+    }
+  }
+  //紧凑格式和运行时度数的树互通
+  string path = "./testTree.bpt";
+  vector<pair<int, uint64_t>> data;
+  for (int i = 0; i < 1000; ++i) {
+    data.push_back(make_pair(i, i));
+  }
+  BPlusTree<int, 4> fixed(0, "fixed", data.begin(), data.end());
+  ASSERT_TRUE(fixed.B_Plus_Tree_Save_Compact(path));
+  BPlusTree<int> dynamic(4, "dynamic");
+  ASSERT_TRUE(dynamic.B_Plus_Tree_Load_Compact(path));
+  EXPECT_EQ(fixed.BFS(NneedOutput), dynamic.BFS(NneedOutput));
+  BPlusTree<int, 5> otherDegree;
+  EXPECT_FALSE(otherDegree.B_Plus_Tree_Load_Compact(path)) << "degree mismatch";
+  remove(path.c_str());
+}
+
 int main() {
   GOOGLE_PROTOBUF_VERIFY_VERSION;
   testing::InitGoogleTest();
   google::protobuf::ShutdownProtobufLibrary();
   return RUN_ALL_TESTS();
-}
\ No newline at end of file
+}